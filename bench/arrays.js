@@ -0,0 +1,21 @@
+// Fills a 1M-element numeric array, then sums it four times. Prints the
+// number of element reads and writes.
+let size = 1000000;
+let a = [];
+let i = 0;
+while (i < size) {
+    a[i] = i * 0.5;
+    i = i + 1;
+}
+let sum = 0;
+let pass = 0;
+while (pass < 4) {
+    i = 0;
+    while (i < size) {
+        sum = sum + a[i];
+        i = i + 1;
+    }
+    pass = pass + 1;
+}
+print(sum);
+print(size * 5);
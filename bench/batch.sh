@@ -0,0 +1,33 @@
+#!/bin/sh
+# Run many small generated scripts one process each, then as one batch,
+# and report scripts per second for both.
+# usage: bench/batch.sh [scripts] [threads]
+
+BIN=${BIN:-build/mini_js}
+COUNT=${1:-2000}
+THREADS=${2:-$(nproc)}
+DIR=$(mktemp -d /tmp/batch_bench.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$COUNT" ]; do
+    cat > "$DIR/s$i.js" <<JS
+function fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }
+let point = {x: $i, y: $i * 2};
+print(fib(12) + point.x + point.y);
+JS
+    echo "$DIR/s$i.js" >> "$DIR/list.txt"
+    i=$((i + 1))
+done
+
+start=$(date +%s.%N)
+while read -r f; do "$BIN" "$f" > /dev/null || exit 1; done < "$DIR/list.txt"
+end=$(date +%s.%N)
+awk -v n="$COUNT" -v s="$start" -v t="$end" \
+    'BEGIN { d = t - s; printf "%-24s %-4s %8.3f s %14.0f scripts/s\n", "bench/batch.sh", "proc", d, n / d }'
+
+start=$(date +%s.%N)
+"$BIN" --batch "$DIR/list.txt" -j "$THREADS" > /dev/null 2>&1 || exit 1
+end=$(date +%s.%N)
+awk -v n="$COUNT" -v s="$start" -v t="$end" -v j="$THREADS" \
+    'BEGIN { d = t - s; printf "%-24s %-4s %8.3f s %14.0f scripts/s\n", "bench/batch.sh", "j" j, d, n / d }'
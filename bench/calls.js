@@ -0,0 +1,26 @@
+// Function call throughput. Prints the number of calls made.
+function add(a, b) {
+    return a + b;
+}
+
+function count(n) {
+    if (n == 0) {
+        return 0;
+    }
+    return 1 + count(n - 1);
+}
+
+let total = 0;
+let i = 0;
+while (i < 3000000) {
+    total = add(total, i);
+    i = i + 1;
+}
+
+let j = 0;
+while (j < 3000) {
+    total = total + count(500);
+    j = j + 1;
+}
+
+print(3000000 + 3000 * 501);
@@ -0,0 +1,16 @@
+// Loops full of constant expressions and disabled debug checks, the code
+// the AST optimizer folds away. Prints the number of iterations.
+let debug = false;
+let total = 0;
+let i = 0;
+while (i < 2000000) {
+    total = total + 60 * 60 * 24 - 86400 + -1 * -1;
+    if (false) {
+        print("iteration " + i);
+    }
+    if (1 < 2 && !false) {
+        total = total - 1;
+    }
+    i = i + 1;
+}
+print(2000000);
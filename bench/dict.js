@@ -0,0 +1,17 @@
+// Objects used as maps: 1M inserts under distinct computed keys, then
+// reads of every key. Prints the number of inserts.
+let map = {};
+let i = 0;
+while (i < 1000000) {
+    map["k" + i] = i;
+    i = i + 1;
+}
+
+let sum = 0;
+i = 0;
+while (i < 1000000) {
+    sum = sum + map["k" + i];
+    i = i + 1;
+}
+
+print(1000000);
@@ -0,0 +1,28 @@
+// Tight loops of small instructions, where dispatch dominates: counters
+// compared and stepped by constants, in globals and in a function's
+// locals. Prints the number of loop iterations.
+let i = 0;
+let odd = 0;
+while (i < 2000000) {
+    if (i > 1000000) {
+        odd = odd + 1;
+    }
+    i = i + 1;
+}
+
+function countdown(n) {
+    let steps = 0;
+    while (n > 0) {
+        n = n - 1;
+        steps = steps + 1;
+    }
+    return steps;
+}
+
+let total = 0;
+let round = 0;
+while (round < 20) {
+    total = total + countdown(100000);
+    round = round + 1;
+}
+print(i + total);
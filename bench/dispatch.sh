@@ -0,0 +1,25 @@
+#!/bin/sh
+# Build the VM with each dispatch strategy and time the same scripts:
+# switch or computed goto, with or without super-instructions.
+# usage: bench/dispatch.sh [benchmark.js ...]
+
+CC=${CC:-gcc}
+CFLAGS="-std=c99 -O2 -Iinclude -pthread"
+DIR=$(mktemp -d /tmp/dispatch_bench.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+[ $# -eq 0 ] && set -- bench/dispatch.js bench/calls.js
+
+$CC $CFLAGS -DNO_COMPUTED_GOTO -DNO_SUPERINSTRUCTIONS src/*.c -o "$DIR/switch" || exit 1
+$CC $CFLAGS -DNO_COMPUTED_GOTO src/*.c -o "$DIR/switch+super" || exit 1
+$CC $CFLAGS -DNO_SUPERINSTRUCTIONS src/*.c -o "$DIR/goto" || exit 1
+$CC $CFLAGS src/*.c -o "$DIR/goto+super" || exit 1
+
+for f in "$@"; do
+    for variant in switch switch+super goto goto+super; do
+        start=$(date +%s.%N)
+        ops=$("$DIR/$variant" --engine=vm "$f" | tail -n 1) || exit 1
+        end=$(date +%s.%N)
+        awk -v f="$f" -v e="$variant" -v ops="$ops" -v s="$start" -v t="$end" \
+            'BEGIN { d = t - s; printf "%-24s %-12s %8.3f s %14.0f ops/s\n", f, e, d, ops / d }'
+    done
+done
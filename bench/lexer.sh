@@ -0,0 +1,24 @@
+#!/bin/sh
+# Tokenize a large generated script and report identifiers per second.
+# usage: bench/lexer.sh [lines]
+
+BIN=${BIN:-build/mini_js}
+LINES=${1:-200000}
+SRC=$(mktemp /tmp/lexer_bench.XXXXXX)
+trap 'rm -f "$SRC"' EXIT
+
+# Keywords, short and long identifiers, numbers, strings and comments
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "let value_%d = alpha + beta_%d * gamma_coefficient; // update %d\n", i, i % 97, i
+        printf "if (value_%d > limit) { total = total + value_%d; } else { print(\"small\"); }\n", i, i
+        printf "while (false) { try { throw counter; } catch (e) { return true; } finally { x = 1.5; } }\n"
+    }
+}' > "$SRC"
+
+start=$(date +%s.%N)
+ids=$("$BIN" --lex-only "$SRC" | tail -n 1) || exit 1
+end=$(date +%s.%N)
+size=$(wc -c < "$SRC")
+awk -v ids="$ids" -v size="$size" -v s="$start" -v t="$end" \
+    'BEGIN { d = t - s; printf "%-24s %-4s %8.3f s %14.0f ids/s %8.1f MB/s\n", "bench/lexer.sh", "lex", d, ids / d, size / d / 1048576 }'
@@ -0,0 +1,16 @@
+// Property reads on records with many fields, from two object shapes.
+// Prints the number of property reads made.
+let a = {id: 1, name: "a", x: 1, y: 2, z: 3, w: 4, u: 5, v: 6, weight: 2, total: 0};
+let b = {name: "b", id: 2, x: 1, y: 2, z: 3, w: 4, u: 5, v: 6, total: 0, weight: 3};
+
+let sum = 0;
+let i = 0;
+while (i < 500000) {
+    sum = sum + a.weight * a.v + a.total + a.id;
+    sum = sum + b.weight * b.v + b.total + b.id;
+    let p = {x: i, y: sum};
+    sum = sum - p.x;
+    i = i + 1;
+}
+
+print(500000 * 9);
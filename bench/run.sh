@@ -0,0 +1,18 @@
+#!/bin/sh
+# Run the benchmarks with both engines and report operations per second.
+# Every benchmark prints the number of operations it performed last.
+# usage: bench/run.sh [benchmark.js ...]
+# FLAGS is passed to every run, e.g. FLAGS=--no-opt for the unoptimized tree.
+
+BIN=${BIN:-build/mini_js}
+[ $# -eq 0 ] && set -- bench/*.js
+
+for f in "$@"; do
+    for engine in vm ast; do
+        start=$(date +%s.%N)
+        ops=$("$BIN" $FLAGS --engine=$engine "$f" | tail -n 1) || exit 1
+        end=$(date +%s.%N)
+        awk -v f="$f" -v e="$engine" -v ops="$ops" -v s="$start" -v t="$end" \
+            'BEGIN { d = t - s; printf "%-24s %-4s %8.3f s %14.0f ops/s\n", f, e, d, ops / d }'
+    done
+done
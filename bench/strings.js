@@ -0,0 +1,13 @@
+// Builds a 2M-character string by repeated `s = s + x`, then compares it,
+// which needs its flat text. Prints the number of concatenations.
+let s = "";
+let t = "";
+let i = 0;
+while (i < 500000) {
+    s = s + "ab";
+    t = t + "ab";
+    i = i + 1;
+}
+
+let same = s == t;
+print(1000000);
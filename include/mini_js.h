@@ -3,8 +3,14 @@
 
 #include "../src/lexer.h"
 #include "../src/parser.h"
+#include "../src/resolver.h"
+#include "../src/optimize.h"
 #include "../src/ast.h"
 #include "../src/eval.h"
 #include "../src/env.h"
+#include "../src/compiler.h"
+#include "../src/vm.h"
+#include "../src/gc.h"
+#include "../src/isolate.h"
 
 #endif
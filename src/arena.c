@@ -0,0 +1,72 @@
+#include "arena.h"
+#include "util.h"
+#include <stdlib.h>
+
+#define BLOCK_SIZE (32 * 1024)
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+void arena_init(Arena *a) {
+    a->blocks = NULL;
+    a->bytes = 0;
+}
+
+static ArenaBlock *new_block(size_t size) {
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + size);
+    if (!b) fatal("Out of memory");
+    b->next = NULL;
+    b->used = 0;
+    b->size = size;
+    return b;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = ALIGN(size);
+    ArenaBlock *b = a->blocks;
+    if (!b || b->size - b->used < size) {
+        b = new_block(size > BLOCK_SIZE ? size : BLOCK_SIZE);
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    void *p = (char*)b->data + b->used;
+    b->used += size;
+    a->bytes += size;
+    return p;
+}
+
+void arena_reset(Arena *a) {
+    if (!a->blocks) return;
+    ArenaBlock *first = a->blocks;
+    while (first->next) {
+        ArenaBlock *b = first;
+        first = first->next;
+        free(b);
+    }
+    first->used = 0;
+    a->blocks = first;
+    a->bytes = 0;
+}
+
+void arena_adopt(Arena *a, Arena *other) {
+    ArenaBlock *last = other->blocks;
+    if (!last) return;
+    while (last->next) last = last->next;
+    // Behind the block `a` is allocating from
+    if (a->blocks) {
+        last->next = a->blocks->next;
+        a->blocks->next = other->blocks;
+    } else {
+        a->blocks = other->blocks;
+    }
+    a->bytes += other->bytes;
+    other->blocks = NULL;
+    other->bytes = 0;
+}
+
+void arena_free(Arena *a) {
+    while (a->blocks) {
+        ArenaBlock *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    a->bytes = 0;
+}
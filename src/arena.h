@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for memory that is released all at once. Blocks are
+// chained; a request larger than the block size gets a block of its own.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    // Aligned for any type
+    union { double d; void *p; long long l; } data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *blocks;     // newest first
+    size_t bytes;           // handed out so far
+} Arena;
+
+void arena_init(Arena *a);
+void *arena_alloc(Arena *a, size_t size);
+// Release every block but the first, which is kept for reuse
+void arena_reset(Arena *a);
+// Move the blocks of `other` into `a`, leaving `other` empty
+void arena_adopt(Arena *a, Arena *other);
+void arena_free(Arena *a);
+
+#endif
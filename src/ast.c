@@ -1,208 +1,202 @@
 #include "ast.h"
-#include <stdlib.h>
+#include "isolate.h"
+#include "util.h"
 #include <string.h>
 
-static ASTNode *make(NodeType t) {
-    ASTNode *n = malloc(sizeof(ASTNode));
+void ast_use_arena(Arena *a) {
+    current_isolate->ast_arena = a;
+}
+
+void *ast_alloc(size_t size) {
+    Arena *arena = current_isolate->ast_arena;
+    if (!arena) fatal("No AST arena");
+    void *p = arena_alloc(arena, size);
+    memset(p, 0, size);
+    return p;
+}
+
+void *ast_copy(const void *items, size_t size) {
+    if (size == 0) return NULL;
+    void *copy = arena_alloc(current_isolate->ast_arena, size);
+    memcpy(copy, items, size);
+    return copy;
+}
+
+// Allocate a node just large enough for its kind's member of `as`
+#define make(t, member) make_node(t, offsetof(ASTNode, as) + sizeof(((ASTNode*)0)->as.member))
+
+static ASTNode *make_node(NodeType t, size_t size) {
+    ASTNode *n = ast_alloc(size);
     n->type = t;
-    n->left = n->right = NULL;
-    n->condition = n->else_branch = NULL;
-    n->statements = NULL;
-    n->statement_count = 0;
-    n->args = NULL;
-    n->arg_count = 0;
-    n->params = NULL;
-    n->param_count = 0;
-    n->name[0]=0;
-    n->string_value[0]=0;
-    n->number = 0;
-    n->op = 0;
-    n->bool_value = 0;
     return n;
 }
 
+static void init_var(VarRef *var, const char *name) {
+    var->name = name;
+    var->depth = DEPTH_UNRESOLVED;
+    var->slot = 0;
+}
+
 ASTNode *new_number(double v) {
-    ASTNode *n = make(NODE_NUMBER);
-    n->number = v;
+    ASTNode *n = make(NODE_NUMBER, number);
+    n->as.number = v;
     return n;
 }
 
 ASTNode *new_string(const char *s) {
-    ASTNode *n = make(NODE_STRING);
-    strncpy(n->string_value, s, 255);
+    ASTNode *n = make(NODE_STRING, string);
+    n->as.string = s;
     return n;
 }
 
 ASTNode *new_var(const char *name) {
-    ASTNode *n = make(NODE_VAR);
-    strncpy(n->name, name, 255);
+    ASTNode *n = make(NODE_VAR, var);
+    init_var(&n->as.var, name);
     return n;
 }
 
-ASTNode *new_binop(char op, ASTNode *l, ASTNode *r) {
-    ASTNode *n = make(NODE_BINOP);
-    n->op = op;
-    n->left = l; n->right = r;
+static ASTNode *new_binary(NodeType t, int op, ASTNode *l, ASTNode *r) {
+    ASTNode *n = make(t, binary);
+    n->as.binary.op = op;
+    n->as.binary.left = l;
+    n->as.binary.right = r;
     return n;
 }
 
+ASTNode *new_binop(ArithOp op, ASTNode *l, ASTNode *r) {
+    return new_binary(NODE_BINOP, op, l, r);
+}
+
 ASTNode *new_assign(const char *name, ASTNode *expr) {
-    ASTNode *n = make(NODE_ASSIGN);
-    strncpy(n->name, name, 63);
-    n->left = expr;
+    ASTNode *n = make(NODE_ASSIGN, assign);
+    init_var(&n->as.assign.var, name);
+    n->as.assign.value = expr;
     return n;
 }
 
-ASTNode *new_print(ASTNode *expr) {
-    ASTNode *n = make(NODE_PRINT);
-    n->left = expr;
+ASTNode *new_declaration(const char *name, ASTNode *expr) {
+    ASTNode *n = new_assign(name, expr);
+    n->as.assign.is_decl = DECL_LET;
     return n;
 }
 
-ASTNode *new_boolean(int value) {
-    ASTNode *n = make(NODE_BOOLEAN);
-    n->bool_value = value;
+ASTNode *new_function_declaration(const char *name, ASTNode *function) {
+    ASTNode *n = new_assign(name, function);
+    n->as.assign.is_decl = DECL_FUNCTION;
     return n;
 }
 
-ASTNode *new_comparison(char *op, ASTNode *l, ASTNode *r) {
-    ASTNode *n = make(NODE_COMPARISON);
-    strncpy(n->name, op, 63);
-    n->left = l;
-    n->right = r;
+static ASTNode *new_unary(NodeType t, ASTNode *operand) {
+    ASTNode *n = make(t, operand);
+    n->as.operand = operand;
     return n;
 }
 
-ASTNode *new_logical(char *op, ASTNode *l, ASTNode *r) {
-    ASTNode *n = make(NODE_LOGICAL);
-    strncpy(n->name, op, 63);
-    n->left = l;
-    n->right = r;
+ASTNode *new_print(ASTNode *expr) {
+    return new_unary(NODE_PRINT, expr);
+}
+
+ASTNode *new_boolean(int value) {
+    ASTNode *n = make(NODE_BOOLEAN, boolean);
+    n->as.boolean = value;
     return n;
 }
 
+ASTNode *new_comparison(CompareOp op, ASTNode *l, ASTNode *r) {
+    return new_binary(NODE_COMPARISON, op, l, r);
+}
+
+ASTNode *new_logical(LogicalOp op, ASTNode *l, ASTNode *r) {
+    return new_binary(NODE_LOGICAL, op, l, r);
+}
+
 ASTNode *new_if(ASTNode *condition, ASTNode *then_branch, ASTNode *else_branch) {
-    ASTNode *n = make(NODE_IF);
-    n->condition = condition;
-    n->left = then_branch;
-    n->else_branch = else_branch;
+    ASTNode *n = make(NODE_IF, branch);
+    n->as.branch.condition = condition;
+    n->as.branch.body = then_branch;
+    n->as.branch.else_branch = else_branch;
     return n;
 }
 
 ASTNode *new_while(ASTNode *condition, ASTNode *body) {
-    ASTNode *n = make(NODE_WHILE);
-    n->condition = condition;
-    n->left = body;
+    ASTNode *n = make(NODE_WHILE, branch);
+    n->as.branch.condition = condition;
+    n->as.branch.body = body;
     return n;
 }
 
 ASTNode *new_block(ASTNode **statements, int count) {
-    ASTNode *n = make(NODE_BLOCK);
-    n->statements = statements;
-    n->statement_count = count;
+    ASTNode *n = make(NODE_BLOCK, list);
+    n->as.list.items = statements;
+    n->as.list.count = count;
     return n;
 }
 
 ASTNode *new_function(char **params, int param_count, ASTNode *body) {
-    ASTNode *n = make(NODE_FUNCTION);
-    n->params = params;
-    n->param_count = param_count;
-    n->left = body;
+    ASTNode *n = make(NODE_FUNCTION, function);
+    n->as.function.params = params;
+    n->as.function.param_count = param_count;
+    n->as.function.body = body;
     return n;
 }
 
 ASTNode *new_call(const char *name, ASTNode **args, int arg_count) {
-    ASTNode *n = make(NODE_CALL);
-    strncpy(n->name, name, 255);
-    n->args = args;
-    n->arg_count = arg_count;
+    ASTNode *n = make(NODE_CALL, call);
+    init_var(&n->as.call.var, name);
+    n->as.call.args = args;
+    n->as.call.arg_count = arg_count;
     return n;
 }
 
 ASTNode *new_return(ASTNode *expr) {
-    ASTNode *n = make(NODE_RETURN);
-    n->left = expr;
-    return n;
+    return new_unary(NODE_RETURN, expr);
 }
 
 ASTNode *new_array(ASTNode **elements, int count) {
-    ASTNode *n = make(NODE_ARRAY);
-    n->args = elements;  // Reusing args field
-    n->arg_count = count;
+    ASTNode *n = make(NODE_ARRAY, list);
+    n->as.list.items = elements;
+    n->as.list.count = count;
     return n;
 }
 
 ASTNode *new_object(char **keys, ASTNode **values, int count) {
-    ASTNode *n = make(NODE_OBJECT);
-    n->params = keys;  // Reusing params field
-    n->args = values;
-    n->param_count = count;
+    ASTNode *n = make(NODE_OBJECT, object);
+    n->as.object.keys = keys;
+    n->as.object.values = values;
+    n->as.object.count = count;
     return n;
 }
 
 ASTNode *new_index(ASTNode *object, ASTNode *index) {
-    ASTNode *n = make(NODE_INDEX);
-    n->left = object;
-    n->right = index;
+    ASTNode *n = make(NODE_INDEX, index);
+    n->as.index.object = object;
+    n->as.index.index = index;
     return n;
 }
 
 ASTNode *new_member(ASTNode *object, const char *member) {
-    ASTNode *n = make(NODE_MEMBER);
-    n->left = object;
-    strncpy(n->name, member, 255);
+    ASTNode *n = make(NODE_MEMBER, member);
+    n->as.member.object = object;
+    n->as.member.name = member;
+    return n;
+}
+
+ASTNode *new_property_assign(ASTNode *target, ASTNode *value) {
+    ASTNode *n = make(NODE_PROPERTY_ASSIGN, property);
+    n->as.property.target = target;
+    n->as.property.value = value;
     return n;
 }
 
 ASTNode *new_try(ASTNode *try_block, const char *catch_param, ASTNode *catch_block, ASTNode *finally_block) {
-    ASTNode *n = make(NODE_TRY);
-    n->try_block = try_block;
-    n->catch_block = catch_block;
-    n->finally_block = finally_block;
-    if (catch_param) {
-        strncpy(n->catch_param, catch_param, 255);
-    } else {
-        n->catch_param[0] = '\0';
-    }
+    ASTNode *n = make(NODE_TRY, try_stmt);
+    n->as.try_stmt.try_block = try_block;
+    n->as.try_stmt.catch_block = catch_block;
+    n->as.try_stmt.finally_block = finally_block;
+    n->as.try_stmt.catch_param = catch_param ? catch_param : "";
     return n;
 }
 
 ASTNode *new_throw(ASTNode *expr) {
-    ASTNode *n = make(NODE_THROW);
-    n->left = expr;
-    return n;
-}
-
-void free_ast(ASTNode *n) {
-    if (!n) return;
-    free_ast(n->left);
-    free_ast(n->right);
-    free_ast(n->condition);
-    free_ast(n->else_branch);
-    free_ast(n->try_block);
-    free_ast(n->catch_block);
-    free_ast(n->finally_block);
-    if (n->statements) {
-        for (int i = 0; i < n->statement_count; i++) {
-            free_ast(n->statements[i]);
-        }
-        free(n->statements);
-    }
-    if (n->args) {
-        for (int i = 0; i < n->arg_count; i++) {
-            free_ast(n->args[i]);
-        }
-        free(n->args);
-    }
-    if (n->params) {
-        for (int i = 0; i < n->param_count; i++) {
-            if (n->type == NODE_OBJECT || n->type == NODE_FUNCTION) {
-                free(n->params[i]);
-            }
-        }
-        if (n->type == NODE_OBJECT || n->type == NODE_FUNCTION) {
-            free(n->params);
-        }
-    }
-    free(n);
+    return new_unary(NODE_THROW, expr);
 }
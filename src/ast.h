@@ -1,6 +1,9 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stddef.h>
+#include "arena.h"
+
 typedef enum {
     NODE_NUMBER,
     NODE_STRING,
@@ -22,44 +25,154 @@ typedef enum {
     NODE_INDEX,
     NODE_MEMBER,
     NODE_TRY,
-    NODE_THROW
+    NODE_THROW,
+    NODE_PROPERTY_ASSIGN
 } NodeType;
 
+// Operators of NODE_BINOP, NODE_COMPARISON and NODE_LOGICAL. The first
+// two are implemented by value_arith and value_compare (value.h).
+typedef enum {
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_MUL,
+    ARITH_DIV
+} ArithOp;
+
+typedef enum {
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_GT,
+    CMP_LE,
+    CMP_GE
+} CompareOp;
+
+typedef enum {
+    LOGIC_AND,
+    LOGIC_OR,
+    LOGIC_NOT
+} LogicalOp;
+
 typedef struct ASTNode ASTNode;
 
+// A variable reference; depth and slot are filled in by the resolver
+// (resolver.c)
+typedef struct {
+    const char *name;
+    int depth;          // scopes to walk up, or DEPTH_GLOBAL
+    int slot;           // slot in that scope or in the global table
+} VarRef;
+
+// Nodes only carry the fields of their kind: each is allocated with the
+// size of its member of `as`. Nodes, names and child arrays all live in
+// the arena that was current when the tree was built.
 struct ASTNode {
     NodeType type;
-    ASTNode *left;
-    ASTNode *right;
-    ASTNode *condition;
-    ASTNode *else_branch;
-    ASTNode **statements;
-    int statement_count;
-    ASTNode **args;
-    int arg_count;
-    char **params;
-    int param_count;
-    char name[256];
-    char string_value[256];
-    double number;
-    char op;
-    int bool_value;
-    // For try-catch-finally
-    ASTNode *try_block;
-    ASTNode *catch_block;
-    ASTNode *finally_block;
-    char catch_param[256];
+    union {
+        double number;                      // NODE_NUMBER
+        const char *string;                 // NODE_STRING
+        int boolean;                        // NODE_BOOLEAN
+        VarRef var;                         // NODE_VAR
+        struct {                            // NODE_ASSIGN
+            VarRef var;
+            ASTNode *value;
+            int is_decl;                    // DECL_LET or DECL_FUNCTION; 0 for assignment
+        } assign;
+        struct {                            // NODE_CALL
+            VarRef var;
+            ASTNode **args;
+            int arg_count;
+        } call;
+        struct {                            // NODE_BINOP, NODE_COMPARISON, NODE_LOGICAL
+            ASTNode *left;
+            ASTNode *right;                 // NULL for `!`
+            int op;                         // ArithOp, CompareOp or LogicalOp
+        } binary;
+        ASTNode *operand;                   // NODE_PRINT, NODE_RETURN, NODE_THROW
+        struct {                            // NODE_IF, NODE_WHILE
+            ASTNode *condition;
+            ASTNode *body;                  // then branch or loop body
+            ASTNode *else_branch;           // NODE_IF only
+        } branch;
+        struct {                            // NODE_BLOCK, NODE_ARRAY
+            ASTNode **items;
+            int count;
+        } list;
+        struct {                            // NODE_FUNCTION
+            char **params;
+            int param_count;
+            ASTNode *body;                  // NULL until parsed when lazy
+            int unparsed_body;              // token index of a lazy body, 0 once parsed
+            int known_globals;              // for resolving a lazy body (resolver)
+            int local_count;                // call scope size (resolver)
+            int has_closure;                // a function literal inside may capture it
+        } function;
+        struct {                            // NODE_OBJECT
+            char **keys;
+            ASTNode **values;
+            int count;
+            // One inline cache per property, allocated by the tree walker
+            // on first evaluation
+            struct PropertyCache *caches;
+        } object;
+        struct {                            // NODE_INDEX
+            ASTNode *object;
+            ASTNode *index;
+        } index;
+        struct {                            // NODE_MEMBER
+            ASTNode *object;
+            const char *name;
+            struct PropertyCache *cache;    // as for NODE_OBJECT
+        } member;
+        struct {                            // NODE_PROPERTY_ASSIGN
+            ASTNode *target;                // NODE_MEMBER or NODE_INDEX
+            ASTNode *value;
+        } property;
+        struct {                            // NODE_TRY
+            ASTNode *try_block;
+            ASTNode *catch_block;
+            ASTNode *finally_block;
+            const char *catch_param;        // "" when unnamed
+            int local_count;                // catch scope size (resolver)
+            int has_closure;
+        } try_stmt;
+    } as;
 };
 
+// A whole script, parsed before any of it runs (parse_program)
+typedef struct {
+    ASTNode **statements;       // top-level statements in the order they run
+    int count;
+    int function_count;         // leading statements that are hoisted function declarations
+} Program;
+
+#define DECL_LET 1
+#define DECL_FUNCTION 2
+
+#define DEPTH_GLOBAL (-1)
+#define DEPTH_UNRESOLVED (-2)
+
+// The arena the constructors below allocate from, set per isolate. It must outlive every
+// use of the trees built in it, including function values that keep a
+// body from it (tree walker).
+void ast_use_arena(Arena *arena);
+// Zeroed memory and copies from the current arena
+void *ast_alloc(size_t size);
+void *ast_copy(const void *items, size_t size);
+
+// Constructors keep the names and strings they are given; the parser
+// passes copies made in the arena.
 ASTNode *new_number(double v);
 ASTNode *new_string(const char *s);
 ASTNode *new_var(const char *name);
-ASTNode *new_binop(char op, ASTNode *l, ASTNode *r);
+ASTNode *new_binop(ArithOp op, ASTNode *l, ASTNode *r);
 ASTNode *new_assign(const char *name, ASTNode *expr);
+ASTNode *new_declaration(const char *name, ASTNode *expr);
+ASTNode *new_function_declaration(const char *name, ASTNode *function);
 ASTNode *new_print(ASTNode *expr);
 ASTNode *new_boolean(int value);
-ASTNode *new_comparison(char *op, ASTNode *l, ASTNode *r);
-ASTNode *new_logical(char *op, ASTNode *l, ASTNode *r);
+ASTNode *new_comparison(CompareOp op, ASTNode *l, ASTNode *r);
+ASTNode *new_logical(LogicalOp op, ASTNode *l, ASTNode *r);
 ASTNode *new_if(ASTNode *condition, ASTNode *then_branch, ASTNode *else_branch);
 ASTNode *new_while(ASTNode *condition, ASTNode *body);
 ASTNode *new_block(ASTNode **statements, int count);
@@ -70,8 +183,8 @@ ASTNode *new_array(ASTNode **elements, int count);
 ASTNode *new_object(char **keys, ASTNode **values, int count);
 ASTNode *new_index(ASTNode *object, ASTNode *index);
 ASTNode *new_member(ASTNode *object, const char *member);
+ASTNode *new_property_assign(ASTNode *target, ASTNode *value);
 ASTNode *new_try(ASTNode *try_block, const char *catch_param, ASTNode *catch_block, ASTNode *finally_block);
 ASTNode *new_throw(ASTNode *expr);
-void free_ast(ASTNode *n);
 
 #endif
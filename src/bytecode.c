@@ -0,0 +1,148 @@
+#include "bytecode.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+void init_chunk(Chunk *c) {
+    c->code = NULL;
+    c->count = 0;
+    c->capacity = 0;
+    c->constants = NULL;
+    c->const_count = 0;
+    c->const_capacity = 0;
+    c->const_index = NULL;
+    c->const_index_capacity = 0;
+    c->functions = NULL;
+    c->func_count = 0;
+    c->func_capacity = 0;
+    c->caches = NULL;
+    c->cache_count = 0;
+    c->cache_capacity = 0;
+}
+
+void free_chunk(Chunk *c) {
+    // Constants are heap cells owned by the collector. Code with no
+    // capacity is borrowed from a mapped cache entry (cache.c).
+    if (c->capacity) free(c->code);
+    free(c->constants);
+    free(c->const_index);
+    for (int i = 0; i < c->func_count; i++) {
+        free_func_proto(c->functions[i]);
+    }
+    free(c->functions);
+    free(c->caches);
+    init_chunk(c);
+}
+
+void chunk_write(Chunk *c, uint8_t byte) {
+    if (c->count >= c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 64;
+        c->code = realloc(c->code, c->capacity);
+        if (!c->code) fatal("Out of memory");
+    }
+    c->code[c->count++] = byte;
+}
+
+void chunk_write_short(Chunk *c, int value) {
+    chunk_write(c, value & 0xff);
+    chunk_write(c, (value >> 8) & 0xff);
+}
+
+static uint32_t constant_hash(Value v) {
+    if (IS_STRING(v)) return string_hash((ObjString*)AS_OBJ(v));
+    return hash_bytes((const char*)&v, sizeof(v));
+}
+
+static int same_constant(Value a, Value b) {
+    if (IS_NUMBER(a)) return a == b;
+    return IS_STRING(b) && strcmp(AS_STRING(a), AS_STRING(b)) == 0;
+}
+
+// Rebuilds the index over every constant, including ones a cache entry
+// stored directly without going through chunk_add_constant
+static void grow_const_index(Chunk *c) {
+    free(c->const_index);
+    if (c->const_index_capacity == 0) c->const_index_capacity = 32;
+    while (c->const_index_capacity < (c->const_count + 1) * 2) c->const_index_capacity *= 2;
+    c->const_index = malloc(sizeof(int) * c->const_index_capacity);
+    if (!c->const_index) fatal("Out of memory");
+    memset(c->const_index, 0xff, sizeof(int) * c->const_index_capacity);
+
+    unsigned mask = c->const_index_capacity - 1;
+    for (int k = 0; k < c->const_count; k++) {
+        unsigned i = constant_hash(c->constants[k]) & mask;
+        while (c->const_index[i] >= 0) i = (i + 1) & mask;
+        c->const_index[i] = k;
+    }
+}
+
+int chunk_add_constant(Chunk *c, Value v) {
+    // Names and literals repeat a lot; share identical constants
+    if ((c->const_count + 1) * 2 > c->const_index_capacity) grow_const_index(c);
+    unsigned mask = c->const_index_capacity - 1;
+    unsigned i = constant_hash(v) & mask;
+    while (c->const_index[i] >= 0) {
+        if (same_constant(v, c->constants[c->const_index[i]])) return c->const_index[i];
+        i = (i + 1) & mask;
+    }
+
+    if (c->const_count >= 65536) fatal("Too many constants in one chunk");
+    if (c->const_count >= c->const_capacity) {
+        c->const_capacity = c->const_capacity ? c->const_capacity * 2 : 16;
+        c->constants = realloc(c->constants, sizeof(Value) * c->const_capacity);
+        if (!c->constants) fatal("Out of memory");
+    }
+    c->const_index[i] = c->const_count;
+    c->constants[c->const_count] = v;
+    return c->const_count++;
+}
+
+int chunk_add_function(Chunk *c, FuncProto *fn) {
+    if (c->func_count >= 65536) fatal("Too many functions in one chunk");
+    if (c->func_count >= c->func_capacity) {
+        c->func_capacity = c->func_capacity ? c->func_capacity * 2 : 4;
+        c->functions = realloc(c->functions, sizeof(FuncProto*) * c->func_capacity);
+        if (!c->functions) fatal("Out of memory");
+    }
+    c->functions[c->func_count] = fn;
+    return c->func_count++;
+}
+
+int chunk_add_cache(Chunk *c) {
+    if (c->cache_count >= 65536) fatal("Too many property accesses in one chunk");
+    if (c->cache_count >= c->cache_capacity) {
+        c->cache_capacity = c->cache_capacity ? c->cache_capacity * 2 : 4;
+        c->caches = realloc(c->caches, sizeof(PropertyCache) * c->cache_capacity);
+        if (!c->caches) fatal("Out of memory");
+    }
+    memset(&c->caches[c->cache_count], 0, sizeof(PropertyCache));
+    return c->cache_count++;
+}
+
+FuncProto *new_func_proto(char **params, int param_count) {
+    FuncProto *fn = malloc(sizeof(FuncProto));
+    if (!fn) fatal("Out of memory");
+    fn->param_count = param_count;
+    fn->local_count = param_count;
+    fn->has_closure = 1;
+    fn->lazy = NULL;
+    fn->params = param_count ? malloc(sizeof(char*) * param_count) : NULL;
+    if (param_count && !fn->params) fatal("Out of memory");
+    for (int i = 0; i < param_count; i++) {
+        fn->params[i] = malloc(strlen(params[i]) + 1);
+        if (!fn->params[i]) fatal("Out of memory");
+        strcpy(fn->params[i], params[i]);
+    }
+    init_chunk(&fn->chunk);
+    return fn;
+}
+
+void free_func_proto(FuncProto *fn) {
+    if (!fn) return;
+    for (int i = 0; i < fn->param_count; i++) {
+        free(fn->params[i]);
+    }
+    free(fn->params);
+    free_chunk(&fn->chunk);
+    free(fn);
+}
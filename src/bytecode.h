@@ -0,0 +1,100 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdint.h>
+#include "value.h"
+
+// Instruction set of the stack VM. Operands follow the opcode byte and
+// are 16-bit little-endian unless noted otherwise.
+typedef enum {
+    OP_CONST,        // u16 constant index        -> push constant
+    OP_NULL,         //                           -> push null
+    OP_TRUE,         //                           -> push true
+    OP_FALSE,        //                           -> push false
+    OP_POP,          // discard top of stack
+    OP_GET_GLOBAL,   // u16 global slot           -> push variable
+    OP_SET_GLOBAL,   // u16 global slot           pop and store variable
+    OP_GET_LOCAL,    // u16 depth, u16 slot       -> push variable
+    OP_SET_LOCAL,    // u16 depth, u16 slot       pop and store variable
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_NOT,
+    OP_TRUTHY,       // replace top of stack with its truthiness
+    OP_JUMP,         // u16 forward offset
+    OP_JUMP_IF_FALSE,// u16 forward offset, pops the condition
+    OP_LOOP,         // u16 backward offset
+    OP_PRINT,        // print top of stack, leave it in place
+    OP_ARRAY,        // u16 element count         pop elements, push array
+    OP_OBJECT,       //                           -> push empty object
+    OP_INIT_PROP,    // u16 key index, u16 cache  pop value into object below it
+    OP_INDEX,        // pop index and container   -> push element
+    OP_MEMBER,       // u16 name index, u16 cache pop object -> push property
+    OP_SET_INDEX,    // pop value, index and container, store -> push value
+    OP_SET_MEMBER,   // u16 name index, u16 cache pop value and object, store -> push value
+    OP_FUNCTION,     // u16 function index        -> push function value
+    OP_CALL,         // u16 name index, u16 argc  call the function below the arguments
+    OP_RETURN,       // pop return value and leave the current frame
+    OP_PUSH_SCOPE,   // u16 slot count, u16 pooled  pop value into a new catch Env
+    OP_POP_SCOPE,
+    OP_TRY,          // u16 forward offset to the handler
+    OP_POP_TRY,      // discard the innermost handler
+    OP_THROW,        // pop value and raise it as an exception
+    OP_HALT,
+    // Super-instructions: a variable and a constant operand in one
+    // dispatch. The last operand is a u8 CompareOp or ArithOp.
+    OP_GLOBAL_CMP_CONST,   // u16 global slot, u16 constant, u8 op          -> push result
+    OP_LOCAL_CMP_CONST,    // u16 depth, u16 slot, u16 constant, u8 op      -> push result
+    OP_GLOBAL_ARITH_CONST, // u16 global slot, u16 constant, u8 op          -> push result
+    OP_LOCAL_ARITH_CONST   // u16 depth, u16 slot, u16 constant, u8 op      -> push result
+} OpCode;
+
+typedef struct FuncProto FuncProto;
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+    Value *constants;       // numbers, strings and names
+    int const_count;
+    int const_capacity;
+    int *const_index;       // constant position by hash, or -1 for an empty bucket
+    int const_index_capacity;
+    FuncProto **functions;  // nested function literals
+    int func_count;
+    int func_capacity;
+    PropertyCache *caches;  // one per property access site
+    int cache_count;
+    int cache_capacity;
+} Chunk;
+
+struct FuncProto {
+    char **params;
+    int param_count;
+    int local_count;        // slots in a call's Env, parameters first
+    int has_closure;        // the Env may be captured, so it cannot be pooled
+    // A top-level function whose body is parsed and compiled on its first
+    // call (compile_lazy); local_count and has_closure are unknown until then
+    ASTNode *lazy;
+    Chunk chunk;
+};
+
+void init_chunk(Chunk *c);
+void free_chunk(Chunk *c);
+void chunk_write(Chunk *c, uint8_t byte);
+void chunk_write_short(Chunk *c, int value);
+int chunk_add_constant(Chunk *c, Value v);
+int chunk_add_function(Chunk *c, FuncProto *fn);
+int chunk_add_cache(Chunk *c);
+
+FuncProto *new_func_proto(char **params, int param_count);
+void free_func_proto(FuncProto *fn);
+
+#endif
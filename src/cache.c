@@ -0,0 +1,827 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cache.h"
+#include "env.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC 0x43534a4du    // "MJSC" read as a little-endian u32
+#define CACHE_VERSION 2
+#define MAX_NESTING 256
+
+// Every offset is from the start of the file. Records are 4-byte
+// aligned; numbers are copied out, so their alignment does not matter.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint64_t checksum;          // of everything after the header
+    uint32_t size;
+    uint32_t global_count;
+    uint32_t globals;           // u32[global_count] string offsets
+    uint32_t script_count;
+    uint32_t scripts;           // u32[script_count] function offsets
+    uint32_t unused;
+} CacheHeader;
+
+// A string is a u32 length followed by the bytes and a NUL
+
+// A function is this record followed by
+//   u32 params[param_count]        string offsets
+//   u64 constants[const_count]     a double, or STRING_TAG | string offset
+//   u32 functions[func_count]      offsets of nested functions
+//   u8  code[code_length]
+typedef struct {
+    uint16_t param_count;
+    uint16_t local_count;
+    uint32_t has_closure;
+    uint32_t code_length;
+    uint32_t const_count;
+    uint32_t func_count;
+    uint32_t cache_count;
+} CachedFunction;
+
+// Computed NaNs are canonical, so no number constant has these high bits
+#define STRING_TAG 0xffffffff00000000ull
+
+// Where each part of a function record starts
+typedef struct {
+    uint32_t params;
+    uint32_t constants;
+    uint32_t functions;
+    uint32_t code;
+    uint64_t end;
+} Layout;
+
+static Layout layout(const CachedFunction *f, uint32_t offset) {
+    Layout l;
+    l.params = offset + sizeof(CachedFunction);
+    l.constants = l.params + 4 * f->param_count;
+    l.functions = l.constants + 8 * f->const_count;
+    l.code = l.functions + 4 * f->func_count;
+    l.end = (uint64_t)l.code + f->code_length;
+    return l;
+}
+
+// FNV-1a over 8-byte words, with a final mix so that the high bits of
+// each word reach the low bits of the result
+static uint64_t hash64(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, 8);
+        h = (h ^ word) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    h ^= h >> 32;
+    return h;
+}
+
+// Reading. Offsets are checked against the file size before anything is
+// built, so a damaged entry is rejected as a whole and never half run.
+
+static uint32_t get32(const ScriptCache *c, uint32_t offset) {
+    uint32_t v;
+    memcpy(&v, c->data + offset, sizeof(v));
+    return v;
+}
+
+static int in_bounds(const ScriptCache *c, uint32_t offset, uint64_t bytes) {
+    return offset <= c->size && bytes <= c->size - offset;
+}
+
+static int valid_array(const ScriptCache *c, uint32_t offset, uint32_t count, size_t item) {
+    return offset % 4 == 0 && in_bounds(c, offset, (uint64_t)count * item);
+}
+
+static int valid_string(const ScriptCache *c, uint32_t offset) {
+    if (!valid_array(c, offset, 1, sizeof(uint32_t))) return 0;
+    uint32_t length = get32(c, offset);
+    return in_bounds(c, offset + 4, (uint64_t)length + 1) &&
+           c->data[offset + 4 + length] == '\0' &&
+           memchr(c->data + offset + 4, '\0', length) == NULL;
+}
+
+static const char *string_at(const ScriptCache *c, uint32_t offset) {
+    return c->data + offset + 4;
+}
+
+static int valid_string_array(const ScriptCache *c, uint32_t offset, uint32_t count) {
+    if (!valid_array(c, offset, count, sizeof(uint32_t))) return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!valid_string(c, get32(c, offset + 4 * i))) return 0;
+    }
+    return 1;
+}
+
+// An Env the code can see: a function's own, or a catch block's. -1 is
+// the end of the chain, where top-level code starts.
+typedef struct {
+    int parent;
+    int slots;
+    int pooled;
+    int captured;           // a closure is created while it is current
+} Scope;
+
+// What holds on entry to an instruction; height is -1 until a path
+// reaches it
+typedef struct {
+    int height;
+    int scope;
+    int tries;
+} CodeState;
+
+// Shared by the checks of one entry
+typedef struct {
+    const ScriptCache *c;
+    uint32_t global_count;
+    uint8_t *seen;          // a bit per 4-byte offset: function records visited
+    Scope *scopes;
+    int scope_count;
+    int scope_capacity;
+    // Per instruction of the chunk being checked, reused from one chunk
+    // to the next
+    uint8_t *start;         // instruction boundaries
+    CodeState *at;
+    int *pending;
+    uint32_t code_capacity;
+} Verifier;
+
+static int valid_function(Verifier *v, uint32_t offset, int depth) {
+    const ScriptCache *c = v->c;
+    if (depth > MAX_NESTING || !valid_array(c, offset, 1, sizeof(CachedFunction))) return 0;
+    // Each record belongs to one parent, so nothing is loaded twice
+    uint32_t bit = offset / 4;
+    if (v->seen[bit / 8] & (1 << bit % 8)) return 0;
+    v->seen[bit / 8] |= 1 << bit % 8;
+    CachedFunction f;
+    memcpy(&f, c->data + offset, sizeof(f));
+    if (f.param_count > f.local_count || f.const_count > 65536 ||
+        f.func_count > 65536 || f.cache_count > 65536 || f.code_length == 0) {
+        return 0;
+    }
+    Layout l = layout(&f, offset);
+    if (l.end > c->size) return 0;
+    if (!valid_string_array(c, l.params, f.param_count)) return 0;
+    for (uint32_t i = 0; i < f.const_count; i++) {
+        uint64_t k;
+        memcpy(&k, c->data + l.constants + 8 * i, 8);
+        if ((k & STRING_TAG) == STRING_TAG && !valid_string(c, (uint32_t)k)) return 0;
+    }
+    for (uint32_t i = 0; i < f.func_count; i++) {
+        uint32_t nested = get32(c, l.functions + 4 * i);
+        // Nested functions are written first, so offsets only go down
+        if (nested >= offset || !valid_function(v, nested, depth + 1)) return 0;
+    }
+    return 1;
+}
+
+// Code. The VM trusts its operands, so before an entry is accepted every
+// chunk is walked once: each operand must name something that exists and
+// every path through the code must agree on the stack height, the open
+// catch scopes and the open try blocks at each instruction.
+
+// Operand bytes after each opcode
+static const uint8_t operand_bytes[] = {
+    [OP_CONST] = 2, [OP_GET_GLOBAL] = 2, [OP_SET_GLOBAL] = 2,
+    [OP_GET_LOCAL] = 4, [OP_SET_LOCAL] = 4,
+    [OP_JUMP] = 2, [OP_JUMP_IF_FALSE] = 2, [OP_LOOP] = 2,
+    [OP_ARRAY] = 2, [OP_INIT_PROP] = 4, [OP_MEMBER] = 4, [OP_SET_MEMBER] = 4,
+    [OP_FUNCTION] = 2, [OP_CALL] = 4, [OP_PUSH_SCOPE] = 4, [OP_TRY] = 2,
+    [OP_GLOBAL_CMP_CONST] = 5, [OP_LOCAL_CMP_CONST] = 7,
+    [OP_GLOBAL_ARITH_CONST] = 5, [OP_LOCAL_ARITH_CONST] = 7,
+};
+
+typedef struct {
+    Verifier *v;
+    CachedFunction f;
+    Layout l;
+    int base;               // the function's own scope
+    int is_script;
+    int pending_count;
+    int *created;           // scope each nested function is created in
+} CodeCheck;
+
+#define NOT_CREATED (-2)
+
+static int add_scope(Verifier *v, int parent, int slots, int pooled) {
+    if (v->scope_count >= v->scope_capacity) {
+        v->scope_capacity = v->scope_capacity ? v->scope_capacity * 2 : 64;
+        v->scopes = realloc(v->scopes, sizeof(Scope) * v->scope_capacity);
+        if (!v->scopes) fatal("Out of memory");
+    }
+    Scope *s = &v->scopes[v->scope_count];
+    s->parent = parent;
+    s->slots = slots;
+    s->pooled = pooled;
+    s->captured = 0;
+    return v->scope_count++;
+}
+
+static uint16_t code16(const CodeCheck *k, uint32_t pc) {
+    const uint8_t *p = (const uint8_t*)k->v->c->data + k->l.code + pc;
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static int valid_constant(const CodeCheck *k, uint32_t index) {
+    return index < k->f.const_count;
+}
+
+// Names are read as strings
+static int valid_name(const CodeCheck *k, uint32_t index) {
+    if (index >= k->f.const_count) return 0;
+    uint64_t constant;
+    memcpy(&constant, k->v->c->data + k->l.constants + 8 * index, 8);
+    return (constant & STRING_TAG) == STRING_TAG;
+}
+
+static int valid_local(const CodeCheck *k, int scope, uint32_t depth, uint32_t slot) {
+    for (; depth > 0 && scope >= 0; depth--) scope = k->v->scopes[scope].parent;
+    return scope >= 0 && slot < (uint32_t)k->v->scopes[scope].slots;
+}
+
+// Operands that do not depend on the path taken
+static int valid_operands(const CodeCheck *k, uint32_t pc) {
+    uint8_t op = ((const uint8_t*)k->v->c->data)[k->l.code + pc];
+    switch (op) {
+        case OP_CONST:
+            return valid_constant(k, code16(k, pc + 1));
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            return code16(k, pc + 1) < k->v->global_count;
+        case OP_INIT_PROP:
+        case OP_MEMBER:
+        case OP_SET_MEMBER:
+            return valid_name(k, code16(k, pc + 1)) && code16(k, pc + 3) < k->f.cache_count;
+        case OP_FUNCTION:
+            return code16(k, pc + 1) < k->f.func_count;
+        case OP_CALL:
+            return valid_name(k, code16(k, pc + 1));
+        case OP_PUSH_SCOPE:
+            // The thrown value goes in slot 0
+            return code16(k, pc + 1) > 0;
+        case OP_HALT:
+            return k->is_script;
+        case OP_GLOBAL_CMP_CONST:
+        case OP_GLOBAL_ARITH_CONST: {
+            uint8_t last = op == OP_GLOBAL_CMP_CONST ? CMP_GE : ARITH_DIV;
+            return code16(k, pc + 1) < k->v->global_count &&
+                   valid_constant(k, code16(k, pc + 3)) &&
+                   ((const uint8_t*)k->v->c->data)[k->l.code + pc + 5] <= last;
+        }
+        case OP_LOCAL_CMP_CONST:
+        case OP_LOCAL_ARITH_CONST: {
+            uint8_t last = op == OP_LOCAL_CMP_CONST ? CMP_GE : ARITH_DIV;
+            return valid_constant(k, code16(k, pc + 5)) &&
+                   ((const uint8_t*)k->v->c->data)[k->l.code + pc + 7] <= last;
+        }
+        default:
+            return 1;
+    }
+}
+
+// Record that control can reach `target` in state `s`
+static int flow_to(CodeCheck *k, int64_t target, CodeState s) {
+    if (target < 0 || target >= k->f.code_length || !k->v->start[target]) return 0;
+    CodeState *at = &k->v->at[target];
+    if (at->height < 0) {
+        *at = s;
+        k->v->pending[k->pending_count++] = (int)target;
+        return 1;
+    }
+    return at->height == s.height && at->scope == s.scope && at->tries == s.tries;
+}
+
+// Follow one instruction to its successors
+static int step(CodeCheck *k, uint32_t pc) {
+    const uint8_t *code = (const uint8_t*)k->v->c->data + k->l.code;
+    uint8_t op = code[pc];
+    uint32_t next = pc + 1 + operand_bytes[op];
+    CodeState s = k->v->at[pc];
+    int pops = 0, pushes = 0;
+    switch (op) {
+        case OP_CONST: case OP_NULL: case OP_TRUE: case OP_FALSE:
+        case OP_GET_GLOBAL: case OP_OBJECT:
+        case OP_GLOBAL_CMP_CONST: case OP_GLOBAL_ARITH_CONST:
+            pushes = 1;
+            break;
+        case OP_GET_LOCAL:
+        case OP_LOCAL_CMP_CONST:
+        case OP_LOCAL_ARITH_CONST:
+            if (!valid_local(k, s.scope, code16(k, pc + 1), code16(k, pc + 3))) return 0;
+            pushes = 1;
+            break;
+        case OP_SET_LOCAL:
+            if (!valid_local(k, s.scope, code16(k, pc + 1), code16(k, pc + 3))) return 0;
+            pops = 1;
+            break;
+        case OP_POP: case OP_SET_GLOBAL:
+            pops = 1;
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_EQ: case OP_NE: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+        case OP_INDEX: case OP_SET_MEMBER: case OP_INIT_PROP:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_NOT: case OP_TRUTHY: case OP_PRINT: case OP_MEMBER:
+            pops = 1;
+            pushes = 1;
+            break;
+        case OP_SET_INDEX:
+            pops = 3;
+            pushes = 1;
+            break;
+        case OP_ARRAY:
+            pops = code16(k, pc + 1);
+            pushes = 1;
+            break;
+        case OP_CALL:
+            pops = code16(k, pc + 3) + 1;
+            pushes = 1;
+            break;
+        case OP_JUMP:
+            return flow_to(k, (int64_t)next + code16(k, pc + 1), s);
+        case OP_LOOP:
+            return flow_to(k, (int64_t)next - code16(k, pc + 1), s);
+        case OP_JUMP_IF_FALSE:
+            if (s.height < 1) return 0;
+            s.height--;
+            return flow_to(k, (int64_t)next + code16(k, pc + 1), s) && flow_to(k, next, s);
+        case OP_FUNCTION: {
+            uint32_t index = code16(k, pc + 1);
+            // Its code is checked once this chunk's is done
+            if (k->created[index] != NOT_CREATED) return 0;
+            k->created[index] = s.scope;
+            // The new closure keeps every Env it can see alive
+            for (int i = s.scope; i >= 0; i = k->v->scopes[i].parent) {
+                k->v->scopes[i].captured = 1;
+            }
+            pushes = 1;
+            break;
+        }
+        case OP_PUSH_SCOPE:
+            if (s.height < 1) return 0;
+            s.height--;
+            s.scope = add_scope(k->v, s.scope, code16(k, pc + 1), code16(k, pc + 3) != 0);
+            return flow_to(k, next, s);
+        case OP_POP_SCOPE:
+            if (s.scope == k->base) return 0;
+            s.scope = k->v->scopes[s.scope].parent;
+            return flow_to(k, next, s);
+        case OP_TRY: {
+            // The handler starts with the thrown value on the stack
+            CodeState handler = s;
+            handler.height++;
+            s.tries++;
+            return flow_to(k, (int64_t)next + code16(k, pc + 1), handler) && flow_to(k, next, s);
+        }
+        case OP_POP_TRY:
+            if (s.tries == 0) return 0;
+            s.tries--;
+            return flow_to(k, next, s);
+        case OP_THROW:
+            return s.height >= 1;
+        case OP_RETURN:
+            // Leaving the script does not unwind its scopes
+            return s.height >= 1 && s.scope == k->base && s.tries == 0;
+        case OP_HALT:
+            return s.scope == k->base && s.tries == 0;
+        default:
+            return 0;
+    }
+    if (s.height < pops) return 0;
+    s.height += pushes - pops;
+    return flow_to(k, next, s);
+}
+
+// Check the code of the function at `offset`, whose Env's parent is the
+// scope `outer`. Scripts have no Env of their own.
+static int valid_code(Verifier *v, uint32_t offset, int outer, int is_script) {
+    CodeCheck k;
+    k.v = v;
+    memcpy(&k.f, v->c->data + offset, sizeof(k.f));
+    k.l = layout(&k.f, offset);
+    k.is_script = is_script;
+    k.base = is_script ? outer : add_scope(v, outer, k.f.local_count, !k.f.has_closure);
+    uint32_t length = k.f.code_length;
+    if (length > v->code_capacity) {
+        free(v->start);
+        free(v->at);
+        free(v->pending);
+        v->start = malloc(length);
+        v->at = malloc(sizeof(CodeState) * length);
+        v->pending = malloc(sizeof(int) * length);
+        if (!v->start || !v->at || !v->pending) fatal("Out of memory");
+        v->code_capacity = length;
+    }
+    memset(v->start, 0, length);
+    k.pending_count = 0;
+    k.created = NULL;
+    if (k.f.func_count > 0) {
+        k.created = malloc(sizeof(int) * k.f.func_count);
+        if (!k.created) fatal("Out of memory");
+        for (uint32_t i = 0; i < k.f.func_count; i++) k.created[i] = NOT_CREATED;
+    }
+
+    const uint8_t *code = (const uint8_t*)v->c->data + k.l.code;
+    int ok = 1;
+    uint32_t pc = 0;
+    while (pc < length && ok) {
+        ok = code[pc] <= OP_LOCAL_ARITH_CONST &&
+             pc + 1 + operand_bytes[code[pc]] <= length &&
+             valid_operands(&k, pc);
+        v->start[pc] = 1;
+        v->at[pc].height = -1;
+        pc += 1 + (ok ? operand_bytes[code[pc]] : 0);
+    }
+    if (ok) {
+        CodeState entry = { 0, k.base, 0 };
+        ok = flow_to(&k, 0, entry);
+    }
+    while (ok && k.pending_count > 0) {
+        ok = step(&k, v->pending[--k.pending_count]);
+    }
+    for (uint32_t i = 0; i < k.f.func_count && ok; i++) {
+        if (k.created[i] == NOT_CREATED) continue;
+        ok = valid_code(v, get32(v->c, k.l.functions + 4 * i), k.created[i], 0);
+    }
+    free(k.created);
+    return ok;
+}
+
+// Names the isolate already has must be in their slots; the rest must be
+// new and distinct, so reserving them in order gives the following slots
+static int valid_globals(const ScriptCache *c, uint32_t offset, uint32_t count) {
+    uint32_t known = global_count();
+    if (count < known) return 0;
+    for (uint32_t i = 0; i < known; i++) {
+        if (strcmp(string_at(c, get32(c, offset + 4 * i)), global_name(i)) != 0) return 0;
+    }
+    if (count == known) return 1;
+
+    uint32_t capacity = 16;
+    while (capacity < (count - known) * 2) capacity *= 2;
+    uint32_t *seen = malloc(sizeof(uint32_t) * capacity);
+    if (!seen) fatal("Out of memory");
+    memset(seen, 0xff, sizeof(uint32_t) * capacity);
+    int ok = 1;
+    for (uint32_t i = known; i < count && ok; i++) {
+        const char *name = string_at(c, get32(c, offset + 4 * i));
+        if (global_exists(name)) {
+            ok = 0;
+            break;
+        }
+        uint32_t slot = hash_bytes(name, strlen(name)) & (capacity - 1);
+        while (seen[slot] != UINT32_MAX) {
+            if (strcmp(string_at(c, get32(c, offset + 4 * seen[slot])), name) == 0) {
+                ok = 0;
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        seen[slot] = i;
+    }
+    free(seen);
+    return ok;
+}
+
+static int valid_entry(ScriptCache *c) {
+    if (c->size < sizeof(CacheHeader)) return 0;
+    CacheHeader h;
+    memcpy(&h, c->data, sizeof(h));
+    if (h.magic != CACHE_MAGIC || h.version != CACHE_VERSION || h.size != c->size ||
+        h.source_hash != c->source_hash || h.source_length != c->source_length) {
+        return 0;
+    }
+    if (hash64(c->data + sizeof(h), c->size - sizeof(h)) != h.checksum) return 0;
+    if (!valid_string_array(c, h.globals, h.global_count)) return 0;
+    if (!valid_array(c, h.scripts, h.script_count, sizeof(uint32_t))) return 0;
+
+    Verifier v;
+    memset(&v, 0, sizeof(v));
+    v.c = c;
+    v.global_count = h.global_count;
+    v.seen = calloc(c->size / 32 + 1, 1);
+    if (!v.seen) fatal("Out of memory");
+    int ok = 1;
+    for (uint32_t i = 0; i < h.script_count && ok; i++) {
+        ok = valid_function(&v, get32(c, h.scripts + 4 * i), 0);
+    }
+    for (uint32_t i = 0; i < h.script_count && ok; i++) {
+        v.scope_count = 0;
+        ok = valid_code(&v, get32(c, h.scripts + 4 * i), -1, 1);
+        // An Env a closure can capture is never pooled
+        for (int j = 0; j < v.scope_count && ok; j++) {
+            ok = !(v.scopes[j].captured && v.scopes[j].pooled);
+        }
+    }
+    free(v.seen);
+    free(v.scopes);
+    free(v.start);
+    free(v.at);
+    free(v.pending);
+    if (!ok) return 0;
+
+    // Compiled code refers to globals by slot, so the names must get the
+    // same slots in this isolate. Nothing is reserved until the whole
+    // entry has been accepted.
+    if (!valid_globals(c, h.globals, h.global_count)) return 0;
+    for (uint32_t i = 0; i < h.global_count; i++) {
+        global_slot(string_at(c, get32(c, h.globals + 4 * i)));
+    }
+    c->script_count = h.script_count;
+    return 1;
+}
+
+static char *entry_path(const char *dir, uint64_t hash) {
+    size_t length = strlen(dir) + 32;
+    char *path = malloc(length);
+    if (!path) fatal("Out of memory");
+    snprintf(path, length, "%s/%016llx.mjsc", dir, (unsigned long long)hash);
+    return path;
+}
+
+int cache_open(ScriptCache *c, const char *dir, const char *source, size_t length,
+               int optimized) {
+    memset(c, 0, sizeof(*c));
+    c->script_count = -1;
+    c->source_hash = hash64(source, length);
+    // Code compiled with --no-opt gets an entry of its own
+    if (!optimized) c->source_hash = ~c->source_hash;
+    c->source_length = length;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) return 0;
+    c->path = entry_path(dir, c->source_hash);
+
+    int fd = open(c->path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader) ||
+        (uint64_t)st.st_size > UINT32_MAX) {
+        close(fd);
+        return 0;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+    c->data = p;
+    c->size = st.st_size;
+    if (!valid_entry(c)) {
+        munmap((void*)c->data, c->size);
+        c->data = NULL;
+        c->size = 0;
+        c->script_count = -1;
+        return 0;
+    }
+    return 1;
+}
+
+static FuncProto *load_function(ScriptCache *c, uint32_t offset) {
+    CachedFunction f;
+    memcpy(&f, c->data + offset, sizeof(f));
+    Layout l = layout(&f, offset);
+    char **params = malloc(sizeof(char*) * (f.param_count ? f.param_count : 1));
+    if (!params) fatal("Out of memory");
+    for (uint32_t i = 0; i < f.param_count; i++) {
+        params[i] = (char*)string_at(c, get32(c, l.params + 4 * i));
+    }
+    FuncProto *fn = new_func_proto(params, f.param_count);
+    free(params);
+    fn->local_count = f.local_count;
+    fn->has_closure = f.has_closure;
+
+    // Borrowed: a capacity of 0 keeps free_chunk from freeing it
+    Chunk *chunk = &fn->chunk;
+    chunk->code = (uint8_t*)c->data + l.code;
+    chunk->count = f.code_length;
+    for (uint32_t i = 0; i < f.const_count; i++) {
+        uint64_t k;
+        memcpy(&k, c->data + l.constants + 8 * i, 8);
+        double number;
+        memcpy(&number, &k, 8);
+        Value v = (k & STRING_TAG) == STRING_TAG ? new_string_val(string_at(c, (uint32_t)k))
+                                                 : new_number_val(number);
+        // Added directly: chunk_add_constant would merge duplicates and
+        // renumber them
+        if (chunk->const_count >= chunk->const_capacity) {
+            chunk->const_capacity = f.const_count;
+            chunk->constants = malloc(sizeof(Value) * f.const_count);
+            if (!chunk->constants) fatal("Out of memory");
+        }
+        chunk->constants[chunk->const_count++] = v;
+    }
+    for (uint32_t i = 0; i < f.func_count; i++) {
+        chunk_add_function(chunk, load_function(c, get32(c, l.functions + 4 * i)));
+    }
+    for (uint32_t i = 0; i < f.cache_count; i++) {
+        chunk_add_cache(chunk);
+    }
+    return fn;
+}
+
+FuncProto *cache_script(ScriptCache *c, int index) {
+    CacheHeader h;
+    memcpy(&h, c->data, sizeof(h));
+    return load_function(c, get32(c, h.scripts + 4 * index));
+}
+
+// Writing. Records are appended to one buffer and refer to each other by
+// offset; the header is filled in last.
+
+static uint32_t reserve(ScriptCache *c, size_t bytes) {
+    bytes = (bytes + 3) & ~(size_t)3;
+    if (c->length + bytes > UINT32_MAX) fatal("Script too large to cache");
+    if (c->length + bytes > c->capacity) {
+        while (c->length + bytes > c->capacity) {
+            c->capacity = c->capacity ? c->capacity * 2 : 4096;
+        }
+        c->buf = realloc(c->buf, c->capacity);
+        if (!c->buf) fatal("Out of memory");
+    }
+    uint32_t offset = c->length;
+    memset(c->buf + offset, 0, bytes);
+    c->length += bytes;
+    return offset;
+}
+
+static uint32_t append(ScriptCache *c, const void *data, size_t bytes) {
+    uint32_t offset = reserve(c, bytes);
+    memcpy(c->buf + offset, data, bytes);
+    return offset;
+}
+
+// Offset 0 is the header, so it marks an empty entry
+static uint32_t *find_string(ScriptCache *c, const char *s, uint32_t length) {
+    uint32_t mask = c->string_capacity - 1;
+    uint32_t i = hash_bytes(s, length) & mask;
+    while (c->strings[i]) {
+        uint32_t offset = c->strings[i];
+        uint32_t other;
+        memcpy(&other, c->buf + offset, 4);
+        if (other == length && memcmp(c->buf + offset + 4, s, length) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return &c->strings[i];
+}
+
+static uint32_t append_string(ScriptCache *c, const char *s) {
+    uint32_t length = strlen(s);
+    if ((c->string_count + 1) * 2 > c->string_capacity) {
+        uint32_t *old = c->strings;
+        uint32_t old_capacity = c->string_capacity;
+        c->string_capacity = old_capacity ? old_capacity * 2 : 256;
+        c->strings = calloc(c->string_capacity, sizeof(uint32_t));
+        if (!c->strings) fatal("Out of memory");
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (!old[i]) continue;
+            uint32_t old_length;
+            memcpy(&old_length, c->buf + old[i], 4);
+            *find_string(c, c->buf + old[i] + 4, old_length) = old[i];
+        }
+        free(old);
+    }
+    uint32_t *entry = find_string(c, s, length);
+    if (*entry) return *entry;
+
+    uint32_t offset = reserve(c, 4 + length + 1);
+    memcpy(c->buf + offset, &length, 4);
+    memcpy(c->buf + offset + 4, s, length);
+    *entry = offset;
+    c->string_count++;
+    return offset;
+}
+
+static uint32_t append_string_array(ScriptCache *c, const char **strings, int count) {
+    uint32_t *offsets = malloc(sizeof(uint32_t) * (count + 1));
+    if (!offsets) fatal("Out of memory");
+    for (int i = 0; i < count; i++) {
+        offsets[i] = append_string(c, strings[i]);
+    }
+    uint32_t offset = append(c, offsets, sizeof(uint32_t) * count);
+    free(offsets);
+    return offset;
+}
+
+static uint32_t append_function(ScriptCache *c, FuncProto *fn) {
+    Chunk *chunk = &fn->chunk;
+    // Strings and nested functions are written first, while the record's
+    // arrays are gathered here
+    uint32_t *params = malloc(4 * (fn->param_count + chunk->func_count + 1));
+    uint32_t *functions = params + fn->param_count;
+    uint64_t *constants = malloc(8 * (chunk->const_count + 1));
+    if (!params || !constants) fatal("Out of memory");
+    for (int i = 0; i < fn->param_count; i++) {
+        params[i] = append_string(c, fn->params[i]);
+    }
+    for (int i = 0; i < chunk->const_count; i++) {
+        Value v = chunk->constants[i];
+        if (IS_STRING(v)) {
+            constants[i] = STRING_TAG | append_string(c, AS_STRING(v));
+        } else {
+            double number = AS_NUMBER(v);
+            memcpy(&constants[i], &number, 8);
+        }
+    }
+    for (int i = 0; i < chunk->func_count; i++) {
+        functions[i] = append_function(c, chunk->functions[i]);
+    }
+
+    CachedFunction f;
+    memset(&f, 0, sizeof(f));
+    f.param_count = fn->param_count;
+    f.local_count = fn->local_count;
+    f.has_closure = fn->has_closure;
+    f.code_length = chunk->count;
+    f.const_count = chunk->const_count;
+    f.func_count = chunk->func_count;
+    f.cache_count = chunk->cache_count;
+    uint32_t offset = reserve(c, layout(&f, 0).end);
+    Layout l = layout(&f, offset);
+    memcpy(c->buf + offset, &f, sizeof(f));
+    memcpy(c->buf + l.params, params, 4 * f.param_count);
+    memcpy(c->buf + l.constants, constants, 8 * f.const_count);
+    memcpy(c->buf + l.functions, functions, 4 * f.func_count);
+    memcpy(c->buf + l.code, chunk->code, chunk->count);
+    free(params);
+    free(constants);
+    return offset;
+}
+
+void cache_add_script(ScriptCache *c, FuncProto *script) {
+    if (!c->path) return;
+    if (c->length == 0) reserve(c, sizeof(CacheHeader));
+    if (c->added >= c->scripts_capacity) {
+        c->scripts_capacity = c->scripts_capacity ? c->scripts_capacity * 2 : 64;
+        c->scripts = realloc(c->scripts, sizeof(uint32_t) * c->scripts_capacity);
+        if (!c->scripts) fatal("Out of memory");
+    }
+    c->scripts[c->added++] = append_function(c, script);
+}
+
+void cache_save(ScriptCache *c) {
+    if (!c->path) return;
+    if (c->length == 0) reserve(c, sizeof(CacheHeader));
+
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.source_hash = c->source_hash;
+    h.source_length = c->source_length;
+    h.global_count = global_count();
+    const char **names = malloc(sizeof(char*) * (h.global_count ? h.global_count : 1));
+    if (!names) fatal("Out of memory");
+    for (uint32_t i = 0; i < h.global_count; i++) {
+        names[i] = global_name(i);
+    }
+    h.globals = append_string_array(c, names, h.global_count);
+    free(names);
+    h.script_count = c->added;
+    h.scripts = append(c, c->scripts, sizeof(uint32_t) * c->added);
+    h.size = c->length;
+    h.checksum = hash64(c->buf + sizeof(h), c->length - sizeof(h));
+    memcpy(c->buf, &h, sizeof(h));
+
+    // Written under a temporary name and renamed, so readers never see a
+    // partial entry
+    size_t tmp_length = strlen(c->path) + 8;
+    char *tmp = malloc(tmp_length);
+    if (!tmp) fatal("Out of memory");
+    snprintf(tmp, tmp_length, "%sXXXXXX", c->path);
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        size_t written = 0;
+        while (written < c->length) {
+            ssize_t n = write(fd, c->buf + written, c->length - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            written += n;
+        }
+        if (close(fd) != 0 || written < c->length || rename(tmp, c->path) != 0) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+}
+
+void cache_close(ScriptCache *c) {
+    if (c->data) munmap((void*)c->data, c->size);
+    free(c->path);
+    free(c->buf);
+    free(c->scripts);
+    free(c->strings);
+    memset(c, 0, sizeof(*c));
+    c->script_count = -1;
+}
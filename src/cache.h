@@ -0,0 +1,63 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bytecode.h"
+
+// Compiled-script cache. An entry holds the bytecode of each top-level
+// statement of a script, in order, and the global names the resolver
+// reserved for them. It is stored as DIR/<hash>.mjsc, where <hash> is a
+// hash of the source text, so an edited script simply gets a new entry.
+//
+// Entries use offsets from the start of the file instead of pointers and
+// are mapped, not read: loaded functions run the code straight out of
+// the mapping. An entry written by another format version, for other
+// source text or with a bad checksum is ignored and the script is parsed
+// as usual.
+typedef struct {
+    char *path;             // NULL when the directory is unusable
+    uint64_t source_hash;
+    uint64_t source_length;
+
+    // The mapped entry
+    const char *data;
+    size_t size;
+    int script_count;       // statements in the entry; -1 when none was loaded
+
+    // Statements compiled on this run, for cache_save
+    char *buf;
+    size_t length;
+    size_t capacity;
+    uint32_t *scripts;
+    int added;
+    int scripts_capacity;
+    // Open-addressing set of the strings written so far, by offset; each
+    // name or literal is stored once
+    uint32_t *strings;
+    uint32_t string_count;
+    uint32_t string_capacity;
+} ScriptCache;
+
+// Look up the entry for `source` in `dir`, creating the directory if
+// needed. `optimized` says whether the statements go through the AST
+// optimizer; each setting has its own entry. Returns 1 when a valid entry was mapped. Must be called with
+// the isolate the statements will run in current and its globals still
+// empty, as the entry's global slots are reserved here.
+int cache_open(ScriptCache *c, const char *dir, const char *source, size_t length,
+               int optimized);
+// Statement `index` of the mapped entry, ready for vm_run. Its code
+// points into the mapping.
+FuncProto *cache_script(ScriptCache *c, int index);
+
+// Record a statement compiled on this run; call before running it
+void cache_add_script(ScriptCache *c, FuncProto *script);
+// Write the entry for the statements added, replacing any existing one.
+// Failures are ignored: the cache is only an optimization.
+void cache_save(ScriptCache *c);
+
+// Unmap the entry. Code loaded from it must no longer be in use, so this
+// comes after the isolate is freed.
+void cache_close(ScriptCache *c);
+
+#endif
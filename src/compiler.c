@@ -0,0 +1,437 @@
+#include "compiler.h"
+#include "isolate.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+// An enclosing try statement, tracked so that `return` can unwind the
+// handlers it installed and run its finally block before leaving.
+typedef struct TryContext {
+    ASTNode *finally_block;
+    int handlers;       // handlers currently installed by this try
+    int catch_scope;    // 1 while compiling the catch body
+    struct TryContext *outer;
+} TryContext;
+
+typedef struct Compiler {
+    FuncProto *fn;
+    TryContext *tries;
+    struct Compiler *enclosing;
+} Compiler;
+
+static Compiler *current(void) {
+    return current_isolate->compiler.current;
+}
+
+static void set_current(Compiler *c) {
+    current_isolate->compiler.current = c;
+}
+
+static void compile_statement(ASTNode *n);
+static void compile_expr(ASTNode *n);
+
+static Chunk *chunk(void) {
+    return &current()->fn->chunk;
+}
+
+static void emit(uint8_t byte) {
+    chunk_write(chunk(), byte);
+}
+
+static void emit_with_operand(uint8_t op, int operand) {
+    emit(op);
+    chunk_write_short(chunk(), operand);
+}
+
+static int string_constant(const char *s) {
+    return chunk_add_constant(chunk(), new_string_val(s));
+}
+
+static int emit_jump(uint8_t op) {
+    emit_with_operand(op, 0xffff);
+    return chunk()->count - 2;
+}
+
+static void patch_jump(int at) {
+    int offset = chunk()->count - (at + 2);
+    if (offset > 0xffff) fatal("Too much code to jump over");
+    chunk()->code[at] = offset & 0xff;
+    chunk()->code[at + 1] = (offset >> 8) & 0xff;
+}
+
+static void emit_loop(int start) {
+    int offset = chunk()->count + 3 - start;
+    if (offset > 0xffff) fatal("Loop body too large");
+    emit_with_operand(OP_LOOP, offset);
+}
+
+static void emit_variable(uint8_t global_op, uint8_t local_op, VarRef *var) {
+    if (var->depth == DEPTH_UNRESOLVED) fatal("Unresolved variable");
+    if (var->depth == DEPTH_GLOBAL) {
+        emit_with_operand(global_op, var->slot);
+    } else {
+        emit_with_operand(local_op, var->depth);
+        chunk_write_short(chunk(), var->slot);
+    }
+}
+
+static void emit_get(VarRef *var) {
+    emit_variable(OP_GET_GLOBAL, OP_GET_LOCAL, var);
+}
+
+static void emit_set(VarRef *var) {
+    emit_variable(OP_SET_GLOBAL, OP_SET_LOCAL, var);
+}
+
+// `variable op literal` as one super-instruction, as in `i < 100` or
+// `n - 1`. Returns 0 when `n` has another shape. Builds with
+// -DNO_SUPERINSTRUCTIONS never emit them, for comparing dispatch costs.
+static int emit_var_const(ASTNode *n, uint8_t global_op, uint8_t local_op) {
+#ifdef NO_SUPERINSTRUCTIONS
+    (void)n; (void)global_op; (void)local_op;
+    return 0;
+#else
+    ASTNode *left = n->as.binary.left;
+    ASTNode *right = n->as.binary.right;
+    if (left->type != NODE_VAR) return 0;
+    int constant;
+    if (right->type == NODE_NUMBER) {
+        constant = chunk_add_constant(chunk(), new_number_val(right->as.number));
+    } else if (right->type == NODE_STRING) {
+        constant = string_constant(right->as.string);
+    } else {
+        return 0;
+    }
+    emit_variable(global_op, local_op, &left->as.var);
+    chunk_write_short(chunk(), constant);
+    emit(n->as.binary.op);
+    return 1;
+#endif
+}
+
+static void compile_body(FuncProto *fn, ASTNode *n) {
+    if (n->as.function.local_count > 0xffff) fatal("Too many local variables");
+    Compiler c;
+    c.fn = fn;
+    c.fn->local_count = n->as.function.local_count;
+    c.fn->has_closure = n->as.function.has_closure;
+    c.tries = NULL;
+    c.enclosing = current();
+    set_current(&c);
+
+    compile_statement(n->as.function.body);
+    emit(OP_NULL);
+    emit(OP_RETURN);
+
+    set_current(c.enclosing);
+}
+
+static FuncProto *compile_function(ASTNode *n) {
+    FuncProto *fn = new_func_proto(n->as.function.params, n->as.function.param_count);
+    if (n->as.function.unparsed_body) {
+        fn->lazy = n;
+    } else {
+        compile_body(fn, n);
+    }
+    return fn;
+}
+
+void compile_lazy(FuncProto *fn) {
+    ASTNode *n = fn->lazy;
+    fn->lazy = NULL;
+    parse_function_body(n);
+    compile_body(fn, n);
+}
+
+static void compile_return(ASTNode *n) {
+    if (n->as.operand) compile_expr(n->as.operand);
+    else emit(OP_NULL);
+
+    // Leave every enclosing try, running finally blocks innermost first.
+    // The return value stays on the stack underneath the finally code.
+    TryContext *saved = current()->tries;
+    for (TryContext *t = saved; t; t = t->outer) {
+        for (int i = 0; i < t->handlers; i++) emit(OP_POP_TRY);
+        if (t->catch_scope) emit(OP_POP_SCOPE);
+        if (t->finally_block) {
+            current()->tries = t->outer;
+            compile_statement(t->finally_block);
+        }
+    }
+    current()->tries = saved;
+    emit(OP_RETURN);
+}
+
+static void compile_try(ASTNode *n) {
+    ASTNode *catch_block = n->as.try_stmt.catch_block;
+    ASTNode *finally_block = n->as.try_stmt.finally_block;
+    TryContext t;
+    t.finally_block = finally_block;
+    t.handlers = 1;
+    t.catch_scope = 0;
+    t.outer = current()->tries;
+    current()->tries = &t;
+
+    int to_handler = emit_jump(OP_TRY);
+    compile_statement(n->as.try_stmt.try_block);
+    emit(OP_POP_TRY);
+    t.handlers = 0;
+    int to_finally = emit_jump(OP_JUMP);
+
+    // The thrown value is on the stack when a handler is entered
+    patch_jump(to_handler);
+    int to_rethrow = -1;
+    if (catch_block) {
+        if (finally_block) {
+            // Protect the catch body so finally still runs if it throws
+            to_rethrow = emit_jump(OP_TRY);
+            t.handlers = 1;
+        }
+        // Takes the thrown value into slot 0
+        emit_with_operand(OP_PUSH_SCOPE, n->as.try_stmt.local_count);
+        chunk_write_short(chunk(), !n->as.try_stmt.has_closure);
+        t.catch_scope = 1;
+        compile_statement(catch_block);
+        emit(OP_POP_SCOPE);
+        t.catch_scope = 0;
+        if (finally_block) {
+            emit(OP_POP_TRY);
+            t.handlers = 0;
+        }
+    }
+    current()->tries = t.outer;
+
+    if (finally_block) {
+        if (catch_block) {
+            int skip = emit_jump(OP_JUMP);
+            patch_jump(to_rethrow);
+            compile_statement(finally_block);
+            emit(OP_THROW);
+            patch_jump(skip);
+        } else {
+            compile_statement(finally_block);
+            emit(OP_THROW);
+        }
+    }
+
+    patch_jump(to_finally);
+    if (finally_block) compile_statement(finally_block);
+}
+
+static void compile_statement(ASTNode *n) {
+    if (!n) return;
+
+    switch (n->type) {
+        case NODE_ASSIGN:
+            compile_expr(n->as.assign.value);
+            emit_set(&n->as.assign.var);
+            return;
+
+        case NODE_IF: {
+            compile_expr(n->as.branch.condition);
+            int to_else = emit_jump(OP_JUMP_IF_FALSE);
+            compile_statement(n->as.branch.body);
+            if (n->as.branch.else_branch) {
+                int to_end = emit_jump(OP_JUMP);
+                patch_jump(to_else);
+                compile_statement(n->as.branch.else_branch);
+                patch_jump(to_end);
+            } else {
+                patch_jump(to_else);
+            }
+            return;
+        }
+
+        case NODE_WHILE: {
+            int start = chunk()->count;
+            compile_expr(n->as.branch.condition);
+            int to_exit = emit_jump(OP_JUMP_IF_FALSE);
+            compile_statement(n->as.branch.body);
+            emit_loop(start);
+            patch_jump(to_exit);
+            return;
+        }
+
+        case NODE_BLOCK:
+            for (int i = 0; i < n->as.list.count; i++) {
+                compile_statement(n->as.list.items[i]);
+            }
+            return;
+
+        case NODE_RETURN:
+            compile_return(n);
+            return;
+
+        case NODE_TRY:
+            compile_try(n);
+            return;
+
+        case NODE_THROW:
+            compile_expr(n->as.operand);
+            emit(OP_THROW);
+            return;
+
+        default:
+            compile_expr(n);
+            emit(OP_POP);
+            return;
+    }
+}
+
+static void compile_expr(ASTNode *n) {
+    if (!n) {
+        emit(OP_NULL);
+        return;
+    }
+
+    switch (n->type) {
+        case NODE_NUMBER:
+            emit_with_operand(OP_CONST, chunk_add_constant(chunk(), new_number_val(n->as.number)));
+            return;
+
+        case NODE_STRING:
+            emit_with_operand(OP_CONST, string_constant(n->as.string));
+            return;
+
+        case NODE_BOOLEAN:
+            emit(n->as.boolean ? OP_TRUE : OP_FALSE);
+            return;
+
+        case NODE_VAR:
+            emit_get(&n->as.var);
+            return;
+
+        case NODE_BINOP:
+            if (emit_var_const(n, OP_GLOBAL_ARITH_CONST, OP_LOCAL_ARITH_CONST)) return;
+            compile_expr(n->as.binary.left);
+            compile_expr(n->as.binary.right);
+            emit(OP_ADD + (n->as.binary.op - ARITH_ADD));
+            return;
+
+        case NODE_COMPARISON:
+            if (emit_var_const(n, OP_GLOBAL_CMP_CONST, OP_LOCAL_CMP_CONST)) return;
+            compile_expr(n->as.binary.left);
+            compile_expr(n->as.binary.right);
+            emit(OP_EQ + (n->as.binary.op - CMP_EQ));
+            return;
+
+        case NODE_LOGICAL: {
+            if (n->as.binary.op == LOGIC_NOT) {
+                compile_expr(n->as.binary.left);
+                emit(OP_NOT);
+                return;
+            }
+            // Both operators yield a boolean, like the tree walker
+            int is_and = n->as.binary.op == LOGIC_AND;
+            compile_expr(n->as.binary.left);
+            int to_short = emit_jump(OP_JUMP_IF_FALSE);
+            if (is_and) {
+                compile_expr(n->as.binary.right);
+                emit(OP_TRUTHY);
+                int to_end = emit_jump(OP_JUMP);
+                patch_jump(to_short);
+                emit(OP_FALSE);
+                patch_jump(to_end);
+            } else {
+                emit(OP_TRUE);
+                int to_end = emit_jump(OP_JUMP);
+                patch_jump(to_short);
+                compile_expr(n->as.binary.right);
+                emit(OP_TRUTHY);
+                patch_jump(to_end);
+            }
+            return;
+        }
+
+        case NODE_ASSIGN:
+            compile_expr(n->as.assign.value);
+            emit_set(&n->as.assign.var);
+            emit_get(&n->as.assign.var);
+            return;
+
+        case NODE_PRINT:
+            compile_expr(n->as.operand);
+            emit(OP_PRINT);
+            return;
+
+        case NODE_FUNCTION: {
+            FuncProto *fn = compile_function(n);
+            emit_with_operand(OP_FUNCTION, chunk_add_function(chunk(), fn));
+            return;
+        }
+
+        case NODE_CALL:
+            if (n->as.call.arg_count > 0xffff) fatal("Too many arguments");
+            emit_get(&n->as.call.var);
+            for (int i = 0; i < n->as.call.arg_count; i++) {
+                compile_expr(n->as.call.args[i]);
+            }
+            emit_with_operand(OP_CALL, string_constant(n->as.call.var.name));
+            chunk_write_short(chunk(), n->as.call.arg_count);
+            return;
+
+        case NODE_ARRAY:
+            for (int i = 0; i < n->as.list.count; i++) {
+                compile_expr(n->as.list.items[i]);
+            }
+            emit_with_operand(OP_ARRAY, n->as.list.count);
+            return;
+
+        case NODE_OBJECT:
+            emit(OP_OBJECT);
+            for (int i = 0; i < n->as.object.count; i++) {
+                compile_expr(n->as.object.values[i]);
+                emit_with_operand(OP_INIT_PROP, string_constant(n->as.object.keys[i]));
+                chunk_write_short(chunk(), chunk_add_cache(chunk()));
+            }
+            return;
+
+        case NODE_INDEX:
+            compile_expr(n->as.index.object);
+            compile_expr(n->as.index.index);
+            emit(OP_INDEX);
+            return;
+
+        case NODE_MEMBER:
+            compile_expr(n->as.member.object);
+            emit_with_operand(OP_MEMBER, string_constant(n->as.member.name));
+            chunk_write_short(chunk(), chunk_add_cache(chunk()));
+            return;
+
+        case NODE_PROPERTY_ASSIGN: {
+            ASTNode *target = n->as.property.target;
+            if (target->type == NODE_INDEX) {
+                compile_expr(target->as.index.object);
+                compile_expr(target->as.index.index);
+                compile_expr(n->as.property.value);
+                emit(OP_SET_INDEX);
+            } else {
+                compile_expr(target->as.member.object);
+                compile_expr(n->as.property.value);
+                emit_with_operand(OP_SET_MEMBER, string_constant(target->as.member.name));
+                chunk_write_short(chunk(), chunk_add_cache(chunk()));
+            }
+            return;
+        }
+
+        default:
+            // Statements in expression position evaluate to null
+            compile_statement(n);
+            emit(OP_NULL);
+            return;
+    }
+}
+
+FuncProto *compile(ASTNode *n) {
+    Compiler c;
+    c.fn = new_func_proto(NULL, 0);
+    c.tries = NULL;
+    c.enclosing = NULL;
+    set_current(&c);
+
+    compile_statement(n);
+    emit(OP_HALT);
+
+    set_current(NULL);
+    return c.fn;
+}
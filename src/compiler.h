@@ -0,0 +1,18 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "ast.h"
+#include "bytecode.h"
+
+// One per isolate (isolate.h)
+typedef struct {
+    struct Compiler *current;   // innermost function being compiled
+} CompilerState;
+
+// Compile a top-level statement into a parameterless script function.
+// The returned prototype does not reference the AST and may outlive it.
+FuncProto *compile(ASTNode *n);
+// Parse and compile the body of a lazy prototype (FuncProto.lazy)
+void compile_lazy(FuncProto *fn);
+
+#endif
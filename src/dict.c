@@ -0,0 +1,86 @@
+#include "dict.h"
+#include "gc.h"
+#include <string.h>
+
+Dict *new_dict(int capacity) {
+    Dict *d = gc_realloc(NULL, 0, sizeof(Dict));
+    d->count = 0;
+    d->capacity = capacity;
+    d->entries = gc_realloc(NULL, 0, sizeof(DictEntry) * capacity);
+    d->index_capacity = 8;
+    while (d->index_capacity < capacity * 2) d->index_capacity *= 2;
+    d->index = gc_realloc(NULL, 0, sizeof(int) * d->index_capacity);
+    memset(d->index, 0xff, sizeof(int) * d->index_capacity);
+    return d;
+}
+
+void free_dict(Dict *d) {
+    gc_realloc(d->entries, sizeof(DictEntry) * d->capacity, 0);
+    gc_realloc(d->index, sizeof(int) * d->index_capacity, 0);
+    gc_realloc(d, sizeof(Dict), 0);
+}
+
+// The bucket holding `key`, or the empty bucket where it would go
+static int *find_bucket(Dict *d, const char *key, int length, uint32_t hash) {
+    unsigned mask = d->index_capacity - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        int *bucket = &d->index[i];
+        if (*bucket < 0) return bucket;
+        DictEntry *e = &d->entries[*bucket];
+        if (e->hash == hash && e->key->length == length &&
+            memcmp(string_chars(e->key), key, length) == 0) {
+            return bucket;
+        }
+    }
+}
+
+static void grow_index(Dict *d) {
+    gc_realloc(d->index, sizeof(int) * d->index_capacity, 0);
+    d->index_capacity *= 2;
+    d->index = gc_realloc(NULL, 0, sizeof(int) * d->index_capacity);
+    memset(d->index, 0xff, sizeof(int) * d->index_capacity);
+
+    unsigned mask = d->index_capacity - 1;
+    for (int e = 0; e < d->count; e++) {
+        unsigned i = d->entries[e].hash & mask;
+        while (d->index[i] >= 0) i = (i + 1) & mask;
+        d->index[i] = e;
+    }
+}
+
+Value *dict_find(Dict *d, const char *key, int length, uint32_t hash) {
+    int *bucket = find_bucket(d, key, length, hash);
+    return *bucket < 0 ? NULL : &d->entries[*bucket].value;
+}
+
+void dict_set(Dict *d, ObjString *key, Value val) {
+    uint32_t hash = string_hash(key);
+    int *bucket = find_bucket(d, string_chars(key), key->length, hash);
+    if (*bucket >= 0) {
+        d->entries[*bucket].value = val;
+        return;
+    }
+
+    if (d->count >= d->capacity) {
+        d->entries = gc_realloc(d->entries, sizeof(DictEntry) * d->capacity,
+                                sizeof(DictEntry) * d->capacity * 2);
+        d->capacity *= 2;
+    }
+    d->entries[d->count].key = key;
+    d->entries[d->count].hash = hash;
+    d->entries[d->count].value = val;
+    d->count++;
+
+    if (d->count * 2 > d->index_capacity) {
+        grow_index(d);
+    } else {
+        *bucket = d->count - 1;
+    }
+}
+
+void dict_mark(Dict *d) {
+    for (int i = 0; i < d->count; i++) {
+        gc_mark_value(OBJ_VAL(d->entries[i].key));
+        gc_mark_value(d->entries[i].value);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include "value.h"
+
+// Hash table behind objects in dictionary mode. Entries stay in insertion
+// order; `index` maps hashes to entry positions by linear probing.
+typedef struct {
+    ObjString *key;
+    uint32_t hash;          // copy of the key's hash, checked before the key
+    Value value;
+} DictEntry;
+
+typedef struct Dict {
+    DictEntry *entries;
+    int count;
+    int capacity;
+    int *index;             // entry position, or -1 for an empty bucket
+    int index_capacity;     // power of two, at least twice `count`
+} Dict;
+
+Dict *new_dict(int capacity);
+void free_dict(Dict *d);
+
+// The value stored under a key, or NULL
+Value *dict_find(Dict *d, const char *key, int length, uint32_t hash);
+// Insert or overwrite; the dictionary keeps a reference to `key`
+void dict_set(Dict *d, ObjString *key, Value val);
+void dict_mark(Dict *d);
+
+#endif
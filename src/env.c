@@ -1,97 +1,189 @@
 #include "env.h"
 #include "util.h"
+#include "gc.h"
+#include "isolate.h"
 #include <string.h>
 #include <stdlib.h>
 
-typedef struct {
-    char name[256];
-    Value *value;
-} Var;
+static EnvState *state(void) {
+    return &current_isolate->env;
+}
 
-typedef struct Scope {
-    Var vars[256];
-    int count;
-    struct Scope *parent;
-} Scope;
+static Env *alloc_pooled(int count) {
+    Env **pool = state()->pool;
+    if (count < POOL_CLASSES && pool[count]) {
+        Env *env = pool[count];
+        pool[count] = env->parent;
+        return env;
+    }
+    Env *env = malloc(sizeof(Env) + sizeof(Value) * count);
+    if (!env) fatal("Out of memory");
+    env->obj.type = VAL_ENV;
+    env->obj.marked = 0;
+    env->obj.next = NULL;
+    return env;
+}
+
+static void release_pooled(Env *env) {
+    Env **pool = state()->pool;
+    if (env->count < POOL_CLASSES) {
+        env->parent = pool[env->count];
+        pool[env->count] = env;
+    } else {
+        free(env);
+    }
+}
 
-static Scope *current_scope = NULL;
+Env *new_env(Env *parent, int count, int pooled) {
+    Env *env;
+    if (pooled) {
+        env = alloc_pooled(count);
+    } else {
+        env = (Env*)gc_alloc_object(sizeof(Env) + sizeof(Value) * count, VAL_ENV);
+    }
+    env->pooled = pooled;
+    env->parent = parent;
+    env->count = count;
+    for (int i = 0; i < count; i++) {
+        env->slots[i] = NULL_VAL;
+    }
+    return env;
+}
 
-void push_scope(void) {
-    Scope *new_scope = malloc(sizeof(Scope));
-    new_scope->count = 0;
-    new_scope->parent = current_scope;
-    current_scope = new_scope;
+void push_scope(Env *env) {
+    EnvState *es = state();
+    if (es->depth >= es->saved_capacity) {
+        es->saved_capacity = es->saved_capacity ? es->saved_capacity * 2 : 64;
+        es->saved = realloc(es->saved, sizeof(Env*) * es->saved_capacity);
+        if (!es->saved) fatal("Out of memory");
+    }
+    es->saved[es->depth++] = es->current;
+    es->current = env;
 }
 
 void pop_scope(void) {
-    if (!current_scope) return;
-    
-    Scope *old = current_scope;
-    current_scope = current_scope->parent;
-    
-    // Clean up values in the old scope
-    for (int i = 0; i < old->count; i++) {
-        free_value(old->vars[i].value);
+    EnvState *es = state();
+    if (es->depth == 0) return;
+    if (es->current && es->current->pooled) release_pooled(es->current);
+    es->current = es->saved[--es->depth];
+}
+
+int scope_depth(void) {
+    return state()->depth;
+}
+
+static int *find_index(EnvState *es, const char *name) {
+    unsigned mask = es->index_capacity - 1;
+    for (unsigned i = hash_bytes(name, strlen(name)) & mask;; i = (i + 1) & mask) {
+        int *entry = &es->index_slots[i];
+        if (*entry < 0 || strcmp(es->global_names[*entry], name) == 0) return entry;
     }
-    free(old);
 }
 
-static int find_in_scope(Scope *scope, const char *name) {
-    if (!scope) return -1;
-    for (int i = 0; i < scope->count; i++) {
-        if (strcmp(scope->vars[i].name, name) == 0) {
-            return i;
-        }
+static void grow_index(EnvState *es) {
+    int *old = es->index_slots;
+    int old_capacity = es->index_capacity;
+    es->index_capacity = es->index_capacity ? es->index_capacity * 2 : 64;
+    es->index_slots = malloc(sizeof(int) * es->index_capacity);
+    if (!es->index_slots) fatal("Out of memory");
+    for (int i = 0; i < es->index_capacity; i++) es->index_slots[i] = -1;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i] >= 0) *find_index(es, es->global_names[old[i]]) = old[i];
     }
-    return -1;
+    free(old);
 }
 
-Value *get_var(const char *name) {
-    // Search from current scope up to global
-    Scope *scope = current_scope;
-    while (scope) {
-        int i = find_in_scope(scope, name);
-        if (i >= 0) {
-            return scope->vars[i].value;
-        }
-        scope = scope->parent;
+int global_exists(const char *name) {
+    EnvState *es = state();
+    return es->index_capacity > 0 && *find_index(es, name) >= 0;
+}
+
+int global_slot(const char *name) {
+    EnvState *es = state();
+    if ((es->global_count + 1) * 2 > es->index_capacity) grow_index(es);
+    int *entry = find_index(es, name);
+    if (*entry >= 0) return *entry;
+
+    if (es->global_count >= es->global_capacity) {
+        es->global_capacity = es->global_capacity ? es->global_capacity * 2 : 64;
+        es->globals = realloc(es->globals, sizeof(Value) * es->global_capacity);
+        es->global_names = realloc(es->global_names, sizeof(char*) * es->global_capacity);
+        if (!es->globals || !es->global_names) fatal("Out of memory");
     }
-    
-    fprintf(stderr, "Undefined variable: %s\n", name);
-    exit(1);
+    size_t len = strlen(name);
+    char *copy = malloc(len + 1);
+    if (!copy) fatal("Out of memory");
+    memcpy(copy, name, len + 1);
+    es->global_names[es->global_count] = copy;
+    es->globals[es->global_count] = EMPTY_VAL;
+    *entry = es->global_count;
+    return es->global_count++;
 }
 
-void set_var(const char *name, Value *v) {
-    // Initialize global scope if needed
-    if (!current_scope) {
-        push_scope();
+Value get_global(int slot) {
+    EnvState *es = state();
+    Value v = es->globals[slot];
+    if (v == EMPTY_VAL) {
+        fprintf(isolate_stderr(), "Undefined variable: %s\n", es->global_names[slot]);
+        isolate_exit(1);
     }
-    
-    // Try to find in current scope only (for let)
-    int i = find_in_scope(current_scope, name);
-    if (i >= 0) {
-        free_value(current_scope->vars[i].value);
-        current_scope->vars[i].value = v;
+    return v;
+}
+
+void set_global(int slot, Value v) {
+    state()->globals[slot] = v;
+}
+
+int global_count(void) {
+    return state()->global_count;
+}
+
+const char *global_name(int slot) {
+    return state()->global_names[slot];
+}
+
+// Pooled Envs are not heap cells, so the collector never marks them
+// itself. Only active scopes can be pooled, and a pooled Env's parent is
+// either active too or a heap cell, so marking the active ones suffices.
+static void mark_env(Env *env) {
+    if (!env) return;
+    if (!env->pooled) {
+        gc_mark_value(OBJ_VAL(env));
         return;
     }
-    
-    // Try to find in parent scopes (for reassignment)
-    Scope *scope = current_scope->parent;
-    while (scope) {
-        i = find_in_scope(scope, name);
-        if (i >= 0) {
-            free_value(scope->vars[i].value);
-            scope->vars[i].value = v;
-            return;
-        }
-        scope = scope->parent;
+    for (int i = 0; i < env->count; i++) {
+        gc_mark_value(env->slots[i]);
+    }
+    if (env->parent && !env->parent->pooled) gc_mark_value(OBJ_VAL(env->parent));
+}
+
+void env_mark_roots(void) {
+    EnvState *es = state();
+    for (int i = 0; i < es->global_count; i++) {
+        gc_mark_value(es->globals[i]);
     }
-    
-    // Not found anywhere, add to current scope
-    if (current_scope->count >= 256) {
-        fatal("Too many variables in scope");
+    mark_env(es->current);
+    for (int i = 0; i < es->depth; i++) {
+        mark_env(es->saved[i]);
+    }
+}
+
+// Heap Envs belong to the collector; this frees the tables and the pooled
+// Envs, active or free
+void free_env(void) {
+    EnvState *es = state();
+    while (es->depth > 0) pop_scope();
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (es->pool[i]) {
+            Env *env = es->pool[i];
+            es->pool[i] = env->parent;
+            free(env);
+        }
     }
-    strcpy(current_scope->vars[current_scope->count].name, name);
-    current_scope->vars[current_scope->count].value = v;
-    current_scope->count++;
+    for (int i = 0; i < es->global_count; i++) free(es->global_names[i]);
+    free(es->global_names);
+    free(es->globals);
+    free(es->index_slots);
+    free(es->saved);
+    memset(es, 0, sizeof(EnvState));
 }
@@ -3,9 +3,68 @@
 
 #include "value.h"
 
-void push_scope(void);
+// Variables are resolved to slots ahead of time (resolver.c). Globals live
+// in one table indexed by slot; every function call and catch block gets an
+// Env holding its locals, linked to the Env the function was created in.
+typedef struct Env {
+    Obj obj;
+    struct Env *parent;
+    int count;
+    int pooled;
+    Value slots[];
+} Env;
+
+#define POOL_CLASSES 32
+
+// One per isolate (isolate.h)
+typedef struct {
+    Env *current;
+    // Envs made current by push_scope, so pop_scope can restore them and
+    // the collector can see callers' locals
+    Env **saved;
+    int depth;
+    int saved_capacity;
+
+    Value *globals;
+    char **global_names;
+    int global_count;
+    int global_capacity;
+    // Open-addressing index from name to global slot, used only at
+    // resolve time
+    int *index_slots;
+    int index_capacity;
+
+    // Free pooled Envs by slot count, linked through `parent`
+    Env *pool[POOL_CLASSES];
+} EnvState;
+
+// Envs a closure may capture are heap cells owned by the collector. The
+// rest are pooled: they come from free lists sized by slot count and go
+// back when their scope is popped, so most calls never touch the heap.
+Env *new_env(Env *parent, int count, int pooled);
+
+// Make `env` current, remembering the previous Env until pop_scope
+void push_scope(Env *env);
 void pop_scope(void);
-Value *get_var(const char *name);
-void set_var(const char *name, Value *v);
+int scope_depth(void);
+
+// Slot of the Env `depth` levels up from `env`
+static inline Value *env_slot(Env *env, int depth, int slot) {
+    while (depth-- > 0) env = env->parent;
+    return &env->slots[slot];
+}
+
+// Find or reserve the global slot for `name`. Reserved slots hold
+// EMPTY_VAL until the first assignment.
+int global_slot(const char *name);
+int global_exists(const char *name);
+Value get_global(int slot);
+void set_global(int slot, Value v);
+// Reserved slots and their names, in slot order
+int global_count(void);
+const char *global_name(int slot);
+
+void env_mark_roots(void);
+void free_env(void);
 
 #endif
@@ -1,361 +1,376 @@
 #include "eval.h"
 #include "env.h"
 #include "value.h"
+#include "gc.h"
+#include "isolate.h"
+#include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static Value *return_value = NULL;
-static Value *exception_value = NULL;
+// Caches live as long as the tree, in its arena
+static PropertyCache *new_caches(int count) {
+    return ast_alloc(sizeof(PropertyCache) * (count ? count : 1));
+}
+
+static Value lookup(VarRef *var) {
+    if (var->depth == DEPTH_GLOBAL) return get_global(var->slot);
+    return *env_slot(current_env(), var->depth, var->slot);
+}
 
-Value *eval(ASTNode *n) {
+static Value eval_node(EvalState *es, ASTNode *n) {
     if (!n) return new_null_val();
     
     // Check if we have an exception
-    if (exception_value) {
-        return copy_value(exception_value);
+    if (es->has_exception) {
+        return es->exception_value;
     }
     
     // Check if we have a return value from a function
-    if (return_value && n->type != NODE_FUNCTION && n->type != NODE_BLOCK) {
-        return copy_value(return_value);
+    if (es->has_return && n->type != NODE_FUNCTION && n->type != NODE_BLOCK) {
+        return es->return_value;
     }
     
     switch (n->type) {
         case NODE_NUMBER:
-            return new_number_val(n->number);
+            return new_number_val(n->as.number);
 
         case NODE_STRING:
-            return new_string_val(n->string_value);
+            return new_string_val(n->as.string);
 
         case NODE_BOOLEAN:
-            return new_boolean_val(n->bool_value);
+            return new_boolean_val(n->as.boolean);
 
         case NODE_VAR:
-            return copy_value(get_var(n->name));
+            return lookup(&n->as.var);
 
         case NODE_BINOP: {
-            Value *l = eval(n->left);
-            Value *r = eval(n->right);
-            Value *result = NULL;
-            
-            // String concatenation with +
-            if (n->op == '+' && (l->type == VAL_STRING || r->type == VAL_STRING)) {
-                char *ls = value_to_string(l);
-                char *rs = value_to_string(r);
-                char *combined = malloc(strlen(ls) + strlen(rs) + 1);
-                strcpy(combined, ls);
-                strcat(combined, rs);
-                result = new_string_val(combined);
-                free(ls);
-                free(rs);
-                free(combined);
-            } else if (l->type == VAL_NUMBER && r->type == VAL_NUMBER) {
-                switch (n->op) {
-                    case '+': result = new_number_val(l->as.number + r->as.number); break;
-                    case '-': result = new_number_val(l->as.number - r->as.number); break;
-                    case '*': result = new_number_val(l->as.number * r->as.number); break;
-                    case '/':
-                        if (r->as.number == 0) {
-                            fprintf(stderr, "Division by zero\n");
-                            exit(1);
-                        }
-                        result = new_number_val(l->as.number / r->as.number);
-                        break;
-                    default:
-                        result = new_null_val();
-                }
-            } else {
-                result = new_null_val();
-            }
-            
-            free_value(l);
-            free_value(r);
-            return result;
+            Value l = eval_node(es, n->as.binary.left);
+            gc_push_root(l);
+            Value r = eval_node(es, n->as.binary.right);
+            gc_pop_roots(1);
+            return value_arith(n->as.binary.op, l, r);
         }
 
         case NODE_COMPARISON: {
-            Value *l = eval(n->left);
-            Value *r = eval(n->right);
-            int result = 0;
-            
-            if (l->type == VAL_NUMBER && r->type == VAL_NUMBER) {
-                double lv = l->as.number;
-                double rv = r->as.number;
-                if (strcmp(n->name, "==") == 0) result = (lv == rv);
-                else if (strcmp(n->name, "!=") == 0) result = (lv != rv);
-                else if (strcmp(n->name, "<") == 0)  result = (lv < rv);
-                else if (strcmp(n->name, ">") == 0)  result = (lv > rv);
-                else if (strcmp(n->name, "<=") == 0) result = (lv <= rv);
-                else if (strcmp(n->name, ">=") == 0) result = (lv >= rv);
-            } else if (l->type == VAL_STRING && r->type == VAL_STRING) {
-                int cmp = strcmp(l->as.string, r->as.string);
-                if (strcmp(n->name, "==") == 0) result = (cmp == 0);
-                else if (strcmp(n->name, "!=") == 0) result = (cmp != 0);
-                else if (strcmp(n->name, "<") == 0)  result = (cmp < 0);
-                else if (strcmp(n->name, ">") == 0)  result = (cmp > 0);
-                else if (strcmp(n->name, "<=") == 0) result = (cmp <= 0);
-                else if (strcmp(n->name, ">=") == 0) result = (cmp >= 0);
-            }
-            
-            free_value(l);
-            free_value(r);
+            Value l = eval_node(es, n->as.binary.left);
+            gc_push_root(l);
+            Value r = eval_node(es, n->as.binary.right);
+            gc_pop_roots(1);
+            int result = value_compare(n->as.binary.op, l, r);
             return new_boolean_val(result);
         }
 
         case NODE_LOGICAL: {
-            if (strcmp(n->name, "!") == 0) {
-                Value *v = eval(n->left);
+            if (n->as.binary.op == LOGIC_NOT) {
+                Value v = eval_node(es, n->as.binary.left);
                 int result = !value_is_truthy(v);
-                free_value(v);
                 return new_boolean_val(result);
             }
-            if (strcmp(n->name, "&&") == 0) {
-                Value *l = eval(n->left);
+            if (n->as.binary.op == LOGIC_AND) {
+                Value l = eval_node(es, n->as.binary.left);
                 if (!value_is_truthy(l)) {
-                    free_value(l);
                     return new_boolean_val(0);
                 }
-                free_value(l);
-                Value *r = eval(n->right);
+                Value r = eval_node(es, n->as.binary.right);
                 int result = value_is_truthy(r);
-                free_value(r);
                 return new_boolean_val(result);
             }
-            if (strcmp(n->name, "||") == 0) {
-                Value *l = eval(n->left);
+            if (n->as.binary.op == LOGIC_OR) {
+                Value l = eval_node(es, n->as.binary.left);
                 if (value_is_truthy(l)) {
-                    free_value(l);
                     return new_boolean_val(1);
                 }
-                free_value(l);
-                Value *r = eval(n->right);
+                Value r = eval_node(es, n->as.binary.right);
                 int result = value_is_truthy(r);
-                free_value(r);
                 return new_boolean_val(result);
             }
             return new_null_val();
         }
 
         case NODE_ASSIGN: {
-            Value *v = eval(n->left);
-            set_var(n->name, v);
-            return copy_value(v);
+            VarRef *var = &n->as.assign.var;
+            Value v = eval_node(es, n->as.assign.value);
+            if (var->depth == DEPTH_GLOBAL) set_global(var->slot, v);
+            else *env_slot(current_env(), var->depth, var->slot) = v;
+            return v;
         }
 
         case NODE_PRINT: {
-            Value *v = eval(n->left);
+            Value v = eval_node(es, n->as.operand);
             char *str = value_to_string(v);
-            printf("%s\n", str);
+            fprintf(current_isolate->out, "%s\n", str);
             free(str);
-            Value *result = copy_value(v);
-            free_value(v);
-            return result;
+            return v;
         }
 
         case NODE_IF: {
-            Value *cond = eval(n->condition);
-            Value *result;
+            Value cond = eval_node(es, n->as.branch.condition);
+            Value result;
             if (value_is_truthy(cond)) {
-                result = eval(n->left);
-            } else if (n->else_branch) {
-                result = eval(n->else_branch);
+                result = eval_node(es, n->as.branch.body);
+            } else if (n->as.branch.else_branch) {
+                result = eval_node(es, n->as.branch.else_branch);
             } else {
                 result = new_null_val();
             }
-            free_value(cond);
             return result;
         }
 
         case NODE_WHILE: {
-            Value *result = new_null_val();
+            Value result = new_null_val();
             while (1) {
-                Value *cond = eval(n->condition);
+                // The last body value is the loop's result; keep it alive
+                gc_push_root(result);
+                gc_maybe_collect();
+                Value cond = eval_node(es, n->as.branch.condition);
+                gc_pop_roots(1);
                 int truthy = value_is_truthy(cond);
-                free_value(cond);
                 if (!truthy) break;
                 
-                free_value(result);
-                result = eval(n->left);
+                result = eval_node(es, n->as.branch.body);
                 
-                if (return_value || exception_value) break;  // Return or exception
+                if (es->has_return || es->has_exception) break;  // Return or exception
             }
             return result;
         }
 
         case NODE_BLOCK: {
-            Value *result = new_null_val();
-            for (int i = 0; i < n->statement_count; i++) {
-                free_value(result);
-                result = eval(n->statements[i]);
-                if (return_value || exception_value) break;  // Early return or exception
+            Value result = new_null_val();
+            for (int i = 0; i < n->as.list.count; i++) {
+                result = eval_node(es, n->as.list.items[i]);
+                if (es->has_return || es->has_exception) break;  // Early return or exception
             }
             return result;
         }
 
         case NODE_FUNCTION: {
-            return new_function_val(n->params, n->param_count, n->left);
+            Value f = new_function_val(n->as.function.params, n->as.function.param_count,
+                                       n->as.function.local_count, n->as.function.body,
+                                       current_env());
+            AS_FUNCTION(f)->has_closure = n->as.function.has_closure;
+            if (n->as.function.unparsed_body) AS_FUNCTION(f)->lazy = n;
+            return f;
         }
 
         case NODE_CALL: {
-            Value *func = get_var(n->name);
-            if (func->type != VAL_FUNCTION) {
-                fprintf(stderr, "Not a function: %s\n", n->name);
-                exit(1);
+            int arg_count = n->as.call.arg_count;
+            Value func = lookup(&n->as.call.var);
+            if (!IS_FUNCTION(func)) {
+                fprintf(isolate_stderr(), "Not a function: %s\n", n->as.call.var.name);
+                isolate_exit(1);
             }
-            
-            // Evaluate arguments
-            Value **arg_values = malloc(sizeof(Value*) * n->arg_count);
-            for (int i = 0; i < n->arg_count; i++) {
-                arg_values[i] = eval(n->args[i]);
+            ObjFunction *fn = AS_FUNCTION(func);
+            if (arg_count != fn->param_count) {
+                fprintf(isolate_stderr(), "Function %s expects %d arguments, got %d\n",
+                        n->as.call.var.name, fn->param_count, arg_count);
+                isolate_exit(1);
             }
-            
-            // Check argument count
-            if (n->arg_count != func->as.function.param_count) {
-                fprintf(stderr, "Function %s expects %d arguments, got %d\n",
-                        n->name, func->as.function.param_count, n->arg_count);
-                exit(1);
+            if (fn->lazy) {
+                ASTNode *decl = fn->lazy;
+                parse_function_body(decl);
+                fn->local_count = decl->as.function.local_count;
+                fn->has_closure = decl->as.function.has_closure;
+                fn->body = decl->as.function.body;
+                fn->lazy = NULL;
             }
             
-            // Create new scope for function
-            push_scope();
-            
-            // Bind parameters
-            for (int i = 0; i < func->as.function.param_count; i++) {
-                set_var(func->as.function.params[i], arg_values[i]);
+            // Evaluate arguments; fn and each argument stay rooted until
+            // they are bound
+            gc_push_root(func);
+            Value small_args[8];
+            Value *arg_values = arg_count <= 8 ? small_args
+                                               : malloc(sizeof(Value) * arg_count);
+            for (int i = 0; i < arg_count; i++) {
+                arg_values[i] = eval_node(es, n->as.call.args[i]);
+                gc_push_root(arg_values[i]);
             }
             
-            free(arg_values);  // Free the array but not the values (owned by scope now)
+            // Create new scope for function and bind parameters
+            Env *env = new_env(fn->env, fn->local_count, !fn->has_closure);
+            memcpy(env->slots, arg_values, sizeof(Value) * arg_count);
+            if (arg_values != small_args) free(arg_values);
+            gc_pop_roots(arg_count + 1);
+            ASTNode *body = fn->body;
+            
+            push_scope(env);
             
             // Execute function body
             // Save the current return_value (in case we're in a nested call)
-            Value *saved_return = return_value;
-            return_value = NULL;
+            Value saved_return = es->return_value;
+            int saved_has_return = es->has_return;
+            es->has_return = 0;
+            if (saved_has_return) gc_push_root(saved_return);
+            gc_maybe_collect();
             
-            Value *result = eval(func->as.function.body);
+            Value result = eval_node(es, body);
+            if (saved_has_return) gc_pop_roots(1);
             
             // Check if function returned a value
-            Value *ret;
-            if (return_value) {
-                ret = return_value;
-                free_value(result);
+            Value ret;
+            if (es->has_return) {
+                ret = es->return_value;
             } else {
                 ret = result;
             }
             
             // Restore the saved return_value
-            return_value = saved_return;
+            es->return_value = saved_return;
+            es->has_return = saved_has_return;
             
             pop_scope();
             return ret;
         }
 
         case NODE_RETURN: {
-            if (return_value) free_value(return_value);
-            return_value = eval(n->left);
-            return copy_value(return_value);
+            es->return_value = eval_node(es, n->as.operand);
+            es->has_return = 1;
+            return es->return_value;
         }
 
         case NODE_ARRAY: {
-            Value *arr = new_array_val();
-            for (int i = 0; i < n->arg_count; i++) {
-                array_push(arr, eval(n->args[i]));
+            Value arr = new_array_val();
+            gc_push_root(arr);
+            for (int i = 0; i < n->as.list.count; i++) {
+                array_push(arr, eval_node(es, n->as.list.items[i]));
             }
+            gc_pop_roots(1);
             return arr;
         }
 
         case NODE_OBJECT: {
-            Value *obj = new_object_val();
-            for (int i = 0; i < n->param_count; i++) {
-                Value *val = eval(n->args[i]);
-                object_set(obj, n->params[i], val);
+            Value obj = new_object_val();
+            gc_push_root(obj);
+            if (!n->as.object.caches) n->as.object.caches = new_caches(n->as.object.count);
+            for (int i = 0; i < n->as.object.count; i++) {
+                Value val = eval_node(es, n->as.object.values[i]);
+                object_set(obj, n->as.object.keys[i], val, &n->as.object.caches[i]);
             }
+            gc_pop_roots(1);
             return obj;
         }
 
         case NODE_INDEX: {
-            Value *obj = eval(n->left);
-            Value *index = eval(n->right);
-            Value *result = new_null_val();
-            
-            if (obj->type == VAL_ARRAY && index->type == VAL_NUMBER) {
-                int idx = (int)index->as.number;
-                result = copy_value(array_get(obj, idx));
-            } else if (obj->type == VAL_OBJECT && index->type == VAL_STRING) {
-                result = copy_value(object_get(obj, index->as.string));
-            }
-            
-            free_value(obj);
-            free_value(index);
-            return result;
+            Value obj = eval_node(es, n->as.index.object);
+            gc_push_root(obj);
+            Value index = eval_node(es, n->as.index.index);
+            gc_pop_roots(1);
+            return value_index(obj, index);
         }
 
         case NODE_MEMBER: {
-            Value *obj = eval(n->left);
-            Value *result = new_null_val();
-            
-            if (obj->type == VAL_OBJECT) {
-                result = copy_value(object_get(obj, n->name));
-            } else if (obj->type == VAL_ARRAY && strcmp(n->name, "length") == 0) {
-                result = new_number_val(obj->as.array.length);
+            Value obj = eval_node(es, n->as.member.object);
+            if (!n->as.member.cache) n->as.member.cache = new_caches(1);
+            return value_member(obj, n->as.member.name, n->as.member.cache);
+        }
+
+        case NODE_PROPERTY_ASSIGN: {
+            ASTNode *target = n->as.property.target;
+            if (target->type == NODE_INDEX) {
+                Value obj = eval_node(es, target->as.index.object);
+                gc_push_root(obj);
+                Value index = eval_node(es, target->as.index.index);
+                gc_push_root(index);
+                Value val = eval_node(es, n->as.property.value);
+                gc_pop_roots(2);
+                value_set_index(obj, index, val);
+                return val;
             }
-            
-            free_value(obj);
-            return result;
+            Value obj = eval_node(es, target->as.member.object);
+            gc_push_root(obj);
+            Value val = eval_node(es, n->as.property.value);
+            gc_pop_roots(1);
+            if (!target->as.member.cache) target->as.member.cache = new_caches(1);
+            object_set(obj, target->as.member.name, val, target->as.member.cache);
+            return val;
         }
 
         case NODE_TRY: {
             // Execute try block
-            Value *try_result = eval(n->try_block);
+            Value try_result = eval_node(es, n->as.try_stmt.try_block);
             
             // If exception occurred during try block
-            if (exception_value && n->catch_block) {
-                Value *caught_exception = exception_value;
-                exception_value = NULL;
+            if (es->has_exception && n->as.try_stmt.catch_block) {
+                Value caught_exception = es->exception_value;
+                es->has_exception = 0;
                 
-                // Create new scope for catch block
-                push_scope();
-                
-                // Bind exception to catch parameter
-                if (n->catch_param[0] != '\0') {
-                    set_var(n->catch_param, caught_exception);
-                } else {
-                    free_value(caught_exception);
-                }
+                // Create new scope for catch block, exception in slot 0
+                Env *env = new_env(current_env(), n->as.try_stmt.local_count,
+                                   !n->as.try_stmt.has_closure);
+                env->slots[0] = caught_exception;
+                push_scope(env);
                 
                 // Execute catch block
-                free_value(try_result);
-                try_result = eval(n->catch_block);
+                try_result = eval_node(es, n->as.try_stmt.catch_block);
                 
                 pop_scope();
             }
             
-            // Execute finally block if present
-            if (n->finally_block) {
-                Value *finally_result = eval(n->finally_block);
-                free_value(finally_result);
+            // The finally block runs however the try was left: normally,
+            // by `return` or by an exception. A pending return or
+            // exception carries on after it, unless the block itself
+            // returns or throws.
+            if (n->as.try_stmt.finally_block) {
+                int pending_return = es->has_return;
+                int pending_exception = es->has_exception;
+                Value return_value = es->return_value;
+                Value exception_value = es->exception_value;
+                es->has_return = 0;
+                es->has_exception = 0;
+                gc_push_root(try_result);
+                gc_push_root(return_value);
+                gc_push_root(exception_value);
+                eval_node(es, n->as.try_stmt.finally_block);
+                gc_pop_roots(3);
+                if (!es->has_return && !es->has_exception) {
+                    es->has_return = pending_return;
+                    es->has_exception = pending_exception;
+                    es->return_value = return_value;
+                    es->exception_value = exception_value;
+                }
             }
             
             return try_result;
         }
 
         case NODE_THROW: {
-            Value *throw_val = eval(n->left);
+            Value throw_val = eval_node(es, n->as.operand);
             
             // If it's already an error, use it; otherwise create error
-            if (throw_val->type == VAL_ERROR) {
-                exception_value = throw_val;
+            if (IS_ERROR(throw_val)) {
+                es->exception_value = throw_val;
             } else {
                 char *msg = value_to_string(throw_val);
-                exception_value = new_error_val(msg);
+                es->exception_value = new_error_val(msg);
                 free(msg);
-                free_value(throw_val);
             }
+            es->has_exception = 1;
             
-            return copy_value(exception_value);
+            return es->exception_value;
         }
     }
 
-    fprintf(stderr, "Unknown AST node type: %d\n", n->type);
-    exit(1);
+    fprintf(isolate_stderr(), "Unknown AST node type: %d\n", n->type);
+    isolate_exit(1);
+}
+
+// Runs a top-level statement. As in the VM, `return` ends just that
+// statement, and an exception nothing catches ends the script.
+Value eval(ASTNode *n) {
+    EvalState *es = &current_isolate->eval;
+    Value result = eval_node(es, n);
+    if (es->has_exception) {
+        char *msg = value_to_string(es->exception_value);
+        fprintf(isolate_stderr(), "Uncaught %s\n", msg);
+        free(msg);
+        isolate_exit(1);
+    }
+    es->has_return = 0;
+    return result;
+}
+
+void eval_mark_roots(void) {
+    EvalState *es = &current_isolate->eval;
+    if (es->has_return) gc_mark_value(es->return_value);
+    if (es->has_exception) gc_mark_value(es->exception_value);
 }
@@ -4,6 +4,15 @@
 #include "ast.h"
 #include "value.h"
 
-Value *eval(ASTNode *n);
+// How statements being run are left early; one per isolate (isolate.h)
+typedef struct {
+    Value return_value;
+    Value exception_value;
+    int has_return;
+    int has_exception;
+} EvalState;
+
+Value eval(ASTNode *n);
+void eval_mark_roots(void);
 
 #endif
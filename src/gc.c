@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 200809L
+#include "gc.h"
+#include "env.h"
+#include "dict.h"
+#include "eval.h"
+#include "vm.h"
+#include "isolate.h"
+#include "util.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_THRESHOLD (1024 * 1024)
+#define DEFAULT_GROWTH 2.0
+
+static GCState *state(void) {
+    return &current_isolate->gc;
+}
+
+void gc_init(GCState *gc) {
+    gc->initial_threshold = DEFAULT_THRESHOLD;
+    gc->growth_factor = DEFAULT_GROWTH;
+    gc->next_gc = DEFAULT_THRESHOLD;
+}
+
+void gc_configure(size_t threshold, double growth) {
+    GCState *gc = state();
+    if (threshold > 0) gc->initial_threshold = threshold;
+    if (growth > 1.0) gc->growth_factor = growth;
+    gc->next_gc = gc->initial_threshold;
+}
+
+void *gc_realloc(void *ptr, size_t old_size, size_t new_size) {
+    GCState *gc = state();
+    gc->bytes_allocated += new_size;
+    gc->bytes_allocated -= old_size;
+    if (gc->bytes_allocated > gc->stats.peak_bytes) gc->stats.peak_bytes = gc->bytes_allocated;
+
+    if (new_size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    void *result = realloc(ptr, new_size);
+    if (!result) fatal("Out of memory");
+    return result;
+}
+
+Obj *gc_alloc_object(size_t size, ValueType type) {
+    GCState *gc = state();
+    Obj *o = gc_realloc(NULL, 0, size);
+    o->type = type;
+    o->marked = 0;
+    o->next = gc->objects;
+    gc->objects = o;
+    return o;
+}
+
+void gc_push_root(Value v) {
+    GCState *gc = state();
+    if (gc->root_count >= gc->root_capacity) {
+        gc->root_capacity = gc->root_capacity ? gc->root_capacity * 2 : 64;
+        gc->roots = realloc(gc->roots, sizeof(Value) * gc->root_capacity);
+        if (!gc->roots) fatal("Out of memory");
+    }
+    gc->roots[gc->root_count++] = v;
+}
+
+void gc_pop_roots(int count) {
+    GCState *gc = state();
+    gc->root_count -= count;
+}
+
+static void mark(GCState *gc, Value v) {
+    if (!IS_OBJ(v)) return;
+    Obj *o = AS_OBJ(v);
+    if (o->marked) return;
+    o->marked = 1;
+
+    if (gc->gray_count >= gc->gray_capacity) {
+        gc->gray_capacity = gc->gray_capacity ? gc->gray_capacity * 2 : 256;
+        gc->gray = realloc(gc->gray, sizeof(Obj*) * gc->gray_capacity);
+        if (!gc->gray) fatal("Out of memory");
+    }
+    gc->gray[gc->gray_count++] = o;
+}
+
+void gc_mark_value(Value v) {
+    mark(state(), v);
+}
+
+static void blacken(GCState *gc, Obj *o) {
+    switch (o->type) {
+        case VAL_STRING: {
+            ObjString *str = (ObjString*)o;
+            if (str->left) {
+                mark(gc, OBJ_VAL(str->left));
+                mark(gc, OBJ_VAL(str->right));
+            }
+            break;
+        }
+        case VAL_ARRAY: {
+            ObjArray *arr = (ObjArray*)o;
+            if (arr->is_numeric) break;
+            for (int i = 0; i < arr->length; i++) {
+                mark(gc, arr->elements[i]);
+            }
+            break;
+        }
+        case VAL_OBJECT: {
+            ObjObject *obj = (ObjObject*)o;
+            if (obj->dict) {
+                dict_mark(obj->dict);
+                break;
+            }
+            for (int i = 0; i < obj->shape->count; i++) {
+                mark(gc, obj->slots[i]);
+            }
+            break;
+        }
+        case VAL_FUNCTION: {
+            ObjFunction *fn = (ObjFunction*)o;
+            if (fn->env) mark(gc, OBJ_VAL(fn->env));
+            break;
+        }
+        case VAL_ENV: {
+            Env *env = (Env*)o;
+            if (env->parent) mark(gc, OBJ_VAL(env->parent));
+            for (int i = 0; i < env->count; i++) {
+                mark(gc, env->slots[i]);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void sweep(void) {
+    GCState *gc = state();
+    Obj **link = &gc->objects;
+    while (*link) {
+        Obj *o = *link;
+        if (o->marked) {
+            o->marked = 0;
+            link = &o->next;
+        } else {
+            *link = o->next;
+            size_t before = gc->bytes_allocated;
+            free_object(o);
+            gc->stats.bytes_reclaimed += before - gc->bytes_allocated;
+            gc->stats.objects_reclaimed++;
+        }
+    }
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void gc_collect(void) {
+    GCState *gc = state();
+    double start = now_ms();
+
+    env_mark_roots();
+    eval_mark_roots();
+    vm_mark_roots();
+    for (int i = 0; i < gc->root_count; i++) {
+        mark(gc, gc->roots[i]);
+    }
+    while (gc->gray_count > 0) {
+        blacken(gc, gc->gray[--gc->gray_count]);
+    }
+    sweep();
+
+    gc->next_gc = (size_t)(gc->bytes_allocated * gc->growth_factor);
+    if (gc->next_gc < gc->initial_threshold) gc->next_gc = gc->initial_threshold;
+
+    double pause = now_ms() - start;
+    gc->stats.collections++;
+    gc->stats.total_pause_ms += pause;
+    if (pause > gc->stats.max_pause_ms) gc->stats.max_pause_ms = pause;
+}
+
+void gc_maybe_collect(void) {
+    GCState *gc = state();
+    if (gc->bytes_allocated > gc->next_gc) gc_collect();
+}
+
+void gc_free_all(void) {
+    GCState *gc = state();
+    while (gc->objects) {
+        Obj *o = gc->objects;
+        gc->objects = o->next;
+        free_object(o);
+    }
+    free(gc->gray);
+    free(gc->roots);
+    gc->gray = NULL;
+    gc->roots = NULL;
+    gc->gray_count = gc->gray_capacity = 0;
+    gc->root_count = gc->root_capacity = 0;
+}
+
+const GCStats *gc_stats(void) {
+    GCState *gc = state();
+    return &gc->stats;
+}
+
+void gc_print_stats(FILE *out) {
+    GCState *gc = state();
+    fprintf(out, "GC: %d collections, %.3f ms total pause, %.3f ms max pause\n",
+            gc->stats.collections, gc->stats.total_pause_ms, gc->stats.max_pause_ms);
+    fprintf(out, "GC: %zu bytes reclaimed in %zu objects\n",
+            gc->stats.bytes_reclaimed, gc->stats.objects_reclaimed);
+    fprintf(out, "GC: %zu bytes live, %zu bytes peak, next collection at %zu bytes\n",
+            gc->bytes_allocated, gc->stats.peak_bytes, gc->next_gc);
+}
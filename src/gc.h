@@ -0,0 +1,65 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "value.h"
+
+// Mark-and-sweep collector for heap cells. Collections only happen at
+// safepoints (gc_maybe_collect), where every live value is reachable from
+// a root: globals and active Envs, the VM stack and loaded scripts, the tree
+// walker's pending return/exception values and the temporary root stack.
+
+typedef struct {
+    int collections;
+    double total_pause_ms;
+    double max_pause_ms;
+    size_t bytes_reclaimed;
+    size_t objects_reclaimed;
+    size_t peak_bytes;
+} GCStats;
+
+// One per isolate (isolate.h)
+typedef struct {
+    Obj *objects;           // every heap cell, newest first
+    size_t bytes_allocated;
+    size_t initial_threshold;
+    double growth_factor;
+    size_t next_gc;
+    Obj **gray;
+    int gray_count;
+    int gray_capacity;
+    Value *roots;
+    int root_count;
+    int root_capacity;
+    GCStats stats;
+} GCState;
+
+// Default tuning for a new isolate
+void gc_init(GCState *gc);
+// Free every heap cell, reachable or not, when the isolate goes away
+void gc_free_all(void);
+
+// Heap growth tuning: the first collection happens once `initial_threshold`
+// bytes are allocated; afterwards the threshold is the surviving heap size
+// times `growth_factor`.
+void gc_configure(size_t initial_threshold, double growth_factor);
+
+Obj *gc_alloc_object(size_t size, ValueType type);
+// Allocate, resize or free (new_size == 0) memory owned by a heap cell,
+// keeping the heap size accounting up to date
+void *gc_realloc(void *ptr, size_t old_size, size_t new_size);
+
+void gc_maybe_collect(void);
+void gc_collect(void);
+void gc_mark_value(Value v);
+
+// Values held only in C locals must be pushed here while code that may
+// reach a safepoint runs
+void gc_push_root(Value v);
+void gc_pop_roots(int count);
+
+const GCStats *gc_stats(void);
+void gc_print_stats(FILE *out);
+
+#endif
@@ -0,0 +1,45 @@
+#include "isolate.h"
+#include "util.h"
+#include <stdlib.h>
+
+__thread Isolate *current_isolate = NULL;
+
+Isolate *isolate_new(void) {
+    Isolate *iso = calloc(1, sizeof(Isolate));
+    if (!iso) fatal("Out of memory");
+    gc_init(&iso->gc);
+    iso->out = stdout;
+    iso->err = stderr;
+    return iso;
+}
+
+void isolate_enter(Isolate *iso) {
+    current_isolate = iso;
+}
+
+FILE *isolate_stderr(void) {
+    return current_isolate ? current_isolate->err : stderr;
+}
+
+void isolate_exit(int status) {
+    Isolate *iso = current_isolate;
+    if (iso && iso->exit_jmp) {
+        iso->exit_status = status;
+        longjmp(*iso->exit_jmp, 1);
+    }
+    exit(status);
+}
+
+void isolate_free(Isolate *iso) {
+    Isolate *previous = current_isolate;
+    current_isolate = iso;
+    vm_free();
+    free_lexer();
+    free_parser();
+    free_resolver();
+    free_env();
+    gc_free_all();
+    free_shapes();
+    current_isolate = previous == iso ? NULL : previous;
+    free(iso);
+}
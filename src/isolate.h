@@ -0,0 +1,57 @@
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include "lexer.h"
+#include "parser.h"
+#include "resolver.h"
+#include "compiler.h"
+#include "env.h"
+#include "eval.h"
+#include "vm.h"
+#include "gc.h"
+#include "shape.h"
+#include <setjmp.h>
+#include <stdio.h>
+
+// Everything the interpreter changes while it runs. Isolates share no
+// mutable state, so each can run on a thread of its own. The lexer,
+// parser, engines and heap all work on the calling thread's current
+// isolate, chosen with isolate_enter; values and trees must not be passed
+// from one isolate to another.
+typedef struct Isolate {
+    LexerState lexer;
+    ParserState parser;
+    Arena *ast_arena;
+    ResolverState resolver;
+    CompilerState compiler;
+    EnvState env;
+    EvalState eval;
+    VMState vm;
+    GCState gc;
+    ShapeState shapes;
+    // Where print writes and errors are reported: stdout and stderr
+    // unless the embedder captures them
+    FILE *out;
+    FILE *err;
+    // When set, isolate_exit() jumps here with the status in exit_status
+    // instead of ending the process. The isolate is left mid-script and
+    // can only be freed.
+    jmp_buf *exit_jmp;
+    int exit_status;
+} Isolate;
+
+extern __thread Isolate *current_isolate;
+
+// The innermost Env of the code running in the current isolate
+static inline Env *current_env(void) {
+    return current_isolate->env.current;
+}
+
+Isolate *isolate_new(void);
+// Make `iso` the calling thread's current isolate; NULL for none
+void isolate_enter(Isolate *iso);
+// Free the isolate and everything allocated in it. If it is the calling
+// thread's current isolate, the thread is left without one.
+void isolate_free(Isolate *iso);
+
+#endif
@@ -1,254 +1,382 @@
 #include "lexer.h"
+#include "isolate.h"
+#include "scan.h"
 #include "util.h"
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
-static const char *src = NULL;
-static size_t pos = 0;
-static char ch = 0;
+// Where tokenize is in the text it is splitting up
+typedef struct {
+    const char *src;
+    const char *end;
+    const Scanner *scan;
+    size_t pos;
+    char ch;
+    int line;
+    int more;           // more input follows (init_lexer_piece)
+} Lexer;
 
-static Token token;
-static Token next;
-static int has_next = 0;
+// The source need not be NUL-terminated: reading past the end gives 0
+static char char_at(Lexer *lx, size_t i) {
+    return lx->src + i < lx->end ? lx->src[i] : 0;
+}
 
-static void advance_char() {
-    if (ch) {
-        pos++;
-        ch = src[pos];
+static void advance_char(Lexer *lx) {
+    if (lx->ch) {
+        if (lx->ch == '\n') lx->line++;
+        lx->pos++;
+        lx->ch = char_at(lx, lx->pos);
     }
 }
 
-static void skip_ws() {
+// Move to `p`, found by a scanner; the skipped text holds no newline
+static void skip_to(Lexer *lx, const char *p) {
+    lx->pos = p - lx->src;
+    lx->ch = char_at(lx, lx->pos);
+}
+
+static void skip_ws(Lexer *lx) {
     while (1) {
-        if (isspace((unsigned char)ch)) {
-            advance_char();
-        } else if (ch == '/') {
-            size_t saved_pos = pos;
-            char saved_ch = ch;
-            advance_char();
-            if (ch == '/') {
-                // Single line comment - skip to end of line
-                while (ch && ch != '\n') {
-                    advance_char();
-                }
-                if (ch == '\n') advance_char();
-            } else {
-                // Not a comment, restore position
-                pos = saved_pos;
-                ch = saved_ch;
-                break;
-            }
+        if (lx->ch == '\n') {
+            advance_char(lx);
+        } else if (isspace((unsigned char)lx->ch)) {
+            skip_to(lx, lx->scan->blanks(lx->src + lx->pos, lx->end));
+        } else if (lx->ch == '/' && char_at(lx, lx->pos + 1) == '/') {
+            // Single line comment - skip to end of line
+            skip_to(lx, lx->scan->line(lx->src + lx->pos, lx->end));
         } else {
             break;
         }
     }
 }
 
-static Token make(TokenType t) {
-    Token x; x.type = t; x.lexeme[0]=0; x.number=0;
-    return x;
+static TokenType number_tok(Lexer *lx) {
+    while (isdigit((unsigned char)lx->ch) || lx->ch=='.') {
+        advance_char(lx);
+    }
+    return TOKEN_NUMBER;
 }
 
-static Token number_tok() {
-    char buf[64]; size_t n=0;
-    while (isdigit((unsigned char)ch) || ch=='.') {
-        if (n<63) buf[n++]=ch;
-        advance_char();
-    }
-    buf[n]=0;
-    Token t = make(TOKEN_NUMBER);
-    t.number = atof(buf);
-    return t;
+static int span_is(const char *s, size_t len, const char *kw) {
+    return strncmp(s, kw, len) == 0 && kw[len] == 0;
 }
 
-static Token ident_or_kw() {
-    char buf[64]; size_t n=0;
-    while (isalnum((unsigned char)ch) || ch=='_') {
-        if (n<63) buf[n++]=ch;
-        advance_char();
-    }
-    buf[n]=0;
-
-    if (strcmp(buf,"let")==0)
-        return make(TOKEN_LET);
-    if (strcmp(buf,"function")==0)
-        return make(TOKEN_FUNCTION);
-    if (strcmp(buf,"return")==0)
-        return make(TOKEN_RETURN);
-    if (strcmp(buf,"if")==0)
-        return make(TOKEN_IF);
-    if (strcmp(buf,"else")==0)
-        return make(TOKEN_ELSE);
-    if (strcmp(buf,"while")==0)
-        return make(TOKEN_WHILE);
-    if (strcmp(buf,"try")==0)
-        return make(TOKEN_TRY);
-    if (strcmp(buf,"catch")==0)
-        return make(TOKEN_CATCH);
-    if (strcmp(buf,"finally")==0)
-        return make(TOKEN_FINALLY);
-    if (strcmp(buf,"throw")==0)
-        return make(TOKEN_THROW);
-    if (strcmp(buf,"true")==0)
-        return make(TOKEN_TRUE);
-    if (strcmp(buf,"false")==0)
-        return make(TOKEN_FALSE);
-
-    Token t = make(TOKEN_IDENTIFIER);
-    strcpy(t.lexeme, buf);
-    return t;
+// Perfect hash of the keywords on length, first and last character: every
+// keyword has a bucket of its own, so any word needs one table probe and
+// at most one memcmp. The multipliers were found by a brute-force search;
+// adding a keyword means searching again.
+#define KEYWORD_HASH(s, n) (((n) + (unsigned char)(s)[0] * 9 + \
+                             (unsigned char)(s)[(n) - 1] * 15) & 15)
+
+typedef struct {
+    const char *word;
+    size_t length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[16] = {
+    [0]  = { "function", 8, TOKEN_FUNCTION },
+    [2]  = { "throw",    5, TOKEN_THROW },
+    [3]  = { "true",     4, TOKEN_TRUE },
+    [4]  = { "finally",  7, TOKEN_FINALLY },
+    [6]  = { "false",    5, TOKEN_FALSE },
+    [8]  = { "catch",    5, TOKEN_CATCH },
+    [10] = { "return",   6, TOKEN_RETURN },
+    [11] = { "let",      3, TOKEN_LET },
+    [12] = { "else",     4, TOKEN_ELSE },
+    [13] = { "if",       2, TOKEN_IF },
+    [14] = { "try",      3, TOKEN_TRY },
+    [15] = { "while",    5, TOKEN_WHILE },
+};
+
+static TokenType ident_or_kw(Lexer *lx) {
+    size_t start = lx->pos;
+    skip_to(lx, lx->scan->ident(lx->src + lx->pos + 1, lx->end));
+    const char *s = lx->src + start;
+    size_t n = lx->pos - start;
+
+    const Keyword *kw = &keywords[KEYWORD_HASH(s, n)];
+    if (kw->length == n && memcmp(kw->word, s, n) == 0) return kw->type;
+    return TOKEN_IDENTIFIER;
 }
 
-static Token string_tok() {
-    char quote = ch;  // ' or "
-    advance_char();
-    
-    char buf[256]; 
-    size_t n = 0;
+// Only finds the end of the literal; escapes are decoded by token_text
+static TokenType string_tok(Lexer *lx) {
+    char quote = lx->ch;  // ' or "
+    advance_char(lx);
     
-    while (ch && ch != quote && n < 255) {
-        if (ch == '\\') {
-            advance_char();
-            if (ch == 'n') buf[n++] = '\n';
-            else if (ch == 't') buf[n++] = '\t';
-            else if (ch == '\\') buf[n++] = '\\';
-            else if (ch == quote) buf[n++] = quote;
-            else buf[n++] = ch;
-            advance_char();
-        } else {
-            buf[n++] = ch;
-            advance_char();
-        }
+    while (1) {
+        skip_to(lx, lx->scan->string(lx->src + lx->pos, lx->end, quote));
+        if (lx->ch == quote || !lx->ch) break;
+        if (lx->ch == '\\') advance_char(lx);
+        advance_char(lx);
     }
-    buf[n] = 0;
     
-    if (ch == quote) advance_char();
-    else {
-        fprintf(stderr, "Unterminated string\n");
-        exit(1);
+    if (lx->ch == quote) advance_char(lx);
+    else if (!lx->more) {
+        fprintf(isolate_stderr(), "Unterminated string\n");
+        isolate_exit(1);
     }
-    
-    Token t = make(TOKEN_STRING);
-    strcpy(t.lexeme, buf);
-    return t;
+    return TOKEN_STRING;
 }
 
-static Token next_token() {
-    skip_ws();
-
-    if (!ch) return make(TOKEN_EOF);
-    if (isdigit((unsigned char)ch)) return number_tok();
-    if (ch == '"' || ch == '\'') return string_tok();
-    if (isalpha((unsigned char)ch) || ch=='_') return ident_or_kw();
+static TokenType scan_token(Lexer *lx) {
+    char ch = lx->ch;
+    if (!ch) return TOKEN_EOF;
+    if (isdigit((unsigned char)ch)) return number_tok(lx);
+    if (ch == '"' || ch == '\'') return string_tok(lx);
+    if (isalpha((unsigned char)ch) || ch=='_') return ident_or_kw(lx);
 
-    Token t;
+    char c = ch;
+    advance_char(lx);
+    ch = lx->ch;
 
-    switch (ch) {
-        case '+': t=make(TOKEN_PLUS);   advance_char(); return t;
-        case '-': t=make(TOKEN_MINUS);  advance_char(); return t;
-        case '*': t=make(TOKEN_STAR);   advance_char(); return t;
-        case '/': t=make(TOKEN_SLASH);  advance_char(); return t;
-        case ';': t=make(TOKEN_SEMI);   advance_char(); return t;
-        case '(': t=make(TOKEN_LPAREN); advance_char(); return t;
-        case ')': t=make(TOKEN_RPAREN); advance_char(); return t;
-        case '{': t=make(TOKEN_LBRACE); advance_char(); return t;
-        case '}': t=make(TOKEN_RBRACE); advance_char(); return t;
-        case '[': t=make(TOKEN_LBRACKET); advance_char(); return t;
-        case ']': t=make(TOKEN_RBRACKET); advance_char(); return t;
-        case ',': t=make(TOKEN_COMMA);  advance_char(); return t;
-        case ':': t=make(TOKEN_COLON);  advance_char(); return t;
-        case '.': t=make(TOKEN_DOT);    advance_char(); return t;
+    switch (c) {
+        case '+': return TOKEN_PLUS;
+        case '-': return TOKEN_MINUS;
+        case '*': return TOKEN_STAR;
+        case '/': return TOKEN_SLASH;
+        case ';': return TOKEN_SEMI;
+        case '(': return TOKEN_LPAREN;
+        case ')': return TOKEN_RPAREN;
+        case '{': return TOKEN_LBRACE;
+        case '}': return TOKEN_RBRACE;
+        case '[': return TOKEN_LBRACKET;
+        case ']': return TOKEN_RBRACKET;
+        case ',': return TOKEN_COMMA;
+        case ':': return TOKEN_COLON;
+        case '.': return TOKEN_DOT;
         case '=':
-            advance_char();
-            if (ch == '=') {
-                t = make(TOKEN_EQ);
-                advance_char();
-            } else {
-                t = make(TOKEN_ASSIGN);
-            }
-            return t;
+            if (ch != '=') return TOKEN_ASSIGN;
+            advance_char(lx);
+            return TOKEN_EQ;
         case '!':
-            advance_char();
-            if (ch == '=') {
-                t = make(TOKEN_NE);
-                advance_char();
-            } else {
-                t = make(TOKEN_NOT);
-            }
-            return t;
+            if (ch != '=') return TOKEN_NOT;
+            advance_char(lx);
+            return TOKEN_NE;
         case '<':
-            advance_char();
-            if (ch == '=') {
-                t = make(TOKEN_LE);
-                advance_char();
-            } else {
-                t = make(TOKEN_LT);
-            }
-            return t;
+            if (ch != '=') return TOKEN_LT;
+            advance_char(lx);
+            return TOKEN_LE;
         case '>':
-            advance_char();
-            if (ch == '=') {
-                t = make(TOKEN_GE);
-                advance_char();
-            } else {
-                t = make(TOKEN_GT);
-            }
-            return t;
+            if (ch != '=') return TOKEN_GT;
+            advance_char(lx);
+            return TOKEN_GE;
         case '&':
-            advance_char();
             if (ch == '&') {
-                t = make(TOKEN_AND);
-                advance_char();
-                return t;
+                advance_char(lx);
+                return TOKEN_AND;
             }
+            c = ch;
             break;
         case '|':
-            advance_char();
             if (ch == '|') {
-                t = make(TOKEN_OR);
-                advance_char();
-                return t;
+                advance_char(lx);
+                return TOKEN_OR;
             }
+            c = ch;
             break;
     }
+    // The second character may be in the next piece
+    if (!c && lx->more) return TOKEN_EOF;
 
-    fprintf(stderr,"Unexpected character '%c'\n", ch);
-    exit(1);
+    fprintf(isolate_stderr(), "Unexpected character '%c'\n", c);
+    isolate_exit(1);
 }
 
-void init_lexer(const char *s) {
-    src = s;
-    pos = 0;
-    ch = src[0];
-    has_next = 0;
-    advance_token();
+static double number_value(Lexer *lx, size_t start, size_t length) {
+    // The span is followed by more source, so copy it out first
+    char buf[64];
+    char *text = length < sizeof(buf) ? buf : malloc(length + 1);
+    if (!text) fatal("Out of memory");
+    memcpy(text, lx->src + start, length);
+    text[length] = 0;
+    double v = atof(text);
+    if (text != buf) free(text);
+    return v;
 }
 
-void advance_token() {
-    if (has_next) {
-        token = next;
-        has_next = 0;
-    } else {
-        token = next_token();
+static void grow_stream(TokenStream *ts) {
+    ts->capacity = ts->capacity ? ts->capacity * 2 : 256;
+    ts->types = realloc(ts->types, ts->capacity);
+    ts->starts = realloc(ts->starts, sizeof(unsigned int) * ts->capacity);
+    ts->lengths = realloc(ts->lengths, sizeof(unsigned int) * ts->capacity);
+    ts->lines = realloc(ts->lines, sizeof(int) * ts->capacity);
+    ts->numbers = realloc(ts->numbers, sizeof(double) * ts->capacity);
+    if (!ts->types || !ts->starts || !ts->lengths || !ts->lines || !ts->numbers) {
+        fatal("Out of memory");
     }
 }
 
+static void tokenize_from(TokenStream *ts, const char *s, size_t length,
+                          int first_line, int more) {
+    Lexer lexer;
+    Lexer *lx = &lexer;
+    lx->src = s;
+    lx->end = s + length;
+    lx->scan = scanner();
+    lx->pos = 0;
+    lx->ch = char_at(lx, 0);
+    lx->line = first_line;
+    lx->more = more;
+
+    ts->types = NULL;
+    ts->starts = ts->lengths = NULL;
+    ts->lines = NULL;
+    ts->numbers = NULL;
+    ts->count = ts->capacity = 0;
+    ts->partial = 0;
+
+    TokenType type;
+    do {
+        // A piece ends at the start of the blanks or token that runs into
+        // its end, since either may go on in the next piece
+        size_t blank_start = lx->pos;
+        int blank_line = lx->line;
+        skip_ws(lx);
+        if (ts->count >= ts->capacity) grow_stream(ts);
+
+        size_t start = lx->pos;
+        int i = ts->count++;
+        ts->lines[i] = lx->line;
+        type = scan_token(lx);
+        size_t length = lx->pos - start;
+        if (more && lx->src + lx->pos == lx->end) {
+            type = TOKEN_EOF;
+            start = blank_start;
+            length = 0;
+            ts->lines[i] = blank_line;
+            ts->partial = 1;
+        }
+        ts->numbers[i] = type == TOKEN_NUMBER ? number_value(lx, start, length) : 0;
+        if (type == TOKEN_STRING) {
+            // Just the text between the quotes
+            start++;
+            length -= 2;
+        }
+        if (start > UINT_MAX || length > UINT_MAX) fatal("Source too large");
+        ts->types[i] = type;
+        ts->starts[i] = start;
+        ts->lengths[i] = length;
+    } while (type != TOKEN_EOF);
+}
+
+void tokenize(TokenStream *ts, const char *s, size_t length) {
+    tokenize_from(ts, s, length, 1, 0);
+}
+
+void free_token_stream(TokenStream *ts) {
+    free(ts->types);
+    free(ts->starts);
+    free(ts->lengths);
+    free(ts->lines);
+    free(ts->numbers);
+    ts->count = ts->capacity = 0;
+}
+
+static LexerState *state(void) {
+    return &current_isolate->lexer;
+}
+
+void init_lexer(const char *s, size_t length) {
+    init_lexer_piece(s, length, 1, 1, 0);
+}
+
+void init_lexer_piece(const char *s, size_t length, int first_line,
+                      int column, int more_input) {
+    LexerState *l = state();
+    free_token_stream(&l->stream);
+    tokenize_from(&l->stream, s, length, first_line, more_input);
+    l->source = s;
+    l->first_column = column;
+    l->cursor = 0;
+}
+
+void free_lexer(void) {
+    free_token_stream(&state()->stream);
+}
+
+const TokenStream *token_stream(void) {
+    return &state()->stream;
+}
+
+void advance_token() {
+    LexerState *l = state();
+    if (l->cursor < l->stream.count - 1) l->cursor++;
+}
+
+void seek_token(int index) {
+    LexerState *l = state();
+    l->cursor = index < l->stream.count ? index : l->stream.count - 1;
+}
+
+Token token_at(int offset) {
+    LexerState *l = state();
+    int i = l->cursor + offset;
+    if (i >= l->stream.count) i = l->stream.count - 1;
+    Token t;
+    t.type = (TokenType)l->stream.types[i];
+    t.start = l->stream.starts[i];
+    t.length = l->stream.lengths[i];
+    t.index = i;
+    return t;
+}
+
 Token current_tok() {
-    return token;
+    return token_at(0);
 }
 
 Token peek_token() {
-    if (!has_next) {
-        next = next_token();
-        has_next = 1;
-    }
-    return next;
+    return token_at(1);
 }
 
 void expect(TokenType t, const char *msg) {
-    if (token.type != t) {
-        fprintf(stderr,"Parse error: %s\n", msg);
-        exit(1);
+    Token tok = current_tok();
+    if (tok.type != t) {
+        LexerState *l = state();
+        // Column of the token's first character, counting from the line start
+        size_t start = tok.start - (tok.type == TOKEN_STRING);
+        size_t line_begin = start;
+        while (line_begin > 0 && l->source[line_begin - 1] != '\n') line_begin--;
+        // A piece's first line may have begun in text already dropped
+        int column = line_begin == 0 ? l->first_column : 1;
+        fprintf(isolate_stderr(), "Parse error at line %d, column %d: %s\n",
+                l->stream.lines[tok.index], (int)(start - line_begin) + column, msg);
+        isolate_exit(1);
     }
     advance_token();
 }
+
+const char *token_chars(Token t) {
+    return state()->source + t.start;
+}
+
+int token_is(Token t, const char *s) {
+    return span_is(state()->source + t.start, t.length, s);
+}
+
+double token_number(Token t) {
+    return state()->stream.numbers[t.index];
+}
+
+size_t token_text(Token t, char *out) {
+    const char *s = state()->source + t.start;
+    size_t n = 0;
+    if (t.type != TOKEN_STRING) {
+        memcpy(out, s, t.length);
+        n = t.length;
+    } else {
+        for (size_t i = 0; i < t.length; i++) {
+            char c = s[i];
+            if (c == '\\' && i + 1 < t.length) {
+                c = s[++i];
+                if (c == 'n') c = '\n';
+                else if (c == 't') c = '\t';
+            }
+            out[n++] = c;
+        }
+    }
+    out[n] = 0;
+    return n;
+}
@@ -46,16 +46,67 @@ typedef enum {
     TOKEN_COLON
 } TokenType;
 
+// The whole source is tokenized up front into parallel arrays, which the
+// parser walks with a cursor. Offsets point into the source buffer, which
+// must outlive the stream; it need not be NUL-terminated. For strings the
+// span is the text between the quotes, escapes undecoded.
+typedef struct {
+    unsigned char *types;   // TokenType
+    unsigned int *starts;
+    unsigned int *lengths;
+    int *lines;             // 1-based
+    double *numbers;        // value of TOKEN_NUMBER entries
+    int count;              // including the final TOKEN_EOF
+    int capacity;
+    int partial;            // the final TOKEN_EOF is only the end of a piece
+} TokenStream;
+
+void tokenize(TokenStream *ts, const char *source, size_t length);
+void free_token_stream(TokenStream *ts);
+
+// One entry of the stream being parsed
 typedef struct {
     TokenType type;
-    char lexeme[256];
-    double number;
+    unsigned int start;     // offset into the source
+    unsigned int length;
+    int index;              // position in the stream
 } Token;
 
-void init_lexer(const char *source);
+// The stream the parser is reading, one per isolate (isolate.h)
+typedef struct {
+    const char *source;
+    TokenStream stream;
+    int cursor;
+    int first_column;       // of the source's first line
+} LexerState;
+
+// Tokenize `source` and put the cursor on the first token
+void init_lexer(const char *source, size_t length);
+// For input read in pieces (main.c): `source` starts at `column` of line
+// `first_line`. With `more_input` set the input goes on after it, so the
+// token or blanks running into its end may be cut short: the stream stops
+// before them, with `partial` set, and the caller tokenizes again from
+// there once more input has arrived.
+void init_lexer_piece(const char *source, size_t length, int first_line,
+                      int column, int more_input);
+void free_lexer(void);
+const TokenStream *token_stream(void);
 void advance_token(void);
 Token current_tok(void);
 Token peek_token(void);
+// Move the cursor to the token at `index` in the stream
+void seek_token(int index);
+// The token `offset` places after the current one; TOKEN_EOF past the end
+Token token_at(int offset);
 void expect(TokenType type, const char *msg);
 
+// These read the source most recently passed to init_lexer
+const char *token_chars(Token t);
+// Whether the token's text is exactly `s`
+int token_is(Token t, const char *s);
+double token_number(Token t);
+// Write the token's text, with escapes decoded for strings, and a NUL to
+// `out`, which must have room for t.length + 1 bytes. Returns the length.
+size_t token_text(Token t, char *out);
+
 #endif
@@ -1,70 +1,664 @@
+#define _POSIX_C_SOURCE 200809L
 #include "../include/mini_js.h"
+#include "util.h"
+#include "cache.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static char *read_entire(const char *path) {
-    FILE *f = fopen(path,"rb");
-    if (!f) { perror("fopen"); exit(1); }
+// A script's text: mapped straight from the file when possible, otherwise
+// read into memory. Either way it is not NUL-terminated.
+typedef struct {
+    char *data;
+    size_t length;
+    int mapped;
+} Source;
 
-    fseek(f,0,SEEK_END);
-    long len = ftell(f);
-    fseek(f,0,SEEK_SET);
+static void read_all(int fd, Source *s) {
+    size_t capacity = 64 * 1024;
+    s->data = malloc(capacity);
+    s->length = 0;
+    s->mapped = 0;
+    if (!s->data) fatal("Out of memory");
+    while (1) {
+        if (s->length == capacity) {
+            capacity *= 2;
+            s->data = realloc(s->data, capacity);
+            if (!s->data) fatal("Out of memory");
+        }
+        ssize_t n = read(fd, s->data + s->length, capacity - s->length);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(isolate_stderr(), "read: %s\n", strerror(errno));
+            isolate_exit(1);
+        }
+        s->length += n;
+    }
+}
+
+// "-" reads standard input (--lex-only; scripts stream it). Regular files are mapped; pipes, terminals
+// and empty files (which cannot be mapped) are read.
+static void load_source(const char *path, Source *s) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(isolate_stderr(), "open: %s\n", strerror(errno));
+        isolate_exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+            s->data = p;
+            s->length = st.st_size;
+            s->mapped = 1;
+            if (fd != STDIN_FILENO) close(fd);
+            return;
+        }
+    }
+    read_all(fd, s);
+    if (fd != STDIN_FILENO) close(fd);
+}
+
+static void free_source(Source *s) {
+    if (s->mapped) munmap(s->data, s->length);
+    else free(s->data);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// What running statements needs, and the totals for --timings and
+// --ast-stats
+typedef struct {
+    int use_vm;
+    int optimize;           // run the AST optimizer; off with --no-opt
+    int parse_threads;
+    int lazy;               // parse top-level function bodies on first call
+    Arena arena;
+    size_t ast_bytes;
+    double lex_ms;
+    double parse_ms;
+    double resolve_ms;      // resolver and optimizer
+    double compile_ms;
+    // The compiled-script cache, with the VM and --cache-dir only
+    ScriptCache *cache;
+    const char *cache_dir;
+    int cached;             // the script ran from a cache entry
+    double load_ms;
+} Runner;
+
+// Parse and run the next statement, for streaming mode. The VM compiles
+// each statement and is done with its tree, so the arena is reused.
+// Function values made by the tree walker point into their statement's
+// tree, so it keeps everything until exit.
+static void run_statement(Runner *r) {
+    double parse_start = now_ms();
+    ASTNode *st = parse_statement();
+    r->parse_ms += now_ms() - parse_start;
+    double resolve_start = now_ms();
+    resolve(st);
+    if (r->optimize) st = optimize(st);
+    r->resolve_ms += now_ms() - resolve_start;
+
+    if (r->use_vm) {
+        double compile_start = now_ms();
+        FuncProto *script = compile(st);
+        r->compile_ms += now_ms() - compile_start;
+        r->ast_bytes += r->arena.bytes;
+        arena_reset(&r->arena);
+        if (r->cache) cache_add_script(r->cache, script);
+        vm_run(script);
+    } else {
+        eval(st);
+    }
+    gc_maybe_collect();
+}
+
+// Resolve and optimize every statement, then run them in order. The VM
+// compiles each statement just before running it, so the collector never
+// sees a compiled script that is not yet loaded; the tree is kept until
+// the end either way.
+static void run_program(Runner *r, Program *p) {
+    double start = now_ms();
+    resolve_program(p);
+    for (int i = 0; r->optimize && i < p->count; i++) {
+        p->statements[i] = optimize(p->statements[i]);
+    }
+    r->resolve_ms += now_ms() - start;
+
+    for (int i = 0; i < p->count; i++) {
+        if (r->use_vm) {
+            double compile_start = now_ms();
+            FuncProto *script = compile(p->statements[i]);
+            r->compile_ms += now_ms() - compile_start;
+            if (r->cache) cache_add_script(r->cache, script);
+            vm_run(script);
+        } else {
+            eval(p->statements[i]);
+        }
+        gc_maybe_collect();
+    }
+    r->ast_bytes += r->arena.bytes;
+    if (r->use_vm) arena_reset(&r->arena);
+}
+
+// Run a whole script: from its cache entry when there is a valid one,
+// otherwise by parsing all of it and running the Program, and then write
+// the entry
+static void run_source(Runner *r, const Source *src) {
+    double start = now_ms();
+    if (r->cache && cache_open(r->cache, r->cache_dir, src->data, src->length, r->optimize)) {
+        r->cached = 1;
+        r->load_ms = now_ms() - start;
+        for (int i = 0; i < r->cache->script_count; i++) {
+            double load_start = now_ms();
+            FuncProto *script = cache_script(r->cache, i);
+            r->load_ms += now_ms() - load_start;
+            vm_run(script);
+            gc_maybe_collect();
+        }
+        return;
+    }
+    init_lexer(src->data, src->length);
+    r->lex_ms += now_ms() - start;
+    double parse_start = now_ms();
+    // A cache entry needs every function compiled
+    ParseOptions options = { r->parse_threads, r->lazy && !r->cache, r->optimize };
+    Program *p = parse_program(&options);
+    r->parse_ms += now_ms() - parse_start;
+    run_program(r, p);
+    if (r->cache) cache_save(r->cache);
+}
+
+#define CHUNK_SIZE (64 * 1024)
+
+// Whether more input arrives within `ms` milliseconds
+static int input_waiting(int fd, int ms) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, ms) > 0;
+}
+
+// Streaming mode for "-": the input is read in chunks and each top-level
+// statement runs as soon as it is complete. Only the text from the first
+// statement not yet run is kept, so the buffer is bounded by the largest
+// statement rather than the input. Returns the number of bytes read.
+static size_t run_stream(int fd, Runner *r) {
+    size_t capacity = CHUNK_SIZE;
+    size_t length = 0;
+    size_t total = 0;
+    size_t tried = 0;   // pending text at the last attempt
+    int line = 1;
+    int column = 1;
+    int eof = 0;
+    char *buf = malloc(capacity);
+    if (!buf) fatal("Out of memory");
+
+    while (!eof) {
+        if (length == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+            if (!buf) fatal("Out of memory");
+        }
+        // Show what has run before waiting for more
+        fflush(current_isolate->out);
+        ssize_t n = read(fd, buf + length, capacity - length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(isolate_stderr(), "read: %s\n", strerror(errno));
+            isolate_exit(1);
+        }
+        if (n == 0) eof = 1;
+        length += n;
+        total += n;
+        // Each attempt tokenizes the pending text again, so while input
+        // keeps coming, hold off until it has doubled
+        if (!eof && length < 2 * tried && input_waiting(fd, 10)) continue;
+
+        double lex_start = now_ms();
+        init_lexer_piece(buf, length, line, column, !eof);
+        r->lex_ms += now_ms() - lex_start;
+        while (current_tok().type != TOKEN_EOF && statement_ready()) {
+            run_statement(r);
+        }
+
+        // Drop the text of the statements that ran
+        Token next = current_tok();
+        size_t keep = next.start - (next.type == TOKEN_STRING);
+        size_t line_begin = keep;
+        while (line_begin > 0 && buf[line_begin - 1] != '\n') line_begin--;
+        column = (line_begin == 0 ? column : 1) + (int)(keep - line_begin);
+        line = token_stream()->lines[next.index];
+        memmove(buf, buf + keep, length - keep);
+        length -= keep;
+        tried = length;
+    }
+    free(buf);
+    return total;
+}
+
+// Batch mode: many scripts run on a pool of threads, each in an isolate
+// of its own, with their output captured and printed in list order.
+typedef struct {
+    const char *path;
+    char *out;              // captured print output
+    size_t out_length;
+    char *err;              // captured error messages
+    size_t err_length;
+    int status;             // isolate_exit status; 0 when the script ran to the end
+    double ms;
+    int done;
+} Job;
+
+// A worker's share of the jobs, the range [head, tail). The owner takes
+// from the head; an idle worker steals the back half.
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} Deque;
+
+typedef struct Batch Batch;
+
+typedef struct {
+    Batch *batch;
+    int id;
+    Deque deque;
+    // Outside the stack frame that a script exit longjmps to
+    Runner runner;
+    Source source;
+    ScriptCache cache;
+} Worker;
 
-    char *buf = malloc(len+1);
-    fread(buf,1,len,f);
-    buf[len]=0;
-    fclose(f);
-    return buf;
+struct Batch {
+    Job *jobs;
+    int count;
+    Worker *workers;
+    int worker_count;
+    int use_vm;
+    int optimize;
+    int lazy;
+    size_t gc_threshold;
+    double gc_growth;
+    const char *cache_dir;
+    pthread_mutex_t output_lock;
+    int next_output;        // first job whose output has not been printed
+    int failed;
+};
+
+static int take_job(Deque *d) {
+    pthread_mutex_lock(&d->lock);
+    int job = d->head < d->tail ? d->head++ : -1;
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+// Steal half the remaining jobs of the first worker that has any. The
+// thief's own deque is empty, so the stolen range becomes its share.
+static int steal_job(Worker *w) {
+    Batch *b = w->batch;
+    for (int i = 1; i < b->worker_count; i++) {
+        Deque *victim = &b->workers[(w->id + i) % b->worker_count].deque;
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->tail - victim->head;
+        int start = victim->tail - (left + 1) / 2;
+        int end = victim->tail;
+        if (left > 0) victim->tail = start;
+        pthread_mutex_unlock(&victim->lock);
+        if (left <= 0) continue;
+
+        pthread_mutex_lock(&w->deque.lock);
+        w->deque.head = start + 1;
+        w->deque.tail = end;
+        pthread_mutex_unlock(&w->deque.lock);
+        return start;
+    }
+    return -1;
+}
+
+// Print the output of every finished job that is next in list order
+static void finish_job(Batch *b, Job *job) {
+    pthread_mutex_lock(&b->output_lock);
+    job->done = 1;
+    if (job->status != 0) b->failed++;
+    while (b->next_output < b->count && b->jobs[b->next_output].done) {
+        Job *j = &b->jobs[b->next_output++];
+        printf("==> %s <==\n", j->path);
+        fwrite(j->out, 1, j->out_length, stdout);
+        if (j->status != 0) {
+            fprintf(stderr, "==> %s <== exit status %d\n", j->path, j->status);
+            fwrite(j->err, 1, j->err_length, stderr);
+        }
+        free(j->out);
+        free(j->err);
+        j->out = j->err = NULL;
+    }
+    pthread_mutex_unlock(&b->output_lock);
+}
+
+static void run_job(Worker *w, Job *job) {
+    Batch *b = w->batch;
+    double start = now_ms();
+    Isolate *iso = isolate_new();
+    isolate_enter(iso);
+    gc_configure(b->gc_threshold, b->gc_growth);
+    FILE *out = open_memstream(&job->out, &job->out_length);
+    FILE *err = open_memstream(&job->err, &job->err_length);
+    if (!out || !err) fatal("Out of memory");
+    iso->out = out;
+    iso->err = err;
+
+    Runner *r = &w->runner;
+    r->use_vm = b->use_vm;
+    r->optimize = b->optimize;
+    // The scripts themselves already run in parallel
+    r->parse_threads = 1;
+    r->lazy = b->lazy;
+    r->cache = b->use_vm && b->cache_dir ? &w->cache : NULL;
+    r->cache_dir = b->cache_dir;
+    arena_init(&r->arena);
+    ast_use_arena(&r->arena);
+    w->source.data = NULL;
+
+    jmp_buf exit_jmp;
+    iso->exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) == 0) {
+        load_source(job->path, &w->source);
+        run_source(r, &w->source);
+        job->status = 0;
+    } else {
+        job->status = iso->exit_status;
+    }
+
+    isolate_free(iso);
+    arena_free(&r->arena);
+    cache_close(&w->cache);
+    if (w->source.data) free_source(&w->source);
+    fclose(out);
+    fclose(err);
+    job->ms = now_ms() - start;
+    finish_job(b, job);
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    int job;
+    while ((job = take_job(&w->deque)) >= 0 || (job = steal_job(w)) >= 0) {
+        run_job(w, &w->batch->jobs[job]);
+    }
+    return NULL;
+}
+
+// One path per line; blank lines and lines starting with '#' are skipped
+static Job *read_job_list(const char *path, int *count) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) { perror("open"); exit(1); }
+    Job *jobs = NULL;
+    int capacity = 0;
+    *count = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_capacity, f)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' ||
+                         line[n - 1] == ' ' || line[n - 1] == '\t')) {
+            line[--n] = '\0';
+        }
+        if (n == 0 || line[0] == '#') continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, sizeof(Job) * capacity);
+            if (!jobs) fatal("Out of memory");
+        }
+        Job *job = &jobs[(*count)++];
+        memset(job, 0, sizeof(Job));
+        job->path = strdup(line);
+        if (!job->path) fatal("Out of memory");
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    return jobs;
 }
 
-static ASTNode **function_asts = NULL;
-static int function_count = 0;
-static int function_capacity = 0;
+static int compare_ms(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted latencies
+static double percentile(const double *sorted, int count, double p) {
+    int rank = (int)(p * count + 0.999999);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+static int run_batch(const char *list, int threads, int use_vm, int optimize, int lazy,
+                     size_t gc_threshold, double gc_growth, const char *cache_dir) {
+    Batch b;
+    memset(&b, 0, sizeof(b));
+    b.jobs = read_job_list(list, &b.count);
+    if (threads < 1) threads = 1;
+    if (threads > b.count && b.count > 0) threads = b.count;
+    b.worker_count = threads;
+    b.use_vm = use_vm;
+    b.optimize = optimize;
+    b.lazy = lazy;
+    b.gc_threshold = gc_threshold;
+    b.gc_growth = gc_growth;
+    b.cache_dir = cache_dir;
+    pthread_mutex_init(&b.output_lock, NULL);
+    b.workers = calloc(threads, sizeof(Worker));
+    if (!b.workers) fatal("Out of memory");
+
+    double start = now_ms();
+    for (int i = 0; i < threads; i++) {
+        Worker *w = &b.workers[i];
+        w->batch = &b;
+        w->id = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->deque.head = (int)((long)b.count * i / threads);
+        w->deque.tail = (int)((long)b.count * (i + 1) / threads);
+    }
+    // The main thread is worker 0
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    if (!tids) fatal("Out of memory");
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, worker_main, &b.workers[i]) != 0) {
+            fatal("Cannot create thread");
+        }
+    }
+    worker_main(&b.workers[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_ms() - start;
+    fflush(stdout);
+
+    double *ms = malloc(sizeof(double) * (b.count ? b.count : 1));
+    if (!ms) fatal("Out of memory");
+    for (int i = 0; i < b.count; i++) {
+        ms[i] = b.jobs[i].ms;
+    }
+    qsort(ms, b.count, sizeof(double), compare_ms);
+    fprintf(stderr, "Batch: %d scripts, %d failed, %d threads, %.3f ms (%.1f scripts/s)\n",
+            b.count, b.failed, threads, elapsed,
+            elapsed > 0 ? b.count * 1000.0 / elapsed : 0.0);
+    if (b.count > 0) {
+        fprintf(stderr, "Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                percentile(ms, b.count, 0.50), percentile(ms, b.count, 0.90),
+                percentile(ms, b.count, 0.99), ms[b.count - 1]);
+    }
 
-static void save_function_ast(ASTNode *ast) {
-    if (function_capacity == 0) {
-        function_capacity = 16;
-        function_asts = malloc(sizeof(ASTNode*) * function_capacity);
+    int failed = b.failed;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&b.workers[i].deque.lock);
     }
-    if (function_count >= function_capacity) {
-        function_capacity *= 2;
-        function_asts = realloc(function_asts, sizeof(ASTNode*) * function_capacity);
+    pthread_mutex_destroy(&b.output_lock);
+    for (int i = 0; i < b.count; i++) {
+        free((char*)b.jobs[i].path);
     }
-    function_asts[function_count++] = ast;
+    free(ms);
+    free(tids);
+    free(b.workers);
+    free(b.jobs);
+    return failed ? 1 : 0;
 }
 
-static int is_function_declaration(ASTNode *n) {
-    return n && n->type == NODE_ASSIGN && n->left && n->left->type == NODE_FUNCTION;
+// Also runs when a script aborts, while its isolate is still current
+static void print_gc_stats(void) {
+    if (current_isolate) gc_print_stats(stderr);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [--engine=vm|ast] [--gc-stats] [--ast-stats] [--timings]\n"
+           "       [--lex-only] [--no-opt] [--lazy] [--gc-threshold=BYTES]\n"
+           "       [--gc-growth=FACTOR] [--cache-dir=DIR] [-j THREADS] file.js|-\n"
+           "       %s [--engine=vm|ast] [--no-opt] [--lazy] [--gc-threshold=BYTES]\n"
+           "       [--gc-growth=FACTOR] [--cache-dir=DIR] "
+           "--batch list.txt [-j THREADS]\n", prog, prog);
 }
 
 int main(int argc, char **argv) {
-    if (argc<2) {
-        printf("Usage: %s file.js\n", argv[0]);
+    int use_vm = 1;
+    int optimize = 1;
+    int lazy = 0;
+    int ast_stats = 0;
+    int lex_only = 0;
+    int timings = 0;
+    int gc_stats_wanted = 0;
+    size_t gc_threshold = 0;
+    double gc_growth = 0;
+    const char *path = NULL;
+    const char *batch_list = NULL;
+    const char *cache_dir = NULL;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine=vm") == 0) {
+            use_vm = 1;
+        } else if (strcmp(argv[i], "--engine=ast") == 0) {
+            use_vm = 0;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            // Registered with atexit so runs that abort still report
+            if (!gc_stats_wanted) atexit(print_gc_stats);
+            gc_stats_wanted = 1;
+        } else if (strcmp(argv[i], "--ast-stats") == 0) {
+            ast_stats = 1;
+        } else if (strcmp(argv[i], "--lex-only") == 0) {
+            lex_only = 1;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazy = 1;
+        } else if (strcmp(argv[i], "--no-opt") == 0) {
+            optimize = 0;
+        } else if (strcmp(argv[i], "--timings") == 0) {
+            timings = 1;
+        } else if (strncmp(argv[i], "--gc-threshold=", 15) == 0) {
+            gc_threshold = strtoull(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "--gc-growth=", 12) == 0) {
+            gc_growth = strtod(argv[i] + 12, NULL);
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            cache_dir = argv[i] + 12;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_list = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2]) {
+            threads = atoi(argv[i] + 2);
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (batch_list) {
+        return run_batch(batch_list, threads, use_vm, optimize, lazy, gc_threshold, gc_growth, cache_dir);
+    }
+    if (!path) {
+        usage(argv[0]);
         return 1;
     }
 
-    char *src = read_entire(argv[1]);
-    init_lexer(src);
+    Isolate *iso = isolate_new();
+    isolate_enter(iso);
+    gc_configure(gc_threshold, gc_growth);
+
+    ScriptCache cache;
+    Runner r;
+    memset(&r, 0, sizeof(r));
+    r.use_vm = use_vm;
+    r.optimize = optimize;
+    r.parse_threads = threads;
+    r.lazy = lazy;
+    r.cache = use_vm && cache_dir ? &cache : NULL;
+    r.cache_dir = cache_dir;
+    arena_init(&r.arena);
+    ast_use_arena(&r.arena);
+    double start = now_ms();
+
+    Source src = { NULL, 0, 0 };
+    size_t source_bytes;
+    if (strcmp(path, "-") == 0 && !lex_only) {
+        // Statements run as they arrive, before the whole text is known
+        r.cache = NULL;
+        source_bytes = run_stream(STDIN_FILENO, &r);
+    } else {
+        load_source(path, &src);
+        source_bytes = src.length;
+        if (lex_only) {
+            init_lexer(src.data, src.length);
+            // The identifier count comes last for bench/lexer.sh
+            const TokenStream *ts = token_stream();
+            long identifiers = 0;
+            for (int i = 0; i < ts->count; i++) {
+                if (ts->types[i] == TOKEN_IDENTIFIER) identifiers++;
+            }
+            printf("%d tokens\n%ld\n", ts->count - 1, identifiers);
+            free_source(&src);
+            isolate_free(iso);
+            return 0;
+        }
+        run_source(&r, &src);
+    }
+    if (!use_vm) r.ast_bytes = r.arena.bytes;
 
-    while (current_tok().type != TOKEN_EOF) {
-        ASTNode *st = parse_statement();
-        Value *result = eval(st);
-        free_value(result);
-        
-        // Don't free function declarations - they're needed later
-        if (is_function_declaration(st)) {
-            save_function_ast(st);
+    if (timings) {
+        double run_ms = now_ms() - start - r.lex_ms - r.parse_ms - r.resolve_ms -
+                        r.compile_ms - r.load_ms;
+        if (r.cached) {
+            fprintf(stderr, "Time: cache load %.3f ms, run %.3f ms\n", r.load_ms, run_ms);
         } else {
-            free_ast(st);
+            fprintf(stderr, "Time: lex %.3f ms, parse %.3f ms, resolve %.3f ms, ",
+                    r.lex_ms, r.parse_ms, r.resolve_ms);
+            if (use_vm) fprintf(stderr, "compile %.3f ms, ", r.compile_ms);
+            fprintf(stderr, "run %.3f ms\n", run_ms);
         }
     }
 
-    // Clean up function ASTs at the end
-    for (int i = 0; i < function_count; i++) {
-        free_ast(function_asts[i]);
+    if (ast_stats) {
+        size_t len = source_bytes;
+        fprintf(stderr, "AST: %zu bytes for %zu bytes of source (%.0f bytes per KB)\n",
+                r.ast_bytes, len, len ? r.ast_bytes * 1024.0 / len : 0.0);
     }
-    if (function_asts) free(function_asts);
 
-    free(src);
+    if (gc_stats_wanted) print_gc_stats();
+    isolate_free(iso);
+    arena_free(&r.arena);
+    if (r.cache) cache_close(r.cache);
+    if (src.data) free_source(&src);
     return 0;
 }
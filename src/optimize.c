@@ -0,0 +1,235 @@
+#include "optimize.h"
+#include "value.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The value of a number or boolean literal. Folding uses the same operator
+// functions as the engines, so folded results match what running the code
+// would give. String literals are folded on their text instead, so that
+// folding never allocates heap cells.
+static int constant(ASTNode *n, Value *out) {
+    if (!n) return 0;
+    switch (n->type) {
+        case NODE_NUMBER:  *out = new_number_val(n->as.number); return 1;
+        case NODE_BOOLEAN: *out = new_boolean_val(n->as.boolean); return 1;
+        default:           return 0;
+    }
+}
+
+static int is_string(ASTNode *n) {
+    return n && n->type == NODE_STRING;
+}
+
+// A literal node for `v`, or NULL when there is no literal syntax for it
+static ASTNode *literal(Value v) {
+    if (IS_NUMBER(v)) return new_number(AS_NUMBER(v));
+    if (IS_BOOL(v)) return new_boolean(AS_BOOL(v));
+    return NULL;
+}
+
+// 1 or 0 when `n` is a literal that is always truthy or falsy, else -1
+static int truthiness(ASTNode *n) {
+    Value v;
+    if (is_string(n)) return n->as.string[0] != '\0';
+    return constant(n, &v) ? value_is_truthy(v) : -1;
+}
+
+static ASTNode *empty_block(void) {
+    return new_block(NULL, 0);
+}
+
+// Whether control never reaches the statement after `n`
+static int terminates(ASTNode *n) {
+    switch (n->type) {
+        case NODE_RETURN:
+        case NODE_THROW:
+            return 1;
+        case NODE_BLOCK:
+            return n->as.list.count > 0 && terminates(n->as.list.items[n->as.list.count - 1]);
+        case NODE_IF:
+            return n->as.branch.else_branch &&
+                   terminates(n->as.branch.body) && terminates(n->as.branch.else_branch);
+        default:
+            return 0;
+    }
+}
+
+// The text of an operand of `+`, converted as value_arith converts it.
+// `converted` is set to a buffer the caller frees, or NULL.
+static const char *operand_text(ASTNode *n, Value v, char **converted) {
+    *converted = NULL;
+    if (is_string(n)) return n->as.string;
+    *converted = value_to_string(v);
+    return *converted;
+}
+
+// Comparisons and `+` with a string operand, as value_compare and
+// value_arith treat them. The other operators give null, which has no
+// literal.
+static ASTNode *fold_string(ASTNode *n, Value l, Value r) {
+    ASTNode *left = n->as.binary.left;
+    ASTNode *right = n->as.binary.right;
+    if (n->type == NODE_COMPARISON) {
+        if (!is_string(left) || !is_string(right)) return new_boolean(0);
+        int cmp = strcmp(left->as.string, right->as.string);
+        return new_boolean(value_compare(n->as.binary.op, new_number_val(cmp),
+                                         new_number_val(0)));
+    }
+    if (n->as.binary.op != ARITH_ADD) return n;
+
+    char *ca, *cb;
+    const char *a = operand_text(left, l, &ca);
+    const char *b = operand_text(right, r, &cb);
+    size_t alen = strlen(a), blen = strlen(b);
+    char *text = ast_alloc(alen + blen + 1);
+    memcpy(text, a, alen);
+    memcpy(text + alen, b, blen + 1);
+    free(ca);
+    free(cb);
+    return new_string(text);
+}
+
+static ASTNode *fold_binary(ASTNode *n) {
+    Value l = NULL_VAL, r = NULL_VAL;
+
+    if (n->type == NODE_LOGICAL) {
+        int left = truthiness(n->as.binary.left);
+        if (left < 0) return n;
+        switch (n->as.binary.op) {
+            case LOGIC_NOT:
+                return new_boolean(!left);
+            case LOGIC_AND:
+            case LOGIC_OR: {
+                // The right operand does not run when the left decides
+                if (left == (n->as.binary.op == LOGIC_OR)) return new_boolean(left);
+                int right = truthiness(n->as.binary.right);
+                return right < 0 ? n : new_boolean(right);
+            }
+        }
+        return n;
+    }
+
+    int left_string = is_string(n->as.binary.left);
+    int right_string = is_string(n->as.binary.right);
+    if (!left_string && !constant(n->as.binary.left, &l)) return n;
+    if (!right_string && !constant(n->as.binary.right, &r)) return n;
+    if (left_string || right_string) return fold_string(n, l, r);
+
+    if (n->type == NODE_COMPARISON) {
+        return new_boolean(value_compare(n->as.binary.op, l, r));
+    }
+    // Division by zero stays an error raised when the code runs
+    if (n->as.binary.op == ARITH_DIV && IS_NUMBER(r) && AS_NUMBER(r) == 0) return n;
+    ASTNode *folded = literal(value_arith(n->as.binary.op, l, r));
+    return folded ? folded : n;
+}
+
+static ASTNode *opt(ASTNode *n);
+
+static void opt_list(ASTNode **items, int count) {
+    for (int i = 0; i < count; i++) items[i] = opt(items[i]);
+}
+
+static ASTNode *opt_block(ASTNode *n) {
+    int kept = 0;
+    for (int i = 0; i < n->as.list.count; i++) {
+        // Statements after one that always returns or throws never run,
+        // so the list is cut short after it
+        ASTNode *item = opt(n->as.list.items[i]);
+        n->as.list.items[kept++] = item;
+        if (terminates(item)) break;
+    }
+    n->as.list.count = kept;
+    return n;
+}
+
+static ASTNode *opt(ASTNode *n) {
+    if (!n) return NULL;
+
+    switch (n->type) {
+        case NODE_BINOP:
+        case NODE_COMPARISON:
+        case NODE_LOGICAL:
+            n->as.binary.left = opt(n->as.binary.left);
+            n->as.binary.right = opt(n->as.binary.right);
+            return fold_binary(n);
+
+        case NODE_IF: {
+            n->as.branch.condition = opt(n->as.branch.condition);
+            n->as.branch.body = opt(n->as.branch.body);
+            n->as.branch.else_branch = opt(n->as.branch.else_branch);
+            int taken = truthiness(n->as.branch.condition);
+            if (taken == 1) return n->as.branch.body;
+            if (taken == 0) {
+                return n->as.branch.else_branch ? n->as.branch.else_branch : empty_block();
+            }
+            return n;
+        }
+
+        case NODE_WHILE:
+            n->as.branch.condition = opt(n->as.branch.condition);
+            if (truthiness(n->as.branch.condition) == 0) return empty_block();
+            n->as.branch.body = opt(n->as.branch.body);
+            return n;
+
+        case NODE_BLOCK:
+            return opt_block(n);
+
+        case NODE_ARRAY:
+            opt_list(n->as.list.items, n->as.list.count);
+            return n;
+
+        case NODE_OBJECT:
+            opt_list(n->as.object.values, n->as.object.count);
+            return n;
+
+        case NODE_CALL:
+            opt_list(n->as.call.args, n->as.call.arg_count);
+            return n;
+
+        case NODE_ASSIGN:
+            n->as.assign.value = opt(n->as.assign.value);
+            return n;
+
+        case NODE_FUNCTION:
+            n->as.function.body = opt(n->as.function.body);
+            return n;
+
+        case NODE_TRY:
+            n->as.try_stmt.try_block = opt(n->as.try_stmt.try_block);
+            n->as.try_stmt.catch_block = opt(n->as.try_stmt.catch_block);
+            n->as.try_stmt.finally_block = opt(n->as.try_stmt.finally_block);
+            return n;
+
+        case NODE_PRINT:
+        case NODE_RETURN:
+        case NODE_THROW:
+            n->as.operand = opt(n->as.operand);
+            return n;
+
+        case NODE_INDEX:
+            n->as.index.object = opt(n->as.index.object);
+            n->as.index.index = opt(n->as.index.index);
+            return n;
+
+        case NODE_MEMBER:
+            n->as.member.object = opt(n->as.member.object);
+            return n;
+
+        case NODE_PROPERTY_ASSIGN:
+            n->as.property.target = opt(n->as.property.target);
+            n->as.property.value = opt(n->as.property.value);
+            return n;
+
+        case NODE_NUMBER:
+        case NODE_STRING:
+        case NODE_BOOLEAN:
+        case NODE_VAR:
+            return n;
+    }
+    return n;
+}
+
+ASTNode *optimize(ASTNode *n) {
+    return opt(n);
+}
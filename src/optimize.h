@@ -0,0 +1,15 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "ast.h"
+
+// Simplify a resolved top-level statement before either engine runs it:
+// operators on literals are folded, `if` and `while` with a literal
+// condition lose the branch that cannot run, and statements after a
+// `return` or `throw` in the same block are dropped. It runs after the
+// resolver, so removed code still declares the names it would have.
+// Returns the statement to run, which may be a new node from the current
+// AST arena.
+ASTNode *optimize(ASTNode *n);
+
+#endif
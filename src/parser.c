@@ -1,8 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
 #include "parser.h"
 #include "lexer.h"
+#include "isolate.h"
+#include "optimize.h"
 #include "util.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
 
 static ASTNode *expression();
 static ASTNode *logical_or();
@@ -13,52 +18,414 @@ static ASTNode *factor();
 static ASTNode *primary();
 static ASTNode *statement();
 static ASTNode *block();
+static int skip_statement(int *i);
 
-ASTNode *parse_statement() {
-    return statement();
+// Items of the lists being parsed (statements, arguments, parameters, ...)
+// are collected here and copied into the arena once their number is known.
+// Nested lists stack on top of their parent's items.
+static ParserState *state(void) {
+    return &current_isolate->parser;
 }
 
-static ASTNode *statement() {
-    Token t = current_tok();
+static int pending_top(void) {
+    return state()->pending_count;
+}
 
-    // Function declaration
-    if (t.type == TOKEN_FUNCTION) {
-        advance_token();
-        
+static void push_pending(void *item) {
+    ParserState *ps = state();
+    if (ps->pending_count >= ps->pending_capacity) {
+        ps->pending_capacity = ps->pending_capacity ? ps->pending_capacity * 2 : 64;
+        ps->pending = realloc(ps->pending, sizeof(void*) * ps->pending_capacity);
+        if (!ps->pending) fatal("Out of memory");
+    }
+    ps->pending[ps->pending_count++] = item;
+}
+
+// Move the items pushed since `base` into the arena
+static void *take_pending(int base) {
+    ParserState *ps = state();
+    void *items = ast_copy(ps->pending + base, sizeof(void*) * (ps->pending_count - base));
+    ps->pending_count = base;
+    return items;
+}
+
+void free_parser(void) {
+    ParserState *ps = state();
+    free(ps->pending);
+    ps->pending = NULL;
+    ps->pending_count = ps->pending_capacity = 0;
+}
+
+// The token's text (decoded, for strings) copied into the arena
+static char *token_name(Token t) {
+    char *s = ast_alloc(t.length + 1);
+    token_text(t, s);
+    return s;
+}
+
+// Parameter list after the opening parenthesis; consumes the closing one
+static char **parameters(int *count) {
+    int base = pending_top();
+    while (current_tok().type != TOKEN_RPAREN && current_tok().type != TOKEN_EOF) {
         if (current_tok().type != TOKEN_IDENTIFIER) {
-            fatal("Expected function name");
+            fatal("Expected parameter name");
         }
-        char func_name[256];
-        strcpy(func_name, current_tok().lexeme);
+        push_pending(token_name(current_tok()));
         advance_token();
-        
-        expect(TOKEN_LPAREN, "Expected '(' after function name");
-        
-        char **params = malloc(sizeof(char*) * 256);
-        int param_count = 0;
-        
-        while (current_tok().type != TOKEN_RPAREN && current_tok().type != TOKEN_EOF) {
-            if (current_tok().type != TOKEN_IDENTIFIER) {
-                fatal("Expected parameter name");
-            }
-            params[param_count] = malloc(256);
-            strcpy(params[param_count], current_tok().lexeme);
-            param_count++;
+
+        if (current_tok().type == TOKEN_COMMA) {
             advance_token();
-            
-            if (current_tok().type == TOKEN_COMMA) {
-                advance_token();
-            } else {
-                break;
+        } else {
+            break;
+        }
+    }
+    expect(TOKEN_RPAREN, "Expected ')' after parameters");
+    *count = pending_top() - base;
+    return take_pending(base);
+}
+
+// Argument list after the opening parenthesis; consumes the closing one
+static ASTNode **arguments(int *count) {
+    int base = pending_top();
+    while (current_tok().type != TOKEN_RPAREN && current_tok().type != TOKEN_EOF) {
+        push_pending(expression());
+        if (current_tok().type == TOKEN_COMMA) {
+            advance_token();
+        } else {
+            break;
+        }
+    }
+    expect(TOKEN_RPAREN, "Expected ')'");
+    *count = pending_top() - base;
+    return take_pending(base);
+}
+
+ASTNode *parse_statement() {
+    return statement();
+}
+
+// `function name(params) body`, stored as a variable. A lazy body is only
+// skipped over, and parsed by parse_function_body on first call; one
+// running into the end of the stream is parsed now so the error shows.
+static ASTNode *function_declaration(int lazy) {
+    advance_token();
+
+    if (current_tok().type != TOKEN_IDENTIFIER) {
+        fatal("Expected function name");
+    }
+    char *func_name = token_name(current_tok());
+    advance_token();
+
+    expect(TOKEN_LPAREN, "Expected '(' after function name");
+    int param_count;
+    char **params = parameters(&param_count);
+
+    int body_start = current_tok().index;
+    int skipped = 0;
+    if (lazy && skip_statement(&skipped)) {
+        ASTNode *func = new_function(params, param_count, NULL);
+        func->as.function.unparsed_body = body_start;
+        seek_token(body_start + skipped);
+        return new_function_declaration(func_name, func);
+    }
+    ASTNode *body = statement();  // Function body (usually a block)
+    ASTNode *func = new_function(params, param_count, body);
+    return new_function_declaration(func_name, func);
+}
+
+void parse_function_body(ASTNode *function) {
+    int start = function->as.function.unparsed_body;
+    if (!start) return;
+    int resume = current_tok().index;
+    seek_token(start);
+    function->as.function.body = statement();
+    function->as.function.unparsed_body = 0;
+    seek_token(resume);
+    resolve_function_body(function);
+    if (state()->optimize_bodies) optimize(function);
+}
+
+// Where a statement ends, found with just enough of the grammar to skip
+// over it: tokens are counted from the cursor at *i. Running into the end
+// of a partial stream returns 0, as the statement may go on.
+static int is_open(TokenType t) {
+    return t == TOKEN_LPAREN || t == TOKEN_LBRACE || t == TOKEN_LBRACKET;
+}
+
+static int is_close(TokenType t) {
+    return t == TOKEN_RPAREN || t == TOKEN_RBRACE || t == TOKEN_RBRACKET;
+}
+
+// A bracketed group; anything else is left to the parser to reject
+static int skip_group(int *i) {
+    if (!is_open(token_at(*i).type)) return 1;
+    int depth = 0;
+    do {
+        TokenType t = token_at((*i)++).type;
+        if (t == TOKEN_EOF) return 0;
+        if (is_open(t)) depth++;
+        else if (is_close(t)) depth--;
+    } while (depth > 0);
+    return 1;
+}
+
+static int skip_statement(int *i) {
+    TokenType t = token_at(*i).type;
+    switch (t) {
+        case TOKEN_EOF:
+            return 0;
+        case TOKEN_LBRACE:
+            return skip_group(i);
+        case TOKEN_FUNCTION:
+            *i += 2;
+            return skip_group(i) && skip_statement(i);
+        case TOKEN_WHILE:
+            (*i)++;
+            return skip_group(i) && skip_statement(i);
+        case TOKEN_IF:
+            (*i)++;
+            if (!skip_group(i) || !skip_statement(i)) return 0;
+            if (token_at(*i).type == TOKEN_ELSE) {
+                (*i)++;
+                return skip_statement(i);
+            }
+            // An else may still follow
+            return token_at(*i).type != TOKEN_EOF;
+        case TOKEN_TRY:
+            (*i)++;
+            if (!skip_statement(i)) return 0;
+            if (token_at(*i).type == TOKEN_CATCH) {
+                (*i)++;
+                if (!skip_group(i) || !skip_statement(i)) return 0;
+            }
+            if (token_at(*i).type == TOKEN_FINALLY) {
+                (*i)++;
+                return skip_statement(i);
+            }
+            return token_at(*i).type != TOKEN_EOF;
+        default: {
+            // Everything else ends with a ';' outside brackets
+            int depth = 0;
+            while (1) {
+                t = token_at((*i)++).type;
+                if (t == TOKEN_EOF) return 0;
+                if (is_open(t)) depth++;
+                else if (is_close(t)) depth--;
+                else if (t == TOKEN_SEMI && depth <= 0) return 1;
             }
         }
-        expect(TOKEN_RPAREN, "Expected ')' after parameters");
-        
-        ASTNode *body = statement();  // Function body (usually a block)
-        ASTNode *func = new_function(params, param_count, body);
-        
-        // Store function as variable
-        return new_assign(func_name, func);
+    }
+}
+
+int statement_ready(void) {
+    if (!token_stream()->partial) return 1;
+    int i = 0;
+    return skip_statement(&i);
+}
+
+// Parallel parsing. Large scripts are mostly top-level function
+// declarations; their token ranges are found with skip_statement and they
+// are parsed on a pool of threads, each with an isolate of its own that
+// reads the same token stream and allocates into an arena of its own.
+// parse_program takes each result when its own walk reaches the
+// declaration's first token, so the Program, and the error reported for
+// a bad script, are exactly those of a sequential parse.
+#define PARALLEL_MIN_TOKENS (64 * 1024)
+
+typedef struct {
+    int start;              // token index of the declaration
+    int end;                // of the token after it, once parsed
+    ASTNode *node;          // NULL when it failed to parse
+    char *error;            // what the parser reported then
+} ParseTask;
+
+typedef struct {
+    ParseTask *tasks;
+    int count;
+    int next;               // first task not yet taken
+    pthread_mutex_t lock;
+} ParsePool;
+
+typedef struct {
+    ParsePool *pool;
+    Isolate *iso;
+    Arena arena;
+    FILE *err;              // the isolate's error stream, captured
+    char *err_text;
+    size_t err_length;
+} ParseWorker;
+
+static void parse_task(ParseWorker *w, ParseTask *t) {
+    Isolate *iso = w->iso;
+    long mark = ftell(w->err);
+    jmp_buf exit_jmp;
+    iso->exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) == 0) {
+        iso->lexer.cursor = t->start;
+        t->node = statement();
+        t->end = iso->lexer.cursor;
+    } else {
+        iso->exit_jmp = NULL;
+        fflush(w->err);
+        t->error = strdup(w->err_text + mark);
+        if (!t->error) fatal("Out of memory");
+        iso->parser.pending_count = 0;
+    }
+    iso->exit_jmp = NULL;
+}
+
+static void *parse_worker(void *arg) {
+    ParseWorker *w = arg;
+    ParsePool *pool = w->pool;
+    Isolate *previous = current_isolate;
+    isolate_enter(w->iso);
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next < pool->count ? pool->next++ : -1;
+        pthread_mutex_unlock(&pool->lock);
+        if (i < 0) break;
+        parse_task(w, &pool->tasks[i]);
+    }
+    isolate_enter(previous);
+    return NULL;
+}
+
+// The top-level function declarations from the cursor on, in source
+// order, or NULL when they are too few or too small to be worth threads
+static ParseTask *find_functions(int *count) {
+    ParseTask *tasks = NULL;
+    int capacity = 0;
+    long tokens = 0;
+    int cursor = current_tok().index;
+    int i = 0;
+    *count = 0;
+    while (token_at(i).type != TOKEN_EOF) {
+        int start = i;
+        int is_function = token_at(i).type == TOKEN_FUNCTION;
+        if (!skip_statement(&i) || i == start) break;
+        if (!is_function) continue;
+        if (*count >= capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            tasks = realloc(tasks, sizeof(ParseTask) * capacity);
+            if (!tasks) fatal("Out of memory");
+        }
+        ParseTask *t = &tasks[(*count)++];
+        memset(t, 0, sizeof(*t));
+        t->start = cursor + start;
+        tokens += i - start;
+    }
+    if (*count < 2 || tokens < PARALLEL_MIN_TOKENS) {
+        free(tasks);
+        *count = 0;
+        return NULL;
+    }
+    return tasks;
+}
+
+// Parse the tasks on `threads` threads, the calling one included. The
+// workers' arenas are handed to the current one.
+static void parse_functions(ParseTask *tasks, int count, int threads) {
+    ParsePool pool = { tasks, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    if (threads > count) threads = count;
+    ParseWorker *workers = calloc(threads, sizeof(ParseWorker));
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    if (!workers || !tids) fatal("Out of memory");
+
+    for (int i = 0; i < threads; i++) {
+        ParseWorker *w = &workers[i];
+        w->pool = &pool;
+        w->iso = isolate_new();
+        // The stream is shared, read-only
+        w->iso->lexer = current_isolate->lexer;
+        arena_init(&w->arena);
+        w->iso->ast_arena = &w->arena;
+        w->err = open_memstream(&w->err_text, &w->err_length);
+        if (!w->err) fatal("Out of memory");
+        w->iso->err = w->err;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, parse_worker, &workers[i]) != 0) {
+            fatal("Cannot create thread");
+        }
+    }
+    parse_worker(&workers[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        ParseWorker *w = &workers[i];
+        fclose(w->err);
+        free(w->err_text);
+        memset(&w->iso->lexer, 0, sizeof(LexerState));
+        isolate_free(w->iso);
+        arena_adopt(current_isolate->ast_arena, &w->arena);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(tids);
+}
+
+static int is_function_declaration(ASTNode *n) {
+    return n->type == NODE_ASSIGN && n->as.assign.is_decl == DECL_FUNCTION;
+}
+
+Program *parse_program(const ParseOptions *options) {
+    int task_count = 0;
+    ParseTask *tasks = NULL;
+    // Lazy bodies are cheap enough to skip on one thread
+    if (options->threads > 1 && !options->lazy) tasks = find_functions(&task_count);
+    if (tasks) parse_functions(tasks, task_count, options->threads);
+    state()->optimize_bodies = options->optimize;
+
+    int base = pending_top();
+    int next = 0;
+    while (current_tok().type != TOKEN_EOF) {
+        int at = current_tok().index;
+        while (next < task_count && tasks[next].start < at) next++;
+        if (next < task_count && tasks[next].start == at) {
+            ParseTask *t = &tasks[next++];
+            if (t->error) {
+                fputs(t->error, isolate_stderr());
+                isolate_exit(1);
+            }
+            seek_token(t->end);
+            push_pending(t->node);
+        } else if (options->lazy && current_tok().type == TOKEN_FUNCTION) {
+            push_pending(function_declaration(1));
+        } else {
+            push_pending(statement());
+        }
+    }
+    for (int i = 0; i < task_count; i++) {
+        free(tasks[i].error);
+    }
+    free(tasks);
+
+    ParserState *ps = state();
+    Program *p = ast_alloc(sizeof(Program));
+    p->count = ps->pending_count - base;
+    for (int i = base; i < ps->pending_count; i++) {
+        p->function_count += is_function_declaration(ps->pending[i]);
+    }
+    // A stable partition: declarations first, then everything else
+    p->statements = ast_alloc(sizeof(ASTNode*) * (p->count ? p->count : 1));
+    int next_function = 0;
+    int next_other = p->function_count;
+    for (int i = base; i < ps->pending_count; i++) {
+        ASTNode *st = ps->pending[i];
+        p->statements[is_function_declaration(st) ? next_function++ : next_other++] = st;
+    }
+    ps->pending_count = base;
+    return p;
+}
+
+static ASTNode *statement() {
+    Token t = current_tok();
+
+    // Function declaration
+    if (t.type == TOKEN_FUNCTION) {
+        return function_declaration(0);
     }
 
     // Return statement
@@ -107,14 +474,14 @@ static ASTNode *statement() {
         ASTNode *try_block = statement();
         
         ASTNode *catch_block = NULL;
-        char catch_param[256] = {0};
+        char *catch_param = NULL;
         
         if (current_tok().type == TOKEN_CATCH) {
             advance_token();
             expect(TOKEN_LPAREN, "Expected '(' after catch");
             
             if (current_tok().type == TOKEN_IDENTIFIER) {
-                strcpy(catch_param, current_tok().lexeme);
+                catch_param = token_name(current_tok());
                 advance_token();
             }
             
@@ -151,14 +518,13 @@ static ASTNode *statement() {
         if (t.type != TOKEN_IDENTIFIER)
             fatal("Expected identifier after let");
 
-        char name[64];
-        strcpy(name, t.lexeme);
+        char *name = token_name(t);
         advance_token();
 
         expect(TOKEN_ASSIGN, "Expected '='");
         ASTNode *expr = expression();
         expect(TOKEN_SEMI, "Expected ';'");
-        return new_assign(name, expr);
+        return new_declaration(name, expr);
     }
 
     // Check for assignment (identifier = expression)
@@ -167,8 +533,7 @@ static ASTNode *statement() {
         
         if (next_tok.type == TOKEN_ASSIGN) {
             // It's an assignment
-            char name[64];
-            strcpy(name, t.lexeme);
+            char *name = token_name(t);
             advance_token();  // consume identifier
             advance_token();  // consume =
             ASTNode *expr = expression();
@@ -177,8 +542,13 @@ static ASTNode *statement() {
         }
     }
 
-    // Expression statement
+    // Expression statement, or assignment to a property (obj.x = e, obj[k] = e)
     ASTNode *expr = expression();
+    if (current_tok().type == TOKEN_ASSIGN &&
+        (expr->type == NODE_MEMBER || expr->type == NODE_INDEX)) {
+        advance_token();
+        expr = new_property_assign(expr, expression());
+    }
     expect(TOKEN_SEMI, "Expected ';'");
     return expr;
 }
@@ -186,16 +556,14 @@ static ASTNode *statement() {
 static ASTNode *block() {
     expect(TOKEN_LBRACE, "Expected '{'");
     
-    ASTNode **statements = malloc(sizeof(ASTNode*) * 256);
-    int count = 0;
-    
+    int base = pending_top();
     while (current_tok().type != TOKEN_RBRACE && current_tok().type != TOKEN_EOF) {
-        statements[count++] = statement();
-        if (count >= 256) fatal("Too many statements in block");
+        push_pending(statement());
     }
     
     expect(TOKEN_RBRACE, "Expected '}'");
-    return new_block(statements, count);
+    int count = pending_top() - base;
+    return new_block(take_pending(base), count);
 }
 
 static ASTNode *expression() {
@@ -208,7 +576,7 @@ static ASTNode *logical_or() {
     while (current_tok().type == TOKEN_OR) {
         advance_token();
         ASTNode *r = logical_and();
-        n = new_logical("||", n, r);
+        n = new_logical(LOGIC_OR, n, r);
     }
     return n;
 }
@@ -219,7 +587,7 @@ static ASTNode *logical_and() {
     while (current_tok().type == TOKEN_AND) {
         advance_token();
         ASTNode *r = comparison();
-        n = new_logical("&&", n, r);
+        n = new_logical(LOGIC_AND, n, r);
     }
     return n;
 }
@@ -234,19 +602,18 @@ static ASTNode *comparison() {
            t.type == TOKEN_PLUS || t.type == TOKEN_MINUS) {
         
         if (t.type == TOKEN_PLUS || t.type == TOKEN_MINUS) {
-            char op = (t.type == TOKEN_PLUS) ? '+' : '-';
+            ArithOp op = (t.type == TOKEN_PLUS) ? ARITH_ADD : ARITH_SUB;
             advance_token();
             ASTNode *r = term();
             n = new_binop(op, n, r);
         } else {
-            char op[3];
-            if (t.type == TOKEN_EQ) strcpy(op, "==");
-            else if (t.type == TOKEN_NE) strcpy(op, "!=");
-            else if (t.type == TOKEN_LT) strcpy(op, "<");
-            else if (t.type == TOKEN_GT) strcpy(op, ">");
-            else if (t.type == TOKEN_LE) strcpy(op, "<=");
-            else if (t.type == TOKEN_GE) strcpy(op, ">=");
-            
+            CompareOp op = CMP_EQ;
+            if (t.type == TOKEN_NE) op = CMP_NE;
+            else if (t.type == TOKEN_LT) op = CMP_LT;
+            else if (t.type == TOKEN_GT) op = CMP_GT;
+            else if (t.type == TOKEN_LE) op = CMP_LE;
+            else if (t.type == TOKEN_GE) op = CMP_GE;
+
             advance_token();
             ASTNode *r = term();
             n = new_comparison(op, n, r);
@@ -262,7 +629,7 @@ static ASTNode *term() {
     Token t = current_tok();
 
     while (t.type == TOKEN_STAR || t.type == TOKEN_SLASH) {
-        char op = (t.type == TOKEN_STAR) ? '*' : '/';
+        ArithOp op = (t.type == TOKEN_STAR) ? ARITH_MUL : ARITH_DIV;
         advance_token();
         ASTNode *r = factor();
         n = new_binop(op, n, r);
@@ -276,12 +643,12 @@ static ASTNode *factor() {
 
     if (t.type == TOKEN_MINUS) {
         advance_token();
-        return new_binop('-', new_number(0), factor());
+        return new_binop(ARITH_SUB, new_number(0), factor());
     }
     
     if (t.type == TOKEN_NOT) {
         advance_token();
-        return new_logical("!", factor(), NULL);
+        return new_logical(LOGIC_NOT, factor(), NULL);
     }
     
     return primary();
@@ -291,14 +658,13 @@ static ASTNode *primary() {
     Token t = current_tok();
 
     if (t.type == TOKEN_NUMBER) {
-        double v = t.number;
+        double v = token_number(t);
         advance_token();
         return new_number(v);
     }
 
     if (t.type == TOKEN_STRING) {
-        char str[256];
-        strcpy(str, t.lexeme);
+        char *str = token_name(t);
         advance_token();
         return new_string(str);
     }
@@ -318,26 +684,8 @@ static ASTNode *primary() {
         advance_token();
         
         expect(TOKEN_LPAREN, "Expected '(' after function keyword");
-        
-        char **params = malloc(sizeof(char*) * 256);
-        int param_count = 0;
-        
-        while (current_tok().type != TOKEN_RPAREN && current_tok().type != TOKEN_EOF) {
-            if (current_tok().type != TOKEN_IDENTIFIER) {
-                fatal("Expected parameter name");
-            }
-            params[param_count] = malloc(256);
-            strcpy(params[param_count], current_tok().lexeme);
-            param_count++;
-            advance_token();
-            
-            if (current_tok().type == TOKEN_COMMA) {
-                advance_token();
-            } else {
-                break;
-            }
-        }
-        expect(TOKEN_RPAREN, "Expected ')' after parameters");
+        int param_count;
+        char **params = parameters(&param_count);
         
         ASTNode *body = statement();  // Function body (usually a block)
         return new_function(params, param_count, body);
@@ -346,11 +694,9 @@ static ASTNode *primary() {
     // Array literal
     if (t.type == TOKEN_LBRACKET) {
         advance_token();
-        ASTNode **elements = malloc(sizeof(ASTNode*) * 256);
-        int count = 0;
-        
+        int base = pending_top();
         while (current_tok().type != TOKEN_RBRACKET && current_tok().type != TOKEN_EOF) {
-            elements[count++] = expression();
+            push_pending(expression());
             if (current_tok().type == TOKEN_COMMA) {
                 advance_token();
             } else {
@@ -358,28 +704,25 @@ static ASTNode *primary() {
             }
         }
         expect(TOKEN_RBRACKET, "Expected ']'");
-        return new_array(elements, count);
+        int count = pending_top() - base;
+        return new_array(take_pending(base), count);
     }
 
     // Object literal
     if (t.type == TOKEN_LBRACE) {
         advance_token();
-        char **keys = malloc(sizeof(char*) * 256);
-        ASTNode **values = malloc(sizeof(ASTNode*) * 256);
-        int count = 0;
-        
+        // Keys and values alternate on the pending stack
+        int base = pending_top();
         while (current_tok().type != TOKEN_RBRACE && current_tok().type != TOKEN_EOF) {
             if (current_tok().type != TOKEN_IDENTIFIER && current_tok().type != TOKEN_STRING) {
                 fatal("Expected property name");
             }
             
-            keys[count] = malloc(256);
-            strcpy(keys[count], current_tok().lexeme);
+            push_pending(token_name(current_tok()));
             advance_token();
             
             expect(TOKEN_COLON, "Expected ':' after property name");
-            values[count] = expression();
-            count++;
+            push_pending(expression());
             
             if (current_tok().type == TOKEN_COMMA) {
                 advance_token();
@@ -388,57 +731,44 @@ static ASTNode *primary() {
             }
         }
         expect(TOKEN_RBRACE, "Expected '}'");
+        ParserState *ps = state();
+        int count = (ps->pending_count - base) / 2;
+        char **keys = ast_alloc(sizeof(char*) * count);
+        ASTNode **values = ast_alloc(sizeof(ASTNode*) * count);
+        for (int i = 0; i < count; i++) {
+            keys[i] = ps->pending[base + 2 * i];
+            values[i] = ps->pending[base + 2 * i + 1];
+        }
+        ps->pending_count = base;
         return new_object(keys, values, count);
     }
 
     if (t.type == TOKEN_IDENTIFIER) {
-        char name[256];
-        strcpy(name, t.lexeme);
         advance_token();
 
         // Function call or print
         if (current_tok().type == TOKEN_LPAREN) {
             advance_token();
-            ASTNode **args = malloc(sizeof(ASTNode*) * 256);
-            int arg_count = 0;
-            
-            while (current_tok().type != TOKEN_RPAREN && current_tok().type != TOKEN_EOF) {
-                args[arg_count++] = expression();
-                if (current_tok().type == TOKEN_COMMA) {
-                    advance_token();
-                } else {
-                    break;
-                }
-            }
-            expect(TOKEN_RPAREN, "Expected ')'");
+            int arg_count;
+            ASTNode **args = arguments(&arg_count);
             
             // Special handling for print
-            if (strcmp(name, "print") == 0 && arg_count > 0) {
+            if (token_is(t, "print") && arg_count > 0) {
                 return new_print(args[0]);
             }
             
-            return new_call(name, args, arg_count);
+            return new_call(token_name(t), args, arg_count);
         }
 
         // Special handling for console.log()
-        if (strcmp(name, "console") == 0 && current_tok().type == TOKEN_DOT) {
+        if (token_is(t, "console") && current_tok().type == TOKEN_DOT) {
             advance_token();
-            if (current_tok().type == TOKEN_IDENTIFIER && strcmp(current_tok().lexeme, "log") == 0) {
+            if (current_tok().type == TOKEN_IDENTIFIER && token_is(current_tok(), "log")) {
                 advance_token();
                 if (current_tok().type == TOKEN_LPAREN) {
                     advance_token();
-                    ASTNode **args = malloc(sizeof(ASTNode*) * 256);
-                    int arg_count = 0;
-                    
-                    while (current_tok().type != TOKEN_RPAREN && current_tok().type != TOKEN_EOF) {
-                        args[arg_count++] = expression();
-                        if (current_tok().type == TOKEN_COMMA) {
-                            advance_token();
-                        } else {
-                            break;
-                        }
-                    }
-                    expect(TOKEN_RPAREN, "Expected ')'");
+                    int arg_count;
+                    ASTNode **args = arguments(&arg_count);
                     
                     if (arg_count > 0) {
                         return new_print(args[0]);
@@ -448,15 +778,14 @@ static ASTNode *primary() {
         }
 
         // Member access or array indexing
-        ASTNode *node = new_var(name);
+        ASTNode *node = new_var(token_name(t));
         while (1) {
             if (current_tok().type == TOKEN_DOT) {
                 advance_token();
                 if (current_tok().type != TOKEN_IDENTIFIER) {
                     fatal("Expected property name after '.'");
                 }
-                char member[256];
-                strcpy(member, current_tok().lexeme);
+                char *member = token_name(current_tok());
                 advance_token();
                 node = new_member(node, member);
             } else if (current_tok().type == TOKEN_LBRACKET) {
@@ -3,7 +3,39 @@
 
 #include "ast.h"
 
+// Lists being collected (statements of a block, arguments, ...), copied
+// into the arena once complete; one per isolate (isolate.h)
+typedef struct {
+    void **pending;
+    int pending_count;
+    int pending_capacity;
+    int optimize_bodies;        // ParseOptions.optimize of the last parse_program
+} ParserState;
+
 ASTNode *parse_statement();
+typedef struct {
+    // Parse a script made mostly of large function declarations on this
+    // many threads; the result and any parse error are the same as with one
+    int threads;
+    // Only find where each top-level function body ends, leaving it to be
+    // parsed when the function is first called (parse_function_body)
+    int lazy;
+    // Run the optimizer on those bodies once they are parsed
+    int optimize;
+} ParseOptions;
+
+// Parse the rest of a complete token stream. Top-level function
+// declarations are hoisted: they come first, in source order, so code can
+// call a function declared further down. The Program lives in the arena.
+Program *parse_program(const ParseOptions *options);
+// Parse and resolve the body of a top-level function left unparsed by a
+// lazy parse_program; does nothing for one already parsed. The token
+// stream and arena of its script must still be current.
+void parse_function_body(ASTNode *function);
 ASTNode *parse_expression();
+// Whether parse_statement can run without reaching the end of a partial
+// token stream (see init_lexer_piece); always true for a complete one
+int statement_ready(void);
+void free_parser(void);
 
 #endif
@@ -0,0 +1,303 @@
+#include "resolver.h"
+#include "env.h"
+#include "isolate.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A function body or catch block under resolution. Top-level code has no
+// Scope: its variables are globals.
+typedef struct Scope {
+    char **names;       // slot order
+    int count;
+    int capacity;
+    struct Scope *parent;
+} Scope;
+
+static ResolverState *state(void) {
+    return &current_isolate->resolver;
+}
+
+static void resolve_node(ASTNode *n);
+
+static int find_local(Scope *s, const char *name) {
+    for (int i = s->count - 1; i >= 0; i--) {
+        if (strcmp(s->names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static int add_local(Scope *s, const char *name) {
+    if (s->count >= s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 8;
+        s->names = realloc(s->names, sizeof(char*) * s->capacity);
+        if (!s->names) fatal("Out of memory");
+    }
+    s->names[s->count] = (char*)name;
+    return s->count++;
+}
+
+static int declare_local(Scope *s, const char *name) {
+    int i = find_local(s, name);
+    if (i >= 0) return i;
+    return add_local(s, name);
+}
+
+static void bind_global(VarRef *var) {
+    ResolverState *rs = state();
+    var->depth = DEPTH_GLOBAL;
+    var->slot = global_slot(var->name);
+    if (!rs->lazy_body) return;
+    if (var->slot >= rs->global_units_capacity) {
+        int old = rs->global_units_capacity;
+        rs->global_units_capacity = old ? old * 2 : 64;
+        while (rs->global_units_capacity <= var->slot) rs->global_units_capacity *= 2;
+        rs->global_units = realloc(rs->global_units, sizeof(int) * rs->global_units_capacity);
+        if (!rs->global_units) fatal("Out of memory");
+        memset(rs->global_units + old, 0, sizeof(int) * (rs->global_units_capacity - old));
+    }
+    rs->global_units[var->slot] = rs->unit;
+}
+
+// Whether an undeclared assignment inside a function writes the global of
+// that name. A lazy body is resolved after the rest of its script, so the
+// globals reserved since its declaration do not count unless the body
+// itself refers to them.
+static int known_global(const char *name) {
+    ResolverState *rs = state();
+    if (!global_exists(name)) return 0;
+    if (!rs->lazy_body) return 1;
+    int slot = global_slot(name);
+    return slot < rs->known_globals ||
+           (slot < rs->global_units_capacity && rs->global_units[slot] == rs->unit);
+}
+
+static void declare(VarRef *var) {
+    Scope *scope = state()->scope;
+    if (scope) {
+        var->depth = 0;
+        var->slot = declare_local(scope, var->name);
+    } else {
+        bind_global(var);
+    }
+}
+
+// Look the name up through the enclosing scopes; returns 0 if it is not a
+// local of any of them
+static int find(VarRef *var) {
+    int depth = 0;
+    for (Scope *s = state()->scope; s; s = s->parent, depth++) {
+        int i = find_local(s, var->name);
+        if (i >= 0) {
+            var->depth = depth;
+            var->slot = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Anything that is not a local is a global. Functions may refer to globals
+// declared after them, so the slot is reserved on first use.
+static void resolve_use(VarRef *var) {
+    if (!find(var)) bind_global(var);
+}
+
+// Declarations are hoisted to the top of their function or catch block, so
+// closures created before a `let` still see it. Nested functions and catch
+// blocks have scopes of their own and are left alone. At top level every
+// assignment makes a global, so all of their names are reserved.
+static void hoist(ASTNode *n) {
+    if (!n) return;
+    switch (n->type) {
+        case NODE_ASSIGN: {
+            Scope *scope = state()->scope;
+            if (!scope) {
+                global_slot(n->as.assign.var.name);
+            } else if (n->as.assign.is_decl) {
+                declare_local(scope, n->as.assign.var.name);
+            }
+            return;
+        }
+        case NODE_BLOCK:
+            for (int i = 0; i < n->as.list.count; i++) hoist(n->as.list.items[i]);
+            return;
+        case NODE_IF:
+        case NODE_WHILE:
+            hoist(n->as.branch.body);
+            hoist(n->as.branch.else_branch);
+            return;
+        case NODE_TRY:
+            hoist(n->as.try_stmt.try_block);
+            hoist(n->as.try_stmt.finally_block);
+            return;
+        default:
+            return;
+    }
+}
+
+static void begin_scope(Scope *s) {
+    s->names = NULL;
+    s->count = 0;
+    s->capacity = 0;
+    s->parent = state()->scope;
+    state()->scope = s;
+}
+
+static int end_scope(Scope *s) {
+    state()->scope = s->parent;
+    free(s->names);
+    return s->count;
+}
+
+static void resolve_function(ASTNode *n) {
+    int literals = ++state()->function_literals;
+    Scope s;
+    begin_scope(&s);
+    // Parameters take the first slots in order; with duplicate names the
+    // last one wins, as lookups search from the end
+    for (int i = 0; i < n->as.function.param_count; i++) {
+        add_local(&s, n->as.function.params[i]);
+    }
+    hoist(n->as.function.body);
+    resolve_node(n->as.function.body);
+    n->as.function.local_count = end_scope(&s);
+    n->as.function.has_closure = state()->function_literals != literals;
+}
+
+static void resolve_try(ASTNode *n) {
+    resolve_node(n->as.try_stmt.try_block);
+    if (n->as.try_stmt.catch_block) {
+        int literals = state()->function_literals;
+        Scope s;
+        begin_scope(&s);
+        // The caught value is always slot 0, even when it is not named
+        add_local(&s, n->as.try_stmt.catch_param);
+        hoist(n->as.try_stmt.catch_block);
+        resolve_node(n->as.try_stmt.catch_block);
+        n->as.try_stmt.local_count = end_scope(&s);
+        n->as.try_stmt.has_closure = state()->function_literals != literals;
+    }
+    resolve_node(n->as.try_stmt.finally_block);
+}
+
+static void resolve_node(ASTNode *n) {
+    if (!n) return;
+
+    switch (n->type) {
+        case NODE_VAR:
+            resolve_use(&n->as.var);
+            return;
+
+        case NODE_ASSIGN: {
+            VarRef *var = &n->as.assign.var;
+            resolve_node(n->as.assign.value);
+            if (n->as.assign.is_decl) {
+                declare(var);
+            } else if (!find(var)) {
+                // Assigning an undeclared name creates it in the innermost
+                // scope, unless a global of that name is already known
+                if (known_global(var->name)) {
+                    bind_global(var);
+                } else {
+                    declare(var);
+                }
+            }
+            return;
+        }
+
+        case NODE_CALL:
+            resolve_use(&n->as.call.var);
+            for (int i = 0; i < n->as.call.arg_count; i++) resolve_node(n->as.call.args[i]);
+            return;
+
+        case NODE_FUNCTION:
+            // A lazy body is resolved once it has been parsed
+            if (n->as.function.unparsed_body) {
+                n->as.function.known_globals = global_count();
+            } else {
+                resolve_function(n);
+            }
+            return;
+
+        case NODE_TRY:
+            resolve_try(n);
+            return;
+
+        case NODE_BLOCK:
+        case NODE_ARRAY:
+            for (int i = 0; i < n->as.list.count; i++) resolve_node(n->as.list.items[i]);
+            return;
+
+        case NODE_IF:
+        case NODE_WHILE:
+            resolve_node(n->as.branch.condition);
+            resolve_node(n->as.branch.body);
+            resolve_node(n->as.branch.else_branch);
+            return;
+
+        case NODE_OBJECT:
+            for (int i = 0; i < n->as.object.count; i++) resolve_node(n->as.object.values[i]);
+            return;
+
+        case NODE_BINOP:
+        case NODE_COMPARISON:
+        case NODE_LOGICAL:
+            resolve_node(n->as.binary.left);
+            resolve_node(n->as.binary.right);
+            return;
+
+        case NODE_PRINT:
+        case NODE_RETURN:
+        case NODE_THROW:
+            resolve_node(n->as.operand);
+            return;
+
+        case NODE_INDEX:
+            resolve_node(n->as.index.object);
+            resolve_node(n->as.index.index);
+            return;
+
+        case NODE_MEMBER:
+            resolve_node(n->as.member.object);
+            return;
+
+        case NODE_PROPERTY_ASSIGN:
+            resolve_node(n->as.property.target);
+            resolve_node(n->as.property.value);
+            return;
+
+        case NODE_NUMBER:
+        case NODE_STRING:
+        case NODE_BOOLEAN:
+            return;
+    }
+}
+
+void resolve(ASTNode *n) {
+    state()->scope = NULL;
+    resolve_node(n);
+}
+
+void resolve_function_body(ASTNode *function) {
+    ResolverState *rs = state();
+    rs->scope = NULL;
+    rs->lazy_body = 1;
+    rs->known_globals = function->as.function.known_globals;
+    rs->unit++;
+    resolve_function(function);
+    rs->lazy_body = 0;
+}
+
+void resolve_program(Program *p) {
+    state()->scope = NULL;
+    for (int i = 0; i < p->count; i++) hoist(p->statements[i]);
+    for (int i = 0; i < p->count; i++) resolve_node(p->statements[i]);
+}
+
+void free_resolver(void) {
+    ResolverState *rs = state();
+    free(rs->global_units);
+    rs->global_units = NULL;
+    rs->global_units_capacity = 0;
+}
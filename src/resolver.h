@@ -0,0 +1,38 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "ast.h"
+
+// One per isolate (isolate.h)
+typedef struct {
+    struct Scope *scope;        // innermost function or catch scope
+    int function_literals;      // seen so far, to detect closures
+    // While a lazy body is resolved (resolve_function_body): how many
+    // globals existed where its function was declared, and which body
+    // this is (from 1). An undeclared assignment in the body writes a
+    // global only if it is one of those or the body already referred to
+    // it, as when the body is resolved with its script.
+    int lazy_body;
+    int known_globals;
+    int unit;
+    int *global_units;          // per global slot, the last body that referred to it
+    int global_units_capacity;
+} ResolverState;
+
+// Resolve every variable reference in a top-level statement to a slot:
+// NODE_VAR, NODE_ASSIGN and NODE_CALL get (depth, slot), NODE_FUNCTION and
+// NODE_TRY get the size of the Env their calls and catch blocks need and
+// whether a closure created inside may outlive it.
+// Both engines run statements only after they have been resolved.
+void resolve(ASTNode *n);
+// Resolve a whole script. The globals every top-level statement assigns
+// are reserved first, so functions see them whichever order the
+// statements are in.
+void resolve_program(Program *p);
+// Resolve a top-level function whose body was parsed after its script
+// (parse_function_body). Globals that only other unresolved bodies refer
+// to are not known to it yet.
+void resolve_function_body(ASTNode *function);
+void free_resolver(void);
+
+#endif
@@ -0,0 +1,194 @@
+#include "scan.h"
+#include <pthread.h>
+#include <string.h>
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static int is_blank(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static int is_ident(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char *blanks_scalar(const char *p, const char *end) {
+    while (p < end && is_blank((unsigned char)*p)) p++;
+    return p;
+}
+
+static const char *ident_scalar(const char *p, const char *end) {
+    while (p < end && is_ident((unsigned char)*p)) p++;
+    return p;
+}
+
+static const char *line_scalar(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+static const char *string_scalar(const char *p, const char *end, char quote) {
+    while (p < end && *p != quote && *p != '\\' && *p != '\n') p++;
+    return p;
+}
+
+static const Scanner scalar_scanner = {
+    "scalar", blanks_scalar, ident_scalar, line_scalar, string_scalar
+};
+
+#ifdef SCAN_X86
+
+// Each vector loop builds a mask of the bytes that end the run and stops
+// at the first set bit; the tail shorter than a vector is done by the
+// scalar loops.
+
+// Bytes in [lo, hi], using a signed compare after shifting lo to -128
+#define IN_RANGE(add, cmpgt, set1, x, lo, hi) \
+    cmpgt(set1((char)(-128 + ((hi) - (lo)) + 1)), add(x, set1((char)(128 - (lo)))))
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 static __m128i blank_mask16(__m128i x) {
+    __m128i ctrl = IN_RANGE(_mm_add_epi8, _mm_cmpgt_epi8, _mm_set1_epi8, x, '\t', '\r');
+    ctrl = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), ctrl);
+    return _mm_or_si128(ctrl, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+}
+
+SSE2 static __m128i ident_mask16(__m128i x) {
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    __m128i alpha = IN_RANGE(_mm_add_epi8, _mm_cmpgt_epi8, _mm_set1_epi8, lower, 'a', 'z');
+    __m128i digit = IN_RANGE(_mm_add_epi8, _mm_cmpgt_epi8, _mm_set1_epi8, x, '0', '9');
+    __m128i under = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+    return _mm_or_si128(_mm_or_si128(alpha, digit), under);
+}
+
+SSE2 static const char *blanks_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned stop = ~_mm_movemask_epi8(blank_mask16(x)) & 0xffff;
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return blanks_scalar(p, end);
+}
+
+SSE2 static const char *ident_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned stop = ~_mm_movemask_epi8(ident_mask16(x)) & 0xffff;
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return ident_scalar(p, end);
+}
+
+SSE2 static const char *line_sse2(const char *p, const char *end) {
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned stop = _mm_movemask_epi8(_mm_cmpeq_epi8(x, nl));
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return line_scalar(p, end);
+}
+
+SSE2 static const char *string_sse2(const char *p, const char *end, char quote) {
+    __m128i q = _mm_set1_epi8(quote);
+    __m128i bs = _mm_set1_epi8('\\');
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, q),
+                                 _mm_or_si128(_mm_cmpeq_epi8(x, bs), _mm_cmpeq_epi8(x, nl)));
+        unsigned stop = _mm_movemask_epi8(m);
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return string_scalar(p, end, quote);
+}
+
+static const Scanner sse2_scanner = {
+    "sse2", blanks_sse2, ident_sse2, line_sse2, string_sse2
+};
+
+AVX2 static __m256i blank_mask32(__m256i x) {
+    __m256i ctrl = IN_RANGE(_mm256_add_epi8, _mm256_cmpgt_epi8, _mm256_set1_epi8, x, '\t', '\r');
+    ctrl = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), ctrl);
+    return _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+}
+
+AVX2 static __m256i ident_mask32(__m256i x) {
+    __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+    __m256i alpha = IN_RANGE(_mm256_add_epi8, _mm256_cmpgt_epi8, _mm256_set1_epi8, lower, 'a', 'z');
+    __m256i digit = IN_RANGE(_mm256_add_epi8, _mm256_cmpgt_epi8, _mm256_set1_epi8, x, '0', '9');
+    __m256i under = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+    return _mm256_or_si256(_mm256_or_si256(alpha, digit), under);
+}
+
+AVX2 static const char *blanks_avx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(blank_mask32(x));
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return blanks_sse2(p, end);
+}
+
+AVX2 static const char *ident_avx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(ident_mask32(x));
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return ident_sse2(p, end);
+}
+
+AVX2 static const char *line_avx2(const char *p, const char *end) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned stop = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, nl));
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return line_sse2(p, end);
+}
+
+AVX2 static const char *string_avx2(const char *p, const char *end, char quote) {
+    __m256i q = _mm256_set1_epi8(quote);
+    __m256i bs = _mm256_set1_epi8('\\');
+    __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, q),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(x, bs),
+                                                    _mm256_cmpeq_epi8(x, nl)));
+        unsigned stop = _mm256_movemask_epi8(m);
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return string_sse2(p, end, quote);
+}
+
+static const Scanner avx2_scanner = {
+    "avx2", blanks_avx2, ident_avx2, line_avx2, string_avx2
+};
+
+#endif
+
+static const Scanner *chosen = &scalar_scanner;
+static pthread_once_t chosen_once = PTHREAD_ONCE_INIT;
+
+static void choose_scanner(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) chosen = &avx2_scanner;
+    else if (__builtin_cpu_supports("sse2")) chosen = &sse2_scanner;
+#endif
+}
+
+// Detection runs once per process; every lexer shares the result
+const Scanner *scanner(void) {
+    pthread_once(&chosen_once, choose_scanner);
+    return chosen;
+}
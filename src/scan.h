@@ -0,0 +1,25 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Bulk character scanning for the lexer. Each function returns the first
+// position in [p, end) that is not part of the run, or `end`. None of the
+// runs include '\n', so the lexer can keep counting lines itself.
+//
+// On x86 the SSE2 or AVX2 versions are picked at startup by CPU feature
+// detection; elsewhere, or when built with -DNO_SIMD, plain loops are used.
+typedef struct {
+    const char *name;
+    // ' ', '\t', '\v', '\f' and '\r'
+    const char *(*blanks)(const char *p, const char *end);
+    // [A-Za-z0-9_]
+    const char *(*ident)(const char *p, const char *end);
+    // Comment body: anything but '\n'
+    const char *(*line)(const char *p, const char *end);
+    // String body: anything but the quote, '\\' and '\n'
+    const char *(*string)(const char *p, const char *end, char quote);
+} Scanner;
+
+// The best implementation this CPU supports
+const Scanner *scanner(void);
+
+#endif
@@ -0,0 +1,108 @@
+#include "shape.h"
+#include "isolate.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+static ShapeState *state(void) {
+    return &current_isolate->shapes;
+}
+
+static char **find_entry(ShapeState *ss, const char *name) {
+    unsigned mask = ss->name_capacity - 1;
+    for (unsigned i = hash_bytes(name, strlen(name)) & mask;; i = (i + 1) & mask) {
+        if (!ss->names[i] || strcmp(ss->names[i], name) == 0) return &ss->names[i];
+    }
+}
+
+const char *find_interned(const char *name) {
+    ShapeState *ss = state();
+    if (ss->name_capacity == 0) return NULL;
+    return *find_entry(ss, name);
+}
+
+const char *intern_name(const char *name) {
+    ShapeState *ss = state();
+    if ((ss->name_count + 1) * 2 > ss->name_capacity) {
+        char **old = ss->names;
+        int old_capacity = ss->name_capacity;
+        ss->name_capacity = ss->name_capacity ? ss->name_capacity * 2 : 256;
+        ss->names = calloc(ss->name_capacity, sizeof(char*));
+        if (!ss->names) fatal("Out of memory");
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i]) *find_entry(ss, old[i]) = old[i];
+        }
+        free(old);
+    }
+
+    char **entry = find_entry(ss, name);
+    if (!*entry) {
+        size_t len = strlen(name);
+        *entry = malloc(len + 1);
+        if (!*entry) fatal("Out of memory");
+        memcpy(*entry, name, len + 1);
+        ss->name_count++;
+    }
+    return *entry;
+}
+
+static Shape *new_shape(Shape *parent, const char *key) {
+    Shape *s = calloc(1, sizeof(Shape));
+    if (!s) fatal("Out of memory");
+    s->parent = parent;
+    if (parent) {
+        s->count = parent->count + 1;
+        s->keys = malloc(sizeof(char*) * s->count);
+        if (!s->keys) fatal("Out of memory");
+        for (int i = 0; i < parent->count; i++) s->keys[i] = parent->keys[i];
+        s->keys[parent->count] = key;
+    }
+    return s;
+}
+
+Shape *empty_shape(void) {
+    ShapeState *ss = state();
+    if (!ss->root) ss->root = new_shape(NULL, NULL);
+    return ss->root;
+}
+
+int shape_slot(Shape *shape, const char *key) {
+    for (int i = shape->count - 1; i >= 0; i--) {
+        if (shape->keys[i] == key) return i;
+    }
+    return -1;
+}
+
+Shape *shape_add(Shape *shape, const char *key) {
+    for (int i = 0; i < shape->transition_count; i++) {
+        Shape *next = shape->transitions[i];
+        if (next->keys[shape->count] == key) return next;
+    }
+
+    if (shape->transition_count >= shape->transition_capacity) {
+        shape->transition_capacity = shape->transition_capacity ? shape->transition_capacity * 2 : 2;
+        shape->transitions = realloc(shape->transitions,
+                                     sizeof(Shape*) * shape->transition_capacity);
+        if (!shape->transitions) fatal("Out of memory");
+    }
+    Shape *next = new_shape(shape, key);
+    shape->transitions[shape->transition_count++] = next;
+    return next;
+}
+
+static void free_shape(Shape *shape) {
+    for (int i = 0; i < shape->transition_count; i++) {
+        free_shape(shape->transitions[i]);
+    }
+    free(shape->transitions);
+    free(shape->keys);
+    free(shape);
+}
+
+void free_shapes(void) {
+    ShapeState *ss = state();
+    if (ss->root) free_shape(ss->root);
+    for (int i = 0; i < ss->name_capacity; i++) free(ss->names[i]);
+    free(ss->names);
+    memset(ss, 0, sizeof(ShapeState));
+}
@@ -0,0 +1,56 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+// Hidden classes. Objects that gained the same properties in the same
+// order share a Shape, which maps each property name to a slot in the
+// object's value array. Shapes form a transition tree rooted at the empty
+// shape; like the interned names they hold, they live as long as their
+// isolate.
+typedef struct Shape {
+    struct Shape *parent;
+    const char **keys;          // interned property names in slot order
+    int count;
+    struct Shape **transitions;
+    int transition_count;
+    int transition_capacity;
+} Shape;
+
+// One per isolate (isolate.h)
+typedef struct {
+    char **names;               // interned names, open addressing
+    int name_count;
+    int name_capacity;
+    Shape *root;
+} ShapeState;
+
+void free_shapes(void);
+
+// Property names are interned so that shapes compare them by pointer
+const char *intern_name(const char *name);
+// The interned copy of `name`, or NULL if no shape can contain it
+const char *find_interned(const char *name);
+
+Shape *empty_shape(void);
+// Slot of an interned key, or -1
+int shape_slot(Shape *shape, const char *key);
+// The shape reached by adding an interned key
+Shape *shape_add(Shape *shape, const char *key);
+
+#define CACHE_ENTRIES 4
+
+// Inline cache of one property access site. Reads record the slot each
+// shape seen there keeps the property in (-1 if absent); stores also
+// record the shape the object moves to. A site that sees more than
+// CACHE_ENTRIES shapes stops caching new ones.
+typedef struct {
+    Shape *shape;
+    Shape *next;
+    int slot;
+} CacheEntry;
+
+typedef struct PropertyCache {
+    CacheEntry entries[CACHE_ENTRIES];
+    int count;
+} PropertyCache;
+
+#endif
@@ -3,7 +3,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
-#define fatal(msg) do { fprintf(stderr, "%s\n", msg); exit(1); } while(0)
+// Errors are reported on the current isolate's error stream and end its
+// script; without an isolate, or one with no exit handler, they go to
+// stderr and end the process (isolate.c)
+FILE *isolate_stderr(void);
+void isolate_exit(int status) __attribute__((noreturn));
+
+#define fatal(msg) do { fprintf(isolate_stderr(), "%s\n", msg); isolate_exit(1); } while(0)
+
+// FNV-1a, used by every name and key table
+static inline uint32_t hash_bytes(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
 
 #endif
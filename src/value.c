@@ -1,255 +1,543 @@
 #include "value.h"
+#include "gc.h"
+#include "env.h"
+#include "dict.h"
+#include "util.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <float.h>
 
-Value *new_number_val(double n) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_NUMBER;
-    v->as.number = n;
-    return v;
+// Concatenations shorter than this are copied flat rather than roped
+#define ROPE_MIN 64
+
+static ObjString *alloc_string(ValueType type, int length) {
+    ObjString *str = (ObjString*)gc_alloc_object(sizeof(ObjString) + length + 1, type);
+    str->length = length;
+    str->hash = 0;
+    str->is_rope = 0;
+    str->chars = str->data;
+    str->left = NULL;
+    str->right = NULL;
+    str->data[length] = '\0';
+    return str;
 }
 
-Value *new_string_val(const char *s) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_STRING;
-    v->as.string = malloc(strlen(s) + 1);
-    strcpy(v->as.string, s);
-    return v;
+static Value new_string_obj(ValueType type, const char *s) {
+    size_t len = strlen(s);
+    if (len > INT_MAX) fatal("String too long");
+    ObjString *str = alloc_string(type, (int)len);
+    memcpy(str->data, s, len);
+    return OBJ_VAL(str);
 }
 
-Value *new_boolean_val(int b) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_BOOLEAN;
-    v->as.boolean = b ? 1 : 0;
-    return v;
+Value new_string_val(const char *s) {
+    return new_string_obj(VAL_STRING, s);
 }
 
-Value *new_array_val(void) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_ARRAY;
-    v->as.array.capacity = 8;
-    v->as.array.length = 0;
-    v->as.array.elements = malloc(sizeof(Value*) * v->as.array.capacity);
-    return v;
+Value new_string_len(const char *s, int length) {
+    ObjString *str = alloc_string(VAL_STRING, length);
+    memcpy(str->data, s, length);
+    return OBJ_VAL(str);
 }
 
-Value *new_object_val(void) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_OBJECT;
-    v->as.object.capacity = 16;
-    v->as.object.count = 0;
-    v->as.object.entries = malloc(sizeof(ObjectEntry) * v->as.object.capacity);
-    return v;
+static Value concat_strings(ObjString *a, ObjString *b) {
+    if (a->length > INT_MAX - b->length) fatal("String too long");
+    int length = a->length + b->length;
+    if (length < ROPE_MIN) {
+        ObjString *str = alloc_string(VAL_STRING, length);
+        memcpy(str->data, string_chars(a), a->length);
+        memcpy(str->data + a->length, string_chars(b), b->length);
+        return OBJ_VAL(str);
+    }
+
+    ObjString *rope = (ObjString*)gc_alloc_object(sizeof(ObjString), VAL_STRING);
+    rope->length = length;
+    rope->hash = 0;
+    rope->is_rope = 1;
+    rope->chars = NULL;
+    rope->left = a;
+    rope->right = b;
+    return OBJ_VAL(rope);
 }
 
-Value *new_function_val(char **params, int param_count, ASTNode *body) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_FUNCTION;
-    v->as.function.params = params;
-    v->as.function.param_count = param_count;
-    v->as.function.body = body;
-    return v;
+// Copy a rope's leaves into one buffer, back to front so that the
+// left-deep ropes built by `s = s + x` need only a tiny stack
+const char *flatten_string(ObjString *s) {
+    char *buf = gc_realloc(NULL, 0, s->length + 1);
+    buf[s->length] = '\0';
+
+    int capacity = 64;
+    int top = 0;
+    ObjString **stack = malloc(sizeof(ObjString*) * capacity);
+    if (!stack) fatal("Out of memory");
+    stack[top++] = s;
+    int end = s->length;
+    while (top > 0) {
+        ObjString *node = stack[--top];
+        if (node->chars) {
+            end -= node->length;
+            memcpy(buf + end, node->chars, node->length);
+            continue;
+        }
+        if (top + 2 > capacity) {
+            capacity *= 2;
+            stack = realloc(stack, sizeof(ObjString*) * capacity);
+            if (!stack) fatal("Out of memory");
+        }
+        stack[top++] = node->left;
+        stack[top++] = node->right;
+    }
+    free(stack);
+
+    s->chars = buf;
+    s->left = NULL;
+    s->right = NULL;
+    return buf;
 }
 
-Value *new_null_val(void) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_NULL;
-    return v;
+uint32_t string_hash(ObjString *s) {
+    if (s->hash == 0) s->hash = hash_bytes(string_chars(s), s->length);
+    return s->hash;
 }
 
-Value *new_error_val(const char *message) {
-    Value *v = malloc(sizeof(Value));
-    v->type = VAL_ERROR;
-    v->as.string = malloc(strlen(message) + 1);
-    strcpy(v->as.string, message);
-    return v;
+Value new_array_val(void) {
+    ObjArray *arr = (ObjArray*)gc_alloc_object(sizeof(ObjArray), VAL_ARRAY);
+    arr->capacity = 8;
+    arr->length = 0;
+    arr->is_numeric = 1;
+    arr->numbers = gc_realloc(NULL, 0, sizeof(double) * arr->capacity);
+    arr->elements = NULL;
+    return OBJ_VAL(arr);
 }
 
-void free_value(Value *v) {
-    if (!v) return;
-    
-    switch (v->type) {
+Value new_object_val(void) {
+    ObjObject *obj = (ObjObject*)gc_alloc_object(sizeof(ObjObject), VAL_OBJECT);
+    obj->shape = empty_shape();
+    obj->capacity = 4;
+    obj->slots = gc_realloc(NULL, 0, sizeof(Value) * obj->capacity);
+    obj->dict = NULL;
+    return OBJ_VAL(obj);
+}
+
+Value new_function_val(char **params, int param_count, int local_count,
+                       ASTNode *body, struct Env *env) {
+    ObjFunction *fn = (ObjFunction*)gc_alloc_object(sizeof(ObjFunction), VAL_FUNCTION);
+    fn->params = params;
+    fn->param_count = param_count;
+    fn->local_count = local_count;
+    fn->has_closure = 1;
+    fn->body = body;
+    fn->lazy = NULL;
+    fn->proto = NULL;
+    fn->env = env;
+    return OBJ_VAL(fn);
+}
+
+Value new_error_val(const char *message) {
+    return new_string_obj(VAL_ERROR, message);
+}
+
+void free_object(Obj *o) {
+    switch (o->type) {
         case VAL_STRING:
-        case VAL_ERROR:
-            free(v->as.string);
-            break;
-        case VAL_ARRAY:
-            for (int i = 0; i < v->as.array.length; i++) {
-                free_value(v->as.array.elements[i]);
-            }
-            free(v->as.array.elements);
-            break;
-        case VAL_OBJECT:
-            for (int i = 0; i < v->as.object.count; i++) {
-                free(v->as.object.entries[i].key);
-                free_value(v->as.object.entries[i].value);
+        case VAL_ERROR: {
+            ObjString *str = (ObjString*)o;
+            if (!str->is_rope) {
+                gc_realloc(o, sizeof(ObjString) + str->length + 1, 0);
+                return;
             }
-            free(v->as.object.entries);
-            break;
+            if (str->chars) gc_realloc(str->chars, str->length + 1, 0);
+            gc_realloc(o, sizeof(ObjString), 0);
+            return;
+        }
+        case VAL_ARRAY: {
+            ObjArray *arr = (ObjArray*)o;
+            if (arr->is_numeric) gc_realloc(arr->numbers, sizeof(double) * arr->capacity, 0);
+            else gc_realloc(arr->elements, sizeof(Value) * arr->capacity, 0);
+            gc_realloc(o, sizeof(ObjArray), 0);
+            return;
+        }
+        case VAL_OBJECT: {
+            ObjObject *obj = (ObjObject*)o;
+            gc_realloc(obj->slots, sizeof(Value) * obj->capacity, 0);
+            if (obj->dict) free_dict(obj->dict);
+            gc_realloc(o, sizeof(ObjObject), 0);
+            return;
+        }
         case VAL_FUNCTION:
-            for (int i = 0; i < v->as.function.param_count; i++) {
-                // Don't free params - they're managed by AST
-            }
-            // Don't free params array - managed by AST
-            break;
+            // Don't free params - they're managed by AST
+            gc_realloc(o, sizeof(ObjFunction), 0);
+            return;
+        case VAL_ENV:
+            gc_realloc(o, sizeof(Env) + sizeof(Value) * ((Env*)o)->count, 0);
+            return;
         default:
             break;
     }
-    free(v);
 }
 
-Value *copy_value(Value *v) {
-    if (!v) return NULL;
-    
-    switch (v->type) {
-        case VAL_NUMBER:
-            return new_number_val(v->as.number);
-        case VAL_STRING:
-            return new_string_val(v->as.string);
-        case VAL_BOOLEAN:
-            return new_boolean_val(v->as.boolean);
-        case VAL_NULL:
-            return new_null_val();
-        case VAL_ERROR:
-            return new_error_val(v->as.string);
-        case VAL_ARRAY: {
-            Value *arr = new_array_val();
-            for (int i = 0; i < v->as.array.length; i++) {
-                array_push(arr, copy_value(v->as.array.elements[i]));
-            }
-            return arr;
+static void grow_array(ObjArray *arr, size_t needed) {
+    if (needed <= (size_t)arr->capacity) return;
+    if (needed > ARRAY_MAX_LENGTH) fatal("Array too large");
+    size_t capacity = arr->capacity;
+    while (capacity < needed) capacity *= 2;
+    if (capacity > ARRAY_MAX_LENGTH) capacity = ARRAY_MAX_LENGTH;
+    // Both stores use 8-byte elements
+    if (arr->is_numeric) {
+        arr->numbers = gc_realloc(arr->numbers, sizeof(double) * arr->capacity,
+                                  sizeof(double) * capacity);
+    } else {
+        arr->elements = gc_realloc(arr->elements, sizeof(Value) * arr->capacity,
+                                   sizeof(Value) * capacity);
+    }
+    arr->capacity = capacity;
+}
+
+// Box every number in place; the store keeps its size
+static void to_generic(ObjArray *arr) {
+    Value *elements = (Value*)arr->numbers;
+    for (int i = 0; i < arr->length; i++) {
+        double n = arr->numbers[i];
+        elements[i] = new_number_val(n);
+    }
+    arr->elements = elements;
+    arr->numbers = NULL;
+    arr->is_numeric = 0;
+}
+
+void array_push(Value v, Value val) {
+    if (!IS_ARRAY(v)) return;
+
+    ObjArray *arr = AS_ARRAY(v);
+    grow_array(arr, (size_t)arr->length + 1);
+    if (arr->is_numeric) {
+        if (IS_NUMBER(val)) {
+            arr->numbers[arr->length++] = AS_NUMBER(val);
+            return;
         }
-        case VAL_OBJECT: {
-            Value *obj = new_object_val();
-            for (int i = 0; i < v->as.object.count; i++) {
-                object_set(obj, v->as.object.entries[i].key, 
-                          copy_value(v->as.object.entries[i].value));
-            }
-            return obj;
+        to_generic(arr);
+    }
+    arr->elements[arr->length++] = val;
+}
+
+Value array_get(Value v, int index) {
+    if (!IS_ARRAY(v)) return NULL_VAL;
+    ObjArray *arr = AS_ARRAY(v);
+    if (index < 0 || index >= arr->length) return NULL_VAL;
+    if (arr->is_numeric) return new_number_val(arr->numbers[index]);
+    return arr->elements[index];
+}
+
+void array_set(Value v, int index, Value val) {
+    if (!IS_ARRAY(v)) return;
+    if (index < 0) return;
+
+    ObjArray *arr = AS_ARRAY(v);
+    grow_array(arr, (size_t)index + 1);
+
+    if (arr->is_numeric) {
+        if (IS_NUMBER(val) && index <= arr->length) {
+            arr->numbers[index] = AS_NUMBER(val);
+            if (index == arr->length) arr->length++;
+            return;
         }
-        case VAL_FUNCTION:
-            return new_function_val(v->as.function.params, 
-                                   v->as.function.param_count, 
-                                   v->as.function.body);
+        to_generic(arr);
+    }
+
+    while (index >= arr->length) {
+        arr->elements[arr->length++] = NULL_VAL;
     }
-    return NULL;
+
+    arr->elements[index] = val;
+}
+
+static void cache_add(PropertyCache *cache, Shape *shape, Shape *next, int slot) {
+    if (!cache || cache->count >= CACHE_ENTRIES) return;
+    CacheEntry *e = &cache->entries[cache->count++];
+    e->shape = shape;
+    e->next = next;
+    e->slot = slot;
 }
 
-void array_push(Value *arr, Value *val) {
-    if (arr->type != VAL_ARRAY) return;
-    
-    if (arr->as.array.length >= arr->as.array.capacity) {
-        arr->as.array.capacity *= 2;
-        arr->as.array.elements = realloc(arr->as.array.elements, 
-                                        sizeof(Value*) * arr->as.array.capacity);
+// Store into `slot`, moving the object to `next` if that adds a property
+static void object_store(ObjObject *obj, Shape *next, int slot, Value val) {
+    if (next != obj->shape) {
+        if (next->count > obj->capacity) {
+            obj->slots = gc_realloc(obj->slots, sizeof(Value) * obj->capacity,
+                                    sizeof(Value) * obj->capacity * 2);
+            obj->capacity *= 2;
+        }
+        obj->shape = next;
     }
-    arr->as.array.elements[arr->as.array.length++] = val;
+    obj->slots[slot] = val;
 }
 
-Value *array_get(Value *arr, int index) {
-    if (arr->type != VAL_ARRAY) return new_null_val();
-    if (index < 0 || index >= arr->as.array.length) return new_null_val();
-    return arr->as.array.elements[index];
+// Move every property into a hash table, keeping their order
+static void to_dictionary(ObjObject *obj) {
+    Shape *shape = obj->shape;
+    obj->dict = new_dict(shape->count < 4 ? 8 : shape->count * 2);
+    for (int i = 0; i < shape->count; i++) {
+        Value key = new_string_val(shape->keys[i]);
+        dict_set(obj->dict, (ObjString*)AS_OBJ(key), obj->slots[i]);
+    }
+    gc_realloc(obj->slots, sizeof(Value) * obj->capacity, 0);
+    obj->slots = NULL;
+    obj->capacity = 0;
+    obj->shape = NULL;
 }
 
-void array_set(Value *arr, int index, Value *val) {
-    if (arr->type != VAL_ARRAY) return;
-    if (index < 0) return;
-    
-    while (index >= arr->as.array.capacity) {
-        arr->as.array.capacity *= 2;
-        arr->as.array.elements = realloc(arr->as.array.elements, 
-                                        sizeof(Value*) * arr->as.array.capacity);
-    }
-    
-    while (index >= arr->as.array.length) {
-        arr->as.array.elements[arr->as.array.length++] = new_null_val();
-    }
-    
-    free_value(arr->as.array.elements[index]);
-    arr->as.array.elements[index] = val;
-}
-
-void object_set(Value *obj, const char *key, Value *val) {
-    if (obj->type != VAL_OBJECT) return;
-    
-    // Check if key exists
-    for (int i = 0; i < obj->as.object.count; i++) {
-        if (strcmp(obj->as.object.entries[i].key, key) == 0) {
-            free_value(obj->as.object.entries[i].value);
-            obj->as.object.entries[i].value = val;
+static Value *dict_find_name(Dict *d, const char *name) {
+    size_t len = strlen(name);
+    return dict_find(d, name, (int)len, hash_bytes(name, len));
+}
+
+void object_set(Value v, const char *key, Value val, PropertyCache *cache) {
+    if (!IS_OBJECT(v)) return;
+
+    ObjObject *obj = AS_OBJECT(v);
+    if (cache) {
+        for (int i = 0; i < cache->count; i++) {
+            CacheEntry *e = &cache->entries[i];
+            if (e->shape == obj->shape) {
+                object_store(obj, e->next, e->slot, val);
+                return;
+            }
+        }
+    }
+
+    Shape *shape = obj->shape;
+    if (shape) {
+        const char *name = intern_name(key);
+        int slot = shape_slot(shape, name);
+        if (slot >= 0 || shape->count < DICT_THRESHOLD) {
+            Shape *next = shape;
+            if (slot < 0) {
+                next = shape_add(shape, name);
+                slot = shape->count;
+            }
+            cache_add(cache, shape, next, slot);
+            object_store(obj, next, slot, val);
             return;
         }
+        to_dictionary(obj);
     }
-    
-    // Add new entry
-    if (obj->as.object.count >= obj->as.object.capacity) {
-        obj->as.object.capacity *= 2;
-        obj->as.object.entries = realloc(obj->as.object.entries, 
-                                        sizeof(ObjectEntry) * obj->as.object.capacity);
+
+    Value *found = dict_find_name(obj->dict, key);
+    if (found) {
+        *found = val;
+    } else {
+        dict_set(obj->dict, (ObjString*)AS_OBJ(new_string_val(key)), val);
     }
-    
-    obj->as.object.entries[obj->as.object.count].key = malloc(strlen(key) + 1);
-    strcpy(obj->as.object.entries[obj->as.object.count].key, key);
-    obj->as.object.entries[obj->as.object.count].value = val;
-    obj->as.object.count++;
 }
 
-Value *object_get(Value *obj, const char *key) {
-    if (obj->type != VAL_OBJECT) return new_null_val();
-    
-    for (int i = 0; i < obj->as.object.count; i++) {
-        if (strcmp(obj->as.object.entries[i].key, key) == 0) {
-            return obj->as.object.entries[i].value;
+void object_set_key(Value v, Value key, Value val) {
+    if (!IS_OBJECT(v) || !IS_STRING(key)) return;
+
+    ObjObject *obj = AS_OBJECT(v);
+    Shape *shape = obj->shape;
+    if (shape) {
+        // Only names that are already interned may join a shape, so keys
+        // computed at run time never grow the permanent name table
+        const char *name = find_interned(AS_STRING(key));
+        int slot = name ? shape_slot(shape, name) : -1;
+        if (slot >= 0) {
+            obj->slots[slot] = val;
+            return;
+        }
+        if (name && shape->count < DICT_THRESHOLD) {
+            object_store(obj, shape_add(shape, name), shape->count, val);
+            return;
         }
+        to_dictionary(obj);
     }
-    return new_null_val();
+    dict_set(obj->dict, (ObjString*)AS_OBJ(key), val);
 }
 
-char *value_to_string(Value *v) {
-    char *buf = malloc(1024);
-    
-    switch (v->type) {
+Value object_get_key(Value v, Value key) {
+    if (!IS_OBJECT(v) || !IS_STRING(key)) return NULL_VAL;
+
+    ObjObject *obj = AS_OBJECT(v);
+    ObjString *k = (ObjString*)AS_OBJ(key);
+    if (!obj->shape) {
+        Value *found = dict_find(obj->dict, string_chars(k), k->length, string_hash(k));
+        return found ? *found : NULL_VAL;
+    }
+    const char *name = find_interned(string_chars(k));
+    int slot = name ? shape_slot(obj->shape, name) : -1;
+    return slot >= 0 ? obj->slots[slot] : NULL_VAL;
+}
+
+static char *copy_text(const char *prefix, const char *text, size_t length) {
+    size_t plen = strlen(prefix);
+    char *buf = malloc(plen + length + 1);
+    if (!buf) fatal("Out of memory");
+    memcpy(buf, prefix, plen);
+    memcpy(buf + plen, text, length);
+    buf[plen + length] = '\0';
+    return buf;
+}
+
+char *value_to_string(Value v) {
+    char num[32];
+
+    switch (value_type(v)) {
         case VAL_NUMBER:
-            snprintf(buf, 1024, "%g", v->as.number);
-            break;
+            snprintf(num, sizeof(num), "%g", AS_NUMBER(v));
+            return copy_text("", num, strlen(num));
         case VAL_STRING:
-            snprintf(buf, 1024, "%s", v->as.string);
-            break;
+            return copy_text("", AS_STRING(v), ((ObjString*)AS_OBJ(v))->length);
         case VAL_BOOLEAN:
-            snprintf(buf, 1024, "%s", v->as.boolean ? "true" : "false");
-            break;
+            return copy_text("", AS_BOOL(v) ? "true" : "false", AS_BOOL(v) ? 4 : 5);
         case VAL_NULL:
-            snprintf(buf, 1024, "null");
-            break;
+            return copy_text("", "null", 4);
         case VAL_ARRAY:
-            snprintf(buf, 1024, "[Array]");
-            break;
+            return copy_text("", "[Array]", 7);
         case VAL_OBJECT:
-            snprintf(buf, 1024, "[Object]");
-            break;
+            return copy_text("", "[Object]", 8);
         case VAL_FUNCTION:
-            snprintf(buf, 1024, "[Function]");
-            break;
+            return copy_text("", "[Function]", 10);
         case VAL_ERROR:
-            snprintf(buf, 1024, "Error: %s", v->as.string);
-            break;
+            return copy_text("Error: ", AS_STRING(v), ((ObjString*)AS_OBJ(v))->length);
+        case VAL_ENV:
+            return copy_text("", "[Env]", 5);
     }
-    return buf;
+    return copy_text("", "", 0);
 }
 
-int value_is_truthy(Value *v) {
-    switch (v->type) {
+int value_is_truthy(Value v) {
+    switch (value_type(v)) {
         case VAL_NULL:
             return 0;
         case VAL_BOOLEAN:
-            return v->as.boolean;
+            return AS_BOOL(v);
         case VAL_NUMBER:
-            return v->as.number != 0.0;
+            return AS_NUMBER(v) != 0.0;
         case VAL_STRING:
-            return strlen(v->as.string) > 0;
+            return ((ObjString*)AS_OBJ(v))->length > 0;
         default:
             return 1;
     }
 }
+
+Value value_arith(ArithOp op, Value l, Value r) {
+    // String concatenation with +
+    if (op == ARITH_ADD && (IS_STRING(l) || IS_STRING(r))) {
+        // The other operand is converted to a string first; allocating
+        // never collects, so the converted copy needs no rooting
+        if (!IS_STRING(l)) {
+            char *text = value_to_string(l);
+            l = new_string_val(text);
+            free(text);
+        }
+        if (!IS_STRING(r)) {
+            char *text = value_to_string(r);
+            r = new_string_val(text);
+            free(text);
+        }
+        return concat_strings((ObjString*)AS_OBJ(l), (ObjString*)AS_OBJ(r));
+    }
+
+    if (!IS_NUMBER(l) || !IS_NUMBER(r)) {
+        return NULL_VAL;
+    }
+
+    double lv = AS_NUMBER(l);
+    double rv = AS_NUMBER(r);
+    switch (op) {
+        case ARITH_ADD: return new_number_val(lv + rv);
+        case ARITH_SUB: return new_number_val(lv - rv);
+        case ARITH_MUL: return new_number_val(lv * rv);
+        case ARITH_DIV:
+            if (rv == 0) {
+                fprintf(isolate_stderr(), "Division by zero\n");
+                isolate_exit(1);
+            }
+            return new_number_val(lv / rv);
+    }
+    return NULL_VAL;
+}
+
+int value_compare(CompareOp op, Value l, Value r) {
+    int cmp;
+    if (IS_NUMBER(l) && IS_NUMBER(r)) {
+        double lv = AS_NUMBER(l);
+        double rv = AS_NUMBER(r);
+        switch (op) {
+            case CMP_EQ: return lv == rv;
+            case CMP_NE: return lv != rv;
+            case CMP_LT: return lv < rv;
+            case CMP_GT: return lv > rv;
+            case CMP_LE: return lv <= rv;
+            case CMP_GE: return lv >= rv;
+        }
+        return 0;
+    }
+    if (!IS_STRING(l) || !IS_STRING(r)) return 0;
+
+    cmp = strcmp(AS_STRING(l), AS_STRING(r));
+    switch (op) {
+        case CMP_EQ: return cmp == 0;
+        case CMP_NE: return cmp != 0;
+        case CMP_LT: return cmp < 0;
+        case CMP_GT: return cmp > 0;
+        case CMP_LE: return cmp <= 0;
+        case CMP_GE: return cmp >= 0;
+    }
+    return 0;
+}
+
+// The element a number indexes. Finite indexes too large for any array
+// give ARRAY_MAX_LENGTH, so storing there fails; negative and fractional
+// ones, NaN and the infinities name no element and give -1.
+static int element_index(double index) {
+    if (!(index >= 0 && index <= DBL_MAX)) return -1;
+    if (index >= ARRAY_MAX_LENGTH) return ARRAY_MAX_LENGTH;
+    int i = (int)index;
+    return i == index ? i : -1;
+}
+
+Value value_index(Value obj, Value index) {
+    if (IS_ARRAY(obj) && IS_NUMBER(index)) {
+        return array_get(obj, element_index(AS_NUMBER(index)));
+    }
+    if (IS_OBJECT(obj)) {
+        return object_get_key(obj, index);
+    }
+    return NULL_VAL;
+}
+
+void value_set_index(Value obj, Value index, Value val) {
+    if (IS_ARRAY(obj) && IS_NUMBER(index)) {
+        array_set(obj, element_index(AS_NUMBER(index)), val);
+    } else if (IS_OBJECT(obj)) {
+        object_set_key(obj, index, val);
+    }
+}
+
+Value value_member(Value obj, const char *name, PropertyCache *cache) {
+    if (IS_OBJECT(obj)) {
+        ObjObject *o = AS_OBJECT(obj);
+        if (!o->shape) {
+            Value *found = dict_find_name(o->dict, name);
+            return found ? *found : NULL_VAL;
+        }
+        if (cache) {
+            for (int i = 0; i < cache->count; i++) {
+                if (cache->entries[i].shape == o->shape) {
+                    int slot = cache->entries[i].slot;
+                    return slot >= 0 ? o->slots[slot] : NULL_VAL;
+                }
+            }
+        }
+        const char *key = find_interned(name);
+        int slot = key ? shape_slot(o->shape, key) : -1;
+        cache_add(cache, o->shape, o->shape, slot);
+        return slot >= 0 ? o->slots[slot] : NULL_VAL;
+    }
+    if (IS_ARRAY(obj) && strcmp(name, "length") == 0) {
+        return new_number_val(AS_ARRAY(obj)->length);
+    }
+    return NULL_VAL;
+}
@@ -1,7 +1,10 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <stdint.h>
+#include <string.h>
 #include "ast.h"
+#include "shape.h"
 
 typedef enum {
     VAL_NUMBER,
@@ -11,61 +14,189 @@ typedef enum {
     VAL_OBJECT,
     VAL_FUNCTION,
     VAL_NULL,
-    VAL_ERROR
+    VAL_ERROR,
+    VAL_ENV         // scope environment (env.h); never a script value
 } ValueType;
 
-typedef struct Value Value;
-typedef struct ObjectEntry ObjectEntry;
+// A NaN-boxed value. Any bit pattern that is not a quiet NaN with the
+// QNAN bits below set is a double. Null and the booleans are quiet NaNs
+// with a small tag in the low bits; heap cells are quiet NaNs with the
+// sign bit set and the cell pointer in the low 48 bits.
+typedef uint64_t Value;
 
-struct ObjectEntry {
-    char *key;
-    Value *value;
-};
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NULL  1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_EMPTY 4
+
+#define NULL_VAL  ((Value)(QNAN | TAG_NULL))
+#define FALSE_VAL ((Value)(QNAN | TAG_FALSE))
+#define TRUE_VAL  ((Value)(QNAN | TAG_TRUE))
+// A reserved global that has not been assigned yet
+#define EMPTY_VAL ((Value)(QNAN | TAG_EMPTY))
+
+#define IS_NUMBER(v) (((v) & QNAN) != QNAN)
+#define IS_NULL(v)   ((v) == NULL_VAL)
+#define IS_BOOL(v)   (((v) | 1) == TRUE_VAL)
+#define IS_OBJ(v)    (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(v)   ((v) == TRUE_VAL)
+#define AS_OBJ(v)    ((Obj*)(uintptr_t)((v) & ~(SIGN_BIT | QNAN)))
+#define OBJ_VAL(o)   ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(o)))
+
+#define IS_STRING(v)   (IS_OBJ(v) && AS_OBJ(v)->type == VAL_STRING)
+#define IS_ARRAY(v)    (IS_OBJ(v) && AS_OBJ(v)->type == VAL_ARRAY)
+#define IS_OBJECT(v)   (IS_OBJ(v) && AS_OBJ(v)->type == VAL_OBJECT)
+#define IS_FUNCTION(v) (IS_OBJ(v) && AS_OBJ(v)->type == VAL_FUNCTION)
+#define IS_ERROR(v)    (IS_OBJ(v) && AS_OBJ(v)->type == VAL_ERROR)
 
-struct Value {
+#define AS_STRING(v)   (string_chars((ObjString*)AS_OBJ(v)))
+#define AS_ARRAY(v)    ((ObjArray*)AS_OBJ(v))
+#define AS_OBJECT(v)   ((ObjObject*)AS_OBJ(v))
+#define AS_FUNCTION(v) ((ObjFunction*)AS_OBJ(v))
+
+typedef struct Obj Obj;
+struct FuncProto;
+struct Env;
+struct Dict;
+
+// Common header of every heap cell. Cells are owned by the garbage
+// collector (gc.c), which links them all through `next`.
+struct Obj {
     ValueType type;
-    union {
-        double number;
-        char *string;
-        int boolean;
-        struct {
-            Value **elements;
-            int length;
-            int capacity;
-        } array;
-        struct {
-            ObjectEntry *entries;
-            int count;
-            int capacity;
-        } object;
-        struct {
-            char **params;
-            int param_count;
-            ASTNode *body;
-        } function;
-    } as;
+    unsigned char marked;
+    struct Obj *next;
 };
 
-Value *new_number_val(double n);
-Value *new_string_val(const char *s);
-Value *new_boolean_val(int b);
-Value *new_array_val(void);
-Value *new_object_val(void);
-Value *new_function_val(char **params, int param_count, ASTNode *body);
-Value *new_null_val(void);
-Value *new_error_val(const char *message);
+// Strings and error messages. Concatenation builds a rope: `chars` stays
+// NULL and the halves are kept in `left` and `right` until something needs
+// the text, which flattens it into a separate buffer once. Strings created
+// flat keep their text inline in `data`.
+typedef struct ObjString {
+    Obj obj;
+    int length;
+    uint32_t hash;          // 0 until string_hash computes it
+    int is_rope;            // allocated without `data`
+    char *chars;
+    struct ObjString *left;
+    struct ObjString *right;
+    char data[];
+} ObjString;
+
+// Arrays start out numeric: while every element is a number they are kept
+// as plain doubles in `numbers`, which the collector never has to scan.
+// The first element that is not a number (including a hole left by writing
+// past the end) converts the store in place to Values in `elements`.
+// Lengths are capped at ARRAY_MAX_LENGTH, so sizes never overflow.
+#define ARRAY_MAX_LENGTH (1 << 28)
+
+typedef struct {
+    Obj obj;
+    int is_numeric;
+    double *numbers;        // numeric store, or NULL
+    Value *elements;        // generic store, or NULL
+    int length;
+    int capacity;
+} ObjArray;
+
+// Property values live in `slots`, laid out as `shape` describes. Objects
+// that outgrow DICT_THRESHOLD properties, or gain one under a computed key
+// that no shape knows, switch to dictionary mode: `shape` becomes NULL and
+// the properties move to a hash table.
+#define DICT_THRESHOLD 32
+
+typedef struct {
+    Obj obj;
+    Shape *shape;
+    Value *slots;
+    int capacity;
+    struct Dict *dict;
+} ObjObject;
+
+typedef struct {
+    Obj obj;
+    char **params;
+    int param_count;
+    int local_count;          // slots in a call's Env, parameters first
+    int has_closure;          // a closure created by a call may capture its Env
+    ASTNode *body;
+    ASTNode *lazy;            // the NODE_FUNCTION while its body is unparsed (tree walker)
+    struct FuncProto *proto;  // compiled body, set by the VM
+    struct Env *env;          // Env the function was created in
+} ObjFunction;
+
+static inline Value new_number_val(double n) {
+    Value v;
+    if (n != n) {
+        // Canonicalise NaNs so they can never collide with a tag
+        v = (uint64_t)0x7ff8000000000000;
+        return v;
+    }
+    memcpy(&v, &n, sizeof(v));
+    return v;
+}
+
+static inline double AS_NUMBER(Value v) {
+    double n;
+    memcpy(&n, &v, sizeof(n));
+    return n;
+}
+
+static inline Value new_boolean_val(int b) {
+    return b ? TRUE_VAL : FALSE_VAL;
+}
+
+static inline Value new_null_val(void) {
+    return NULL_VAL;
+}
+
+static inline ValueType value_type(Value v) {
+    if (IS_NUMBER(v)) return VAL_NUMBER;
+    if (IS_OBJ(v)) return AS_OBJ(v)->type;
+    if (IS_BOOL(v)) return VAL_BOOLEAN;
+    return VAL_NULL;
+}
+
+Value new_string_val(const char *s);
+Value new_string_len(const char *s, int length);
+const char *flatten_string(ObjString *s);
+
+static inline const char *string_chars(ObjString *s) {
+    return s->chars ? s->chars : flatten_string(s);
+}
+Value new_array_val(void);
+Value new_object_val(void);
+Value new_function_val(char **params, int param_count, int local_count,
+                       ASTNode *body, struct Env *env);
+Value new_error_val(const char *message);
+
+// Release a cell and everything it owns; only the collector calls this
+void free_object(Obj *o);
+
+void array_push(Value arr, Value val);
+Value array_get(Value arr, int index);
+void array_set(Value arr, int index, Value val);
 
-void free_value(Value *v);
-Value *copy_value(Value *v);
+uint32_t string_hash(ObjString *s);
 
-void array_push(Value *arr, Value *val);
-Value *array_get(Value *arr, int index);
-void array_set(Value *arr, int index, Value *val);
+// `cache` is the inline cache of the access site, or NULL
+void object_set(Value obj, const char *key, Value val, PropertyCache *cache);
+// Computed keys: `key` is a string value
+void object_set_key(Value obj, Value key, Value val);
+Value object_get_key(Value obj, Value key);
 
-void object_set(Value *obj, const char *key, Value *val);
-Value *object_get(Value *obj, const char *key);
+// A malloc'd copy of the value's printed form
+char *value_to_string(Value v);
+int value_is_truthy(Value v);
 
-char *value_to_string(Value *v);
-int value_is_truthy(Value *v);
+// Operator semantics shared by the tree walker and the VM
+Value value_arith(ArithOp op, Value l, Value r);
+int value_compare(CompareOp op, Value l, Value r);
+Value value_index(Value obj, Value index);
+Value value_member(Value obj, const char *name, PropertyCache *cache);
+void value_set_index(Value obj, Value index, Value val);
 
 #endif
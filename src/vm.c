@@ -0,0 +1,503 @@
+#include "vm.h"
+#include "env.h"
+#include "gc.h"
+#include "isolate.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STACK_MAX 65536
+#define FRAMES_MAX 16384
+#define HANDLERS_MAX 1024
+
+typedef struct CallFrame {
+    FuncProto *fn;
+    uint8_t *ip;
+    int stack_base;     // stack height once the arguments are consumed
+    int scope_depth;    // scope depth to restore on return
+} CallFrame;
+
+// An active try statement: where to resume and what to unwind to
+typedef struct Handler {
+    int frame_count;
+    int sp;
+    int scope_depth;
+    uint8_t *target;
+} Handler;
+
+static VMState *state(void) {
+    return &current_isolate->vm;
+}
+
+static void push(VMState *vm, Value v) {
+    if (vm->sp >= STACK_MAX) fatal("Stack overflow");
+    vm->stack[vm->sp++] = v;
+}
+
+static Value pop(VMState *vm) {
+    return vm->stack[--vm->sp];
+}
+
+static void unwind_scopes(int target) {
+    while (scope_depth() > target) {
+        pop_scope();
+    }
+}
+
+// Transfer control to the innermost handler, or abort if there is none
+static CallFrame *raise(VMState *vm, Value exception) {
+    if (vm->handler_count == 0) {
+        char *msg = value_to_string(exception);
+        fprintf(isolate_stderr(), "Uncaught %s\n", msg);
+        free(msg);
+        isolate_exit(1);
+    }
+
+    Handler *h = &vm->handlers[--vm->handler_count];
+    vm->frame_count = h->frame_count;
+    vm->sp = h->sp;
+    unwind_scopes(h->scope_depth);
+
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    frame->ip = h->target;
+    push(vm, exception);
+    return frame;
+}
+
+static Value make_exception(Value v) {
+    if (IS_ERROR(v)) return v;
+    char *msg = value_to_string(v);
+    Value err = new_error_val(msg);
+    free(msg);
+    return err;
+}
+
+// Where the compiler supports labels as values, every handler jumps
+// straight to the next instruction's handler through a table: each jump
+// gets a branch predictor entry of its own instead of all of them sharing
+// the switch's. Other compilers, and builds with -DNO_COMPUTED_GOTO, go
+// round the switch. bench/dispatch.sh compares the two.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+#ifdef COMPUTED_GOTO
+#define CASE(op) case op: L_##op
+#define DEFAULT default: L_unknown
+#define NEXT() goto *dispatch[op = READ_BYTE()]
+#else
+#define CASE(op) case op
+#define DEFAULT default
+#define NEXT() break
+#endif
+
+static void run(VMState *vm, FuncProto *script) {
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *const dispatch[256] = {
+        [0 ... 255] = &&L_unknown,
+        [OP_CONST] = &&L_OP_CONST,
+        [OP_NULL] = &&L_OP_NULL,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_POP] = &&L_OP_POP,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_NE] = &&L_OP_NE,
+        [OP_LT] = &&L_OP_LT,
+        [OP_GT] = &&L_OP_GT,
+        [OP_LE] = &&L_OP_LE,
+        [OP_GE] = &&L_OP_GE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_TRUTHY] = &&L_OP_TRUTHY,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_ARRAY] = &&L_OP_ARRAY,
+        [OP_OBJECT] = &&L_OP_OBJECT,
+        [OP_INIT_PROP] = &&L_OP_INIT_PROP,
+        [OP_INDEX] = &&L_OP_INDEX,
+        [OP_MEMBER] = &&L_OP_MEMBER,
+        [OP_SET_INDEX] = &&L_OP_SET_INDEX,
+        [OP_SET_MEMBER] = &&L_OP_SET_MEMBER,
+        [OP_FUNCTION] = &&L_OP_FUNCTION,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_PUSH_SCOPE] = &&L_OP_PUSH_SCOPE,
+        [OP_POP_SCOPE] = &&L_OP_POP_SCOPE,
+        [OP_TRY] = &&L_OP_TRY,
+        [OP_POP_TRY] = &&L_OP_POP_TRY,
+        [OP_THROW] = &&L_OP_THROW,
+        [OP_HALT] = &&L_OP_HALT,
+        [OP_GLOBAL_CMP_CONST] = &&L_OP_GLOBAL_CMP_CONST,
+        [OP_LOCAL_CMP_CONST] = &&L_OP_LOCAL_CMP_CONST,
+        [OP_GLOBAL_ARITH_CONST] = &&L_OP_GLOBAL_ARITH_CONST,
+        [OP_LOCAL_ARITH_CONST] = &&L_OP_LOCAL_ARITH_CONST,
+    };
+#pragma GCC diagnostic pop
+#endif
+
+    int base_frames = vm->frame_count;
+    CallFrame *frame = &vm->frames[vm->frame_count++];
+    frame->fn = script;
+    frame->ip = script->chunk.code;
+    frame->stack_base = vm->sp;
+    frame->scope_depth = scope_depth();
+
+#define READ_BYTE() (*frame->ip++)
+#define READ_SHORT() (frame->ip += 2, (uint16_t)(frame->ip[-2] | (frame->ip[-1] << 8)))
+#define CONSTANT(i) (frame->fn->chunk.constants[i])
+#define NAME(i) AS_STRING(CONSTANT(i))
+
+    uint8_t op;
+    for (;;) {
+        op = READ_BYTE();
+        switch (op) {
+            CASE(OP_CONST):
+                push(vm, CONSTANT(READ_SHORT()));
+                NEXT();
+
+            CASE(OP_NULL):  push(vm, NULL_VAL); NEXT();
+            CASE(OP_TRUE):  push(vm, TRUE_VAL); NEXT();
+            CASE(OP_FALSE): push(vm, FALSE_VAL); NEXT();
+
+            CASE(OP_POP):
+                vm->sp--;
+                NEXT();
+
+            CASE(OP_GET_GLOBAL):
+                push(vm, get_global(READ_SHORT()));
+                NEXT();
+
+            CASE(OP_SET_GLOBAL):
+                set_global(READ_SHORT(), pop(vm));
+                NEXT();
+
+            CASE(OP_GET_LOCAL): {
+                int depth = READ_SHORT();
+                push(vm, *env_slot(current_env(), depth, READ_SHORT()));
+                NEXT();
+            }
+
+            CASE(OP_SET_LOCAL): {
+                int depth = READ_SHORT();
+                *env_slot(current_env(), depth, READ_SHORT()) = pop(vm);
+                NEXT();
+            }
+
+            CASE(OP_ADD):
+            CASE(OP_SUB):
+            CASE(OP_MUL):
+            CASE(OP_DIV): {
+                Value r = pop(vm);
+                Value l = pop(vm);
+                push(vm, value_arith((ArithOp)(ARITH_ADD + (op - OP_ADD)), l, r));
+                NEXT();
+            }
+
+            CASE(OP_EQ):
+            CASE(OP_NE):
+            CASE(OP_LT):
+            CASE(OP_GT):
+            CASE(OP_LE):
+            CASE(OP_GE): {
+                Value r = pop(vm);
+                Value l = pop(vm);
+                push(vm, new_boolean_val(value_compare((CompareOp)(CMP_EQ + (op - OP_EQ)), l, r)));
+                NEXT();
+            }
+
+            CASE(OP_NOT):
+            CASE(OP_TRUTHY): {
+                Value v = pop(vm);
+                int truthy = value_is_truthy(v);
+                push(vm, new_boolean_val(op == OP_NOT ? !truthy : truthy));
+                NEXT();
+            }
+
+            CASE(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                frame->ip += offset;
+                NEXT();
+            }
+
+            CASE(OP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                Value cond = pop(vm);
+                if (!value_is_truthy(cond)) frame->ip += offset;
+                NEXT();
+            }
+
+            CASE(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                frame->ip -= offset;
+                gc_maybe_collect();
+                NEXT();
+            }
+
+            CASE(OP_PRINT): {
+                char *str = value_to_string(vm->stack[vm->sp - 1]);
+                fprintf(current_isolate->out, "%s\n", str);
+                free(str);
+                NEXT();
+            }
+
+            CASE(OP_ARRAY): {
+                int count = READ_SHORT();
+                Value arr = new_array_val();
+                for (int i = vm->sp - count; i < vm->sp; i++) {
+                    array_push(arr, vm->stack[i]);
+                }
+                vm->sp -= count;
+                push(vm, arr);
+                NEXT();
+            }
+
+            CASE(OP_OBJECT):
+                push(vm, new_object_val());
+                NEXT();
+
+            CASE(OP_INIT_PROP): {
+                const char *key = NAME(READ_SHORT());
+                PropertyCache *cache = &frame->fn->chunk.caches[READ_SHORT()];
+                Value val = pop(vm);
+                object_set(vm->stack[vm->sp - 1], key, val, cache);
+                NEXT();
+            }
+
+            CASE(OP_INDEX): {
+                Value index = pop(vm);
+                Value obj = pop(vm);
+                push(vm, value_index(obj, index));
+                NEXT();
+            }
+
+            CASE(OP_MEMBER): {
+                const char *name = NAME(READ_SHORT());
+                PropertyCache *cache = &frame->fn->chunk.caches[READ_SHORT()];
+                Value obj = pop(vm);
+                push(vm, value_member(obj, name, cache));
+                NEXT();
+            }
+
+            CASE(OP_SET_INDEX): {
+                Value val = pop(vm);
+                Value index = pop(vm);
+                Value obj = pop(vm);
+                value_set_index(obj, index, val);
+                push(vm, val);
+                NEXT();
+            }
+
+            CASE(OP_SET_MEMBER): {
+                const char *name = NAME(READ_SHORT());
+                PropertyCache *cache = &frame->fn->chunk.caches[READ_SHORT()];
+                Value val = pop(vm);
+                Value obj = pop(vm);
+                object_set(obj, name, val, cache);
+                push(vm, val);
+                NEXT();
+            }
+
+            CASE(OP_FUNCTION): {
+                FuncProto *fn = frame->fn->chunk.functions[READ_SHORT()];
+                Value v = new_function_val(fn->params, fn->param_count, fn->local_count,
+                                           NULL, current_env());
+                AS_FUNCTION(v)->has_closure = fn->has_closure;
+                AS_FUNCTION(v)->proto = fn;
+                push(vm, v);
+                NEXT();
+            }
+
+            CASE(OP_CALL): {
+                const char *name = NAME(READ_SHORT());
+                int argc = READ_SHORT();
+                Value func = vm->stack[vm->sp - argc - 1];
+                if (!IS_FUNCTION(func) || !AS_FUNCTION(func)->proto) {
+                    fprintf(isolate_stderr(), "Not a function: %s\n", name);
+                    isolate_exit(1);
+                }
+                FuncProto *fn = AS_FUNCTION(func)->proto;
+                if (argc != fn->param_count) {
+                    fprintf(isolate_stderr(), "Function %s expects %d arguments, got %d\n",
+                            name, fn->param_count, argc);
+                    isolate_exit(1);
+                }
+                if (vm->frame_count >= FRAMES_MAX) fatal("Call stack overflow");
+                if (fn->lazy) compile_lazy(fn);
+
+                int depth = scope_depth();
+                Env *env = new_env(AS_FUNCTION(func)->env, fn->local_count,
+                                   !fn->has_closure);
+                for (int i = 0; i < argc; i++) {
+                    env->slots[i] = vm->stack[vm->sp - argc + i];
+                }
+                vm->sp -= argc + 1;
+                push_scope(env);
+
+                frame = &vm->frames[vm->frame_count++];
+                frame->fn = fn;
+                frame->ip = fn->chunk.code;
+                frame->stack_base = vm->sp;
+                frame->scope_depth = depth;
+                gc_maybe_collect();
+                NEXT();
+            }
+
+            CASE(OP_RETURN): {
+                Value result = pop(vm);
+                while (vm->handler_count > 0 &&
+                       vm->handlers[vm->handler_count - 1].frame_count >= vm->frame_count) {
+                    vm->handler_count--;
+                }
+                vm->sp = frame->stack_base;
+                if (vm->frame_count - 1 == base_frames) {
+                    // Returning from the script itself ends it
+                    vm->frame_count = base_frames;
+                    return;
+                }
+                unwind_scopes(frame->scope_depth);
+                vm->frame_count--;
+                frame = &vm->frames[vm->frame_count - 1];
+                push(vm, result);
+                NEXT();
+            }
+
+            CASE(OP_PUSH_SCOPE): {
+                int count = READ_SHORT();
+                Env *env = new_env(current_env(), count, READ_SHORT());
+                env->slots[0] = pop(vm);
+                push_scope(env);
+                NEXT();
+            }
+
+            CASE(OP_POP_SCOPE):
+                pop_scope();
+                NEXT();
+
+            CASE(OP_TRY): {
+                uint16_t offset = READ_SHORT();
+                if (vm->handler_count >= HANDLERS_MAX) fatal("Too many nested try blocks");
+                Handler *h = &vm->handlers[vm->handler_count++];
+                h->frame_count = vm->frame_count;
+                h->sp = vm->sp;
+                h->scope_depth = scope_depth();
+                h->target = frame->ip + offset;
+                NEXT();
+            }
+
+            CASE(OP_POP_TRY):
+                vm->handler_count--;
+                NEXT();
+
+            CASE(OP_THROW):
+                frame = raise(vm, make_exception(pop(vm)));
+                NEXT();
+
+            CASE(OP_GLOBAL_CMP_CONST): {
+                Value l = get_global(READ_SHORT());
+                Value r = CONSTANT(READ_SHORT());
+                push(vm, new_boolean_val(value_compare((CompareOp)READ_BYTE(), l, r)));
+                NEXT();
+            }
+
+            CASE(OP_LOCAL_CMP_CONST): {
+                int depth = READ_SHORT();
+                Value l = *env_slot(current_env(), depth, READ_SHORT());
+                Value r = CONSTANT(READ_SHORT());
+                push(vm, new_boolean_val(value_compare((CompareOp)READ_BYTE(), l, r)));
+                NEXT();
+            }
+
+            CASE(OP_GLOBAL_ARITH_CONST): {
+                Value l = get_global(READ_SHORT());
+                Value r = CONSTANT(READ_SHORT());
+                push(vm, value_arith((ArithOp)READ_BYTE(), l, r));
+                NEXT();
+            }
+
+            CASE(OP_LOCAL_ARITH_CONST): {
+                int depth = READ_SHORT();
+                Value l = *env_slot(current_env(), depth, READ_SHORT());
+                Value r = CONSTANT(READ_SHORT());
+                push(vm, value_arith((ArithOp)READ_BYTE(), l, r));
+                NEXT();
+            }
+
+            CASE(OP_HALT):
+                vm->frame_count = base_frames;
+                return;
+
+            DEFAULT:
+                fprintf(isolate_stderr(), "Unknown opcode: %d\n", op);
+                isolate_exit(1);
+        }
+    }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef CONSTANT
+#undef NAME
+}
+
+void vm_run(FuncProto *script) {
+    VMState *vm = state();
+    if (!vm->stack) {
+        vm->stack = malloc(sizeof(Value) * STACK_MAX);
+        vm->frames = malloc(sizeof(CallFrame) * FRAMES_MAX);
+        vm->handlers = malloc(sizeof(Handler) * HANDLERS_MAX);
+        if (!vm->stack || !vm->frames || !vm->handlers) fatal("Out of memory");
+    }
+    if (vm->script_count >= vm->script_capacity) {
+        vm->script_capacity = vm->script_capacity ? vm->script_capacity * 2 : 16;
+        vm->scripts = realloc(vm->scripts, sizeof(FuncProto*) * vm->script_capacity);
+        if (!vm->scripts) fatal("Out of memory");
+    }
+    vm->scripts[vm->script_count++] = script;
+    run(vm, script);
+    if (script->chunk.func_count == 0) {
+        vm->script_count--;
+        free_func_proto(script);
+    }
+}
+
+static void mark_proto(FuncProto *fn) {
+    for (int i = 0; i < fn->chunk.const_count; i++) {
+        gc_mark_value(fn->chunk.constants[i]);
+    }
+    for (int i = 0; i < fn->chunk.func_count; i++) {
+        mark_proto(fn->chunk.functions[i]);
+    }
+}
+
+void vm_mark_roots(void) {
+    VMState *vm = state();
+    for (int i = 0; i < vm->sp; i++) {
+        gc_mark_value(vm->stack[i]);
+    }
+    for (int i = 0; i < vm->script_count; i++) {
+        mark_proto(vm->scripts[i]);
+    }
+}
+
+void vm_free(void) {
+    VMState *vm = state();
+    for (int i = 0; i < vm->script_count; i++) {
+        free_func_proto(vm->scripts[i]);
+    }
+    free(vm->scripts);
+    free(vm->stack);
+    free(vm->frames);
+    free(vm->handlers);
+    memset(vm, 0, sizeof(VMState));
+}
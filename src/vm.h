@@ -0,0 +1,31 @@
+#ifndef VM_H
+#define VM_H
+
+#include "bytecode.h"
+
+// One per isolate (isolate.h); the stacks are allocated on first use
+typedef struct {
+    Value *stack;
+    int sp;
+    struct CallFrame *frames;
+    int frame_count;
+    struct Handler *handlers;   // active try statements
+    int handler_count;
+    // Scripts with function literals stay loaded until vm_free: function
+    // values created while running them point into their nested
+    // prototypes. The rest are only kept while they run, so their
+    // constants stay marked.
+    FuncProto **scripts;
+    int script_count;
+    int script_capacity;
+} VMState;
+
+// Execute a compiled script. Globals live in the shared global table,
+// so consecutive scripts see each other's variables. The VM takes the
+// script: one that defines functions stays loaded until vm_free(), any
+// other is freed once it has run.
+void vm_run(FuncProto *script);
+void vm_mark_roots(void);
+void vm_free(void);
+
+#endif
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Indexes that name no element, on both engines: fractional, negative,
+# NaN, infinite and too large for any array.
+# usage: tests/arrays.sh
+
+. "$(dirname "$0")/common.sh"
+
+cat > "$DIR/index.js" <<'JS'
+let a = [1, 2, 3];
+let big = 1000000000 * 1000000000;
+let inf = big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big * big;
+let nan = inf - inf;
+print(a[1.5]);
+print(a[-1]);
+print(a[nan]);
+print(a[inf]);
+print(a[big]);
+a[1.5] = 9;
+a[-2] = 9;
+a[nan] = 9;
+a[inf] = 9;
+print(a[1]);
+a[5] = 6;
+print(a[4]);
+print(a[5]);
+a[big] = 1;
+print("unreached");
+JS
+for engine in vm ast; do
+    check "index ($engine)" "null
+null
+null
+null
+null
+2
+null
+6" "Array too large" 1 "$BIN" --engine=$engine "$DIR/index.js"
+done
+
+finish arrays
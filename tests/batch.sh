@@ -0,0 +1,56 @@
+#!/bin/sh
+# --batch captures each script's output under a header, in list order
+# whatever the number of threads; failures go to stderr under their
+# header without stopping the others, and make the exit status 1.
+# usage: tests/batch.sh
+
+. "$(dirname "$0")/common.sh"
+
+printf 'shared = "a";\nprint("a1");\nprint("a2");\n' > "$DIR/a.js"
+printf 'print("b1");\nthrow "bad";\n' > "$DIR/b.js"
+printf 'print(1 +);\n' > "$DIR/c.js"
+# Isolates share nothing, so the global set by a.js does not exist here
+printf 'print(shared);\n' > "$DIR/d.js"
+printf 'print("e");\n' > "$DIR/e.js"
+printf '%s\n' "$DIR/a.js" "# comment" "$DIR/b.js" "$DIR/c.js" "$DIR/missing.js" \
+       "" "$DIR/d.js" "$DIR/e.js" > "$DIR/list.txt"
+printf '%s\n' "$DIR/a.js" "$DIR/e.js" > "$DIR/ok.txt"
+
+# batch ARGS...: run --batch like `run`, leaving out the summary lines,
+# which hold timings
+batch() {
+    run "$BIN" "$@"
+    err=$(printf '%s\n' "$err" | grep -v '^Batch: \|^Latency: ')
+}
+
+for engine in vm ast; do
+    for threads in 1 4; do
+        batch --engine=$engine --batch "$DIR/list.txt" -j $threads
+        compare "failures ($engine, -j $threads)" "==> $DIR/a.js <==
+a1
+a2
+==> $DIR/b.js <==
+b1
+==> $DIR/c.js <==
+==> $DIR/missing.js <==
+==> $DIR/d.js <==
+==> $DIR/e.js <==
+e" "==> $DIR/b.js <== exit status 1
+Uncaught Error: bad
+==> $DIR/c.js <== exit status 1
+Unexpected token in primary
+==> $DIR/missing.js <== exit status 1
+open: No such file or directory
+==> $DIR/d.js <== exit status 1
+Undefined variable: shared" 1
+
+        batch --engine=$engine --batch "$DIR/ok.txt" -j $threads
+        compare "success ($engine, -j $threads)" "==> $DIR/a.js <==
+a1
+a2
+==> $DIR/e.js <==
+e" "" 0
+    done
+done
+
+finish batch
@@ -0,0 +1,74 @@
+#!/bin/sh
+# The first run with --cache-dir writes an entry and later runs load it
+# with the same output; a damaged entry is ignored and rewritten.
+# usage: tests/cache.sh
+
+. "$(dirname "$0")/common.sh"
+
+# load NAME FILE: run FILE from the cache and check it was loaded
+load() {
+    run "$BIN" --cache-dir="$DIR/cache" --timings "$2"
+    case $err in
+        *"cache load"*) ;;
+        *) fail "$1" "entry was not loaded: $err" ;;
+    esac
+}
+
+for f in example/*.js; do
+    rm -rf "$DIR/cache"
+    run "$BIN" "$f"
+    want_out=$out want_err=$err want_status=$status
+    check "$f (miss)" "$want_out" "$want_err" "$want_status" "$BIN" --cache-dir="$DIR/cache" "$f"
+    [ "$(ls "$DIR/cache")" ] || fail "$f" "no entry was written"
+    load "$f (hit)" "$f"
+    [ "$out" = "$want_out" ] || fail "$f (hit)" "got $out"
+done
+
+cat > "$DIR/script.js" <<'JS'
+function area(w, h) { return w * h; }
+shapes = [{ w: 2, h: 3 }, { w: 4, h: 5 }];
+total = 0;
+i = 0;
+while (i < 2) {
+    total = total + area(shapes[i].w, shapes[i].h);
+    i = i + 1;
+}
+try { throw "done"; } catch (e) { print(e); }
+print(total);
+JS
+want="Error: done
+26"
+
+# corrupt NAME: run the script over a damaged entry, which must be parsed
+# as usual and then loaded once it has been rewritten
+corrupt() {
+    run "$BIN" --cache-dir="$DIR/cache" --timings "$DIR/script.js"
+    [ "$out" = "$want" ] && [ $status = 0 ] || fail "$1" "got status $status, $out"
+    case $err in
+        *"cache load"*) fail "$1" "damaged entry was loaded" ;;
+    esac
+    load "$1 (rewritten)" "$DIR/script.js"
+    [ "$out" = "$want" ] || fail "$1 (rewritten)" "got $out"
+}
+
+rm -rf "$DIR/cache"
+"$BIN" --cache-dir="$DIR/cache" "$DIR/script.js" > /dev/null
+entry=$(ls "$DIR"/cache/*.mjsc)
+size=$(wc -c < "$entry")
+
+# A flipped byte anywhere after the header fails the checksum
+for at in 60 $((size / 2)) $((size - 1)); do
+    byte=$(od -An -tu1 -j $at -N1 "$entry")
+    printf "\\$(printf %o $(((byte + 1) % 256)))" |
+        dd of="$entry" bs=1 seek=$at conv=notrunc 2> /dev/null
+    corrupt "byte $at"
+done
+
+head -c $((size / 2)) "$entry" > "$DIR/half"
+cp "$DIR/half" "$entry"
+corrupt "truncated"
+
+: > "$entry"
+corrupt "empty"
+
+finish cache
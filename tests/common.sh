@@ -0,0 +1,45 @@
+# Sourced by the tests: the binary under test, a scratch directory that is
+# removed on exit, and helpers that compare what a command prints.
+
+BIN=${BIN:-build/mini_js}
+DIR=$(mktemp -d /tmp/mini_js_test.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+failed=0
+
+# run COMMAND...: run it, leaving its stdout, stderr and exit status in
+# $out, $err and $status
+run() {
+    out=$("$@" 2> "$DIR/stderr")
+    status=$?
+    err=$(cat "$DIR/stderr")
+}
+
+# check NAME STDOUT STDERR STATUS COMMAND...: run COMMAND and compare
+check() {
+    name=$1 want_out=$2 want_err=$3 want_status=$4
+    shift 4
+    run "$@"
+    compare "$name" "$want_out" "$want_err" "$want_status"
+}
+
+# compare NAME STDOUT STDERR STATUS: compare with $out, $err and $status
+compare() {
+    name=$1 want_out=$2 want_err=$3 want_status=$4
+    if [ "$out" != "$want_out" ] || [ "$err" != "$want_err" ] || [ "$status" != "$want_status" ]; then
+        printf '%s: expected status %s, stdout\n%s\nstderr\n%s\ngot status %s, stdout\n%s\nstderr\n%s\n' \
+               "$name" "$want_status" "$want_out" "$want_err" "$status" "$out" "$err"
+        failed=1
+    fi
+}
+
+# fail NAME MESSAGE
+fail() {
+    echo "$1: $2"
+    failed=1
+}
+
+# finish TEST: report and exit with the result
+finish() {
+    [ $failed = 0 ] && echo "$1: ok"
+    exit $failed
+}
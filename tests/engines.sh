@@ -0,0 +1,68 @@
+#!/bin/sh
+# The tree walker is the reference for the VM: every example must print
+# the same and exit with the same status on both engines, and so must the
+# ways of leaving a try block.
+# usage: tests/engines.sh
+
+. "$(dirname "$0")/common.sh"
+
+for f in example/*.js; do
+    run "$BIN" --engine=vm "$f"
+    vm_out=$out vm_err=$err vm_status=$status
+    check "$f" "$vm_out" "$vm_err" "$vm_status" "$BIN" --engine=ast "$f"
+done
+
+cat > "$DIR/try.js" <<'JS'
+function f() {
+    try { return 1; } finally { print("finally after return"); }
+}
+print(f());
+function g() {
+    try { throw "boom"; } finally { print("finally after throw"); }
+}
+try { g(); } catch (e) { print(e); }
+function h() {
+    try { return 1; } finally { return 2; }
+}
+print(h());
+function k() {
+    try { throw "x"; } catch (e) { throw "from catch"; } finally { print("finally after catch"); }
+}
+try { k(); } catch (e) { print(e); }
+function m() {
+    let i = 0;
+    while (i < 3) {
+        try { i = i + 1; if (i == 2) { return i; } } finally { print("loop finally " + i); }
+    }
+    return 0;
+}
+print(m());
+JS
+for engine in vm ast; do
+    check "try ($engine)" "finally after return
+1
+finally after throw
+Error: boom
+2
+finally after catch
+Error: from catch
+loop finally 1
+loop finally 2
+2" "" 0 "$BIN" --engine=$engine "$DIR/try.js"
+done
+
+# A top-level return ends its statement only; an uncaught exception ends
+# the script with status 1
+cat > "$DIR/exit.js" <<'JS'
+print("before");
+return 5;
+print("after return");
+throw "uncaught";
+print("never");
+JS
+for engine in vm ast; do
+    check "exit ($engine)" "before
+after return" "Uncaught Error: uncaught" 1 "$BIN" --engine=$engine "$DIR/exit.js"
+done
+
+finish engines
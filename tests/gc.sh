@@ -0,0 +1,62 @@
+#!/bin/sh
+# With a tiny threshold the collector runs at almost every safepoint; no
+# live value may be lost, so every script must print what it prints with
+# the default settings.
+# usage: tests/gc.sh
+
+. "$(dirname "$0")/common.sh"
+
+STRESS="--gc-threshold=1 --gc-growth=1.01"
+
+cat > "$DIR/garbage.js" <<'JS'
+function make(n) {
+    let o = { id: n, name: "item" + n, tags: [n, n + 1, "t" + n] };
+    return o;
+}
+function counter() {
+    let c = 0;
+    let inc = function() { c = c + 1; return c; };
+    return inc;
+}
+let keep = [];
+let i = 0;
+let j = 100;
+let k = 0;
+let s = "";
+while (i < 2000) {
+    let o = make(i);
+    if (j == 100) { keep[k] = o; k = k + 1; j = 0; }
+    j = j + 1;
+    s = s + "x";
+    i = i + 1;
+}
+let total = 0;
+i = 0;
+while (i < 20) { total = total + keep[i].tags[0] + keep[i].tags[1]; i = i + 1; }
+print(total);
+print(keep[19].name);
+print(keep[7].tags[2]);
+let inc = counter();
+inc(); inc();
+print(inc());
+try { throw make(5); } catch (e) { print(e); }
+JS
+
+for engine in vm ast; do
+    check "garbage ($engine)" "38020
+item1900
+t700
+3
+Error: [Object]" "" 0 "$BIN" --engine=$engine $STRESS "$DIR/garbage.js"
+
+    "$BIN" --engine=$engine $STRESS --gc-stats "$DIR/garbage.js" > /dev/null 2> "$DIR/stats"
+    collections=$(sed -n 's/^GC: \([0-9]*\) collections.*/\1/p' "$DIR/stats")
+    [ "${collections:-0}" -gt 100 ] || fail "stats ($engine)" "expected over 100 collections, got '$collections'"
+
+    for f in example/*.js; do
+        run "$BIN" --engine=$engine "$f"
+        check "$f ($engine)" "$out" "$err" "$status" "$BIN" --engine=$engine $STRESS "$f"
+    done
+done
+
+finish gc
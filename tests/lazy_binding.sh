@@ -0,0 +1,85 @@
+#!/bin/sh
+# An undeclared assignment inside a function must bind the same way whether
+# its body is parsed on first call, parsed with the script, or loaded from
+# a cache entry. Each case is run in all three modes on both engines.
+# A lazy body only differs when no body resolved before it mentions the
+# global.
+# usage: tests/lazy_binding.sh
+
+BIN=${BIN:-build/mini_js}
+DIR=$(mktemp -d /tmp/lazy_binding.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+failed=0
+
+# check NAME STDOUT STDERR [LAZY_STDOUT LAZY_STDERR]: run $DIR/NAME.js and
+# compare what it prints; with --lazy, the last two are expected if given
+check() {
+    for engine in vm ast; do
+        for mode in lazy eager cache; do
+            want_out=$2 want_err=$3
+            case $mode in
+                lazy)  flags=--lazy
+                       [ $# -gt 3 ] && want_out=$4 want_err=$5 ;;
+                eager) flags= ;;
+                # The first run writes the entry, the second loads it
+                cache) flags=--cache-dir=$DIR/cache
+                       "$BIN" --engine=$engine $flags "$DIR/$1.js" > /dev/null 2>&1 ;;
+            esac
+            out=$("$BIN" --engine=$engine $flags "$DIR/$1.js" 2> "$DIR/err")
+            err=$(cat "$DIR/err")
+            if [ "$out" != "$want_out" ] || [ "$err" != "$want_err" ]; then
+                printf '%s (%s, %s): expected\n%s\n%s\ngot\n%s\n%s\n' \
+                       "$1" "$engine" "$mode" "$want_out" "$want_err" "$out" "$err"
+                failed=1
+            fi
+        done
+    done
+}
+
+# Nothing at top level assigns `counter`, so it is local to setup
+cat > "$DIR/local.js" <<'JS'
+function setup(){ counter = 5; }
+setup();
+print(counter);
+JS
+check local "" "Undefined variable: counter"
+
+# A top-level assignment makes it a global, wherever it is
+cat > "$DIR/global.js" <<'JS'
+function setup(){ counter = 5; }
+setup();
+print(counter);
+counter = 1;
+JS
+check global "5" ""
+
+# A function resolved earlier reading the name makes it a global. Lazily,
+# get's body has not been resolved when set's is, so counter is local.
+cat > "$DIR/other.js" <<'JS'
+function get(){ return counter; }
+function set(){ counter = 5; return counter; }
+print(set());
+print(get());
+JS
+check other "5
+5" "" "5" "Undefined variable: counter"
+
+# Globals a later statement reserves before a lazy body is resolved do not
+# change how it binds
+cat > "$DIR/later.js" <<'JS'
+function set(){ counter = 5; return counter; }
+function get(){ return counter; }
+print(set());
+print(get());
+JS
+check later "5" "Undefined variable: counter"
+
+# A global the same function reads first is assigned, not shadowed
+cat > "$DIR/same.js" <<'JS'
+function f(){ let seen = counter; counter = 5; return seen; }
+print(f());
+JS
+check same "" "Undefined variable: counter"
+
+[ $failed = 0 ] && echo "lazy_binding: ok"
+exit $failed
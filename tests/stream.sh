@@ -0,0 +1,30 @@
+#!/bin/sh
+# Scripts read from standard input with "-" run statement by statement as
+# the text arrives, and must print what the same file prints.
+# usage: tests/stream.sh
+
+. "$(dirname "$0")/common.sh"
+
+for f in example/*.js; do
+    for engine in vm ast; do
+        run "$BIN" --engine=$engine "$f"
+        check "$f ($engine)" "$out" "$err" "$status" sh -c '"$1" --engine=$2 - < "$3"' sh "$BIN" $engine "$f"
+    done
+done
+
+# A statement runs before the rest of the input has been written, and a
+# statement cut between two reads runs once it is complete
+{
+    printf 'print("first");\nprint("sec'
+    sleep 1
+    cat "$DIR/out" > "$DIR/seen"
+    printf 'ond");\n'
+} | "$BIN" - > "$DIR/out"
+[ "$(cat "$DIR/seen")" = "first" ] || fail "streaming" "first statement had not run before more input came"
+[ "$(cat "$DIR/out")" = "first
+second" ] || fail "streaming" "got $(cat "$DIR/out")"
+
+# Read errors end the script through the isolate, like any other error
+check "read error" "" "read: Is a directory" 1 sh -c '"$1" - < /' sh "$BIN"
+
+finish stream